@@ -0,0 +1,53 @@
+#include "aot.h"
+#include "interrupt.h"
+#include "sched.h"
+#include <stdio.h>
+
+// The cartridge header's global checksum.
+#define HEADER_CHECKSUM 0x14E
+
+// 1 if the code at pc is what the blocks were recompiled from: bank 0 at
+// 0x0000-0x3FFF, which MBC1 can swap out in its RAM banking mode, and bank
+// 1 at 0x4000-0x7FFF.
+static int romMapped(uint16_t pc)
+{
+	if(pc < AOT_BANK_SIZE)
+		return !gb->cart.rom || pageMapped(0x00) == gb->cart.rom;
+	return gb->romBank == 1;
+}
+
+int runAOT()
+{
+	const uint8_t* rom = gb->cart.rom;
+	int cycles;
+
+	// A cartridge loaded with the same ROM also brings its banks and RAM.
+	if(rom && (aotRomSize < HEADER_CHECKSUM + 2 || rom[HEADER_CHECKSUM] != aotRom[HEADER_CHECKSUM]
+		|| rom[HEADER_CHECKSUM + 1] != aotRom[HEADER_CHECKSUM + 1]))
+	{
+		fprintf(stderr, "The cartridge is not the ROM this build was recompiled from\n");
+		return 0;
+	}
+	if(!rom)
+		for(unsigned i = 0; i < aotRomSize && i < AOT_ROM_SIZE; i++)
+			writeMem(i, aotRom[i]);
+
+	CPUStateInit();
+
+	while(!halted())
+	{
+		takeInterrupt();
+		while(gb->cycles < gb->nextEvent)
+		{
+			uint16_t pc = holdPC();
+
+			if(pc < AOT_ROM_SIZE && aotBlocks[pc] && romMapped(pc))
+				cycles = aotBlocks[pc]();
+			else
+				execute(readMem(PC()), &cycles);
+			gb->cycles += cycles;
+		}
+		runEvents();
+	}
+	return 1;
+}
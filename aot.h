@@ -0,0 +1,38 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "cpu.h"
+#include "execute.h"
+#include "memory.h"
+#include <stdint.h>
+
+// Ahead-of-time recompiled ROMs (make aot ROM=game.gb).
+//
+// recomp walks the code reachable from 0x100 and the RST and interrupt
+// vectors and writes one C function per basic block to aot_rom.c. Each
+// function runs its block through the accessors in cpu.h and memory.h,
+// leaves PC at the next block and returns the cycles taken. runAOT()
+// interprets anything recomp could not find, such as code in RAM or the
+// targets of JP HL.
+//
+// Only the first 32K of the file is recompiled: bank 0, then bank 1 at
+// 0x4000. No block runs from one bank into the other, and the blocks from
+// 0x4000 up only run while bank 1 is the one mapped there, so a cartridge
+// that switches banks interprets the others.
+
+#define AOT_ROM_SIZE 0x8000
+#define AOT_BANK_SIZE 0x4000
+
+typedef int (*AotBlock)(void);
+
+// Generated: the ROM image and its blocks, indexed by start address.
+extern const uint8_t aotRom[];
+extern const unsigned aotRomSize;
+extern const AotBlock aotBlocks[AOT_ROM_SIZE];
+
+// Copies the ROM into memory, unless a cartridge is loaded, and runs it
+// from 0x100 until the CPU halts. Returns 0 after printing why to stderr
+// if the loaded cartridge is not the ROM recomp was given.
+int runAOT();
+
+#endif
@@ -0,0 +1,755 @@
+#include "apu.h"
+#include "machine.h"
+#include "sched.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cycles between steps of the frame sequencer, 512 Hz.
+#define SEQUENCER_CYCLES 8192
+
+// Register writes logged before the log is played back early.
+#define LOG_SIZE 4096
+
+// A band-limited step is KERNEL_TAPS samples long, with KERNEL_PHASES
+// versions for where between two samples it lands. Each version's taps
+// add up to 1 << KERNEL_BITS. CUTOFF is where the steps roll off, as a
+// fraction of half the sample rate.
+#define KERNEL_TAPS 16
+#define KERNEL_PHASES 32
+#define KERNEL_BITS 15
+#define CUTOFF 0.9
+#define PI 3.14159265358979323846
+
+// Samples of steps kept before they are summed: up to half of them wait,
+// and the rest leave room for a frame at up to 192 kHz.
+#define BLIP_SIZE 8192
+
+// Stereo samples the ring buffer holds. Must be a power of 2.
+#define RING_SIZE 16384
+
+// How fast the output drifts back to 0, as a shift, like the capacitor
+// on the real output does.
+#define HIGHPASS_SHIFT 9
+
+// Output per step of a channel's level times the master volume, so all
+// four channels at full volume stay inside 16 bits.
+#define AMP_SCALE 32
+
+// Offsets from 0xFF10.
+#define NR10 0x00
+#define NR50 0x14
+#define NR51 0x15
+#define NR52 0x16
+#define WAVE_RAM 0x20
+
+enum {PULSE1, PULSE2, WAVE, NOISE, CHANNELS};
+
+typedef struct {
+	uint8_t on, dac;
+	uint8_t lengthOn;
+	int length;       // Steps of the length counter left, the channel stops at 0.
+	int freq;         // The 11-bit frequency of the pulse and wave channels.
+	int period;       // Cycles between steps of the waveform, 0 if it is stopped.
+	uint64_t next;    // Cycle of the next step.
+	int position;     // Step of the duty cycle or of the wave.
+	int volume;       // Envelope volume, or the wave channel's volume code.
+	uint8_t envelope; // NRx2 as it was when the channel was triggered.
+	int envTimer;
+	uint16_t lfsr;
+	int left, right;  // What the channel adds to each side now.
+} Channel;
+
+typedef struct {
+	uint64_t cycle;
+	uint16_t address;
+	uint8_t value;
+} LoggedWrite;
+
+typedef struct Audio {
+	// The sound circuit as far as it has been synthesised, up to cycle now.
+	Channel ch[CHANNELS];
+	uint8_t regs[0x30]; // 0xFF10-0xFF3F as the synthesis has seen them.
+	uint8_t power;
+	int sequencerStep;
+	uint64_t sequencerNext;
+	int shadowFreq, sweepTimer; // Channel 1's sweep.
+	uint8_t sweepOn;
+	uint64_t now;
+
+	// Writes since then.
+	LoggedWrite log[LOG_SIZE];
+	int logged;
+
+	// Steps waiting to be summed into samples. Sample n is at cycle
+	// start + n * APU_CLOCK / rate, and blip[0] is sample emitted. heard is
+	// each channel's left and right as far as the steps go, which only
+	// falls behind while muted, when start moves on with now.
+	uint8_t muted;
+	int heard[CHANNELS][2];
+	int rate;
+	uint64_t start, emitted;
+	int32_t blip[2][BLIP_SIZE + KERNEL_TAPS];
+	int32_t sum[2];
+
+	int16_t ring[RING_SIZE][2];
+	unsigned head, tail;
+} Audio;
+
+// The part of Audio a save state holds.
+#define SAVED_SIZE (offsetof(Audio, now) + sizeof(uint64_t))
+
+_Static_assert(SAVED_SIZE <= APU_STATE_SIZE, "APU_STATE_SIZE is too small");
+
+static int16_t kernel[KERNEL_PHASES][KERNEL_TAPS];
+
+// Duty cycles, first step in the top bit.
+static const uint8_t duties[] = {0x01, 0x81, 0x87, 0x7E};
+
+static const int noiseDivisors[] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+// Bits of 0xFF10-0xFF2F that read as 1.
+static const uint8_t readMasks[0x20] = {
+	0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+	0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF, 0xFF, 0x00, 0x00, 0xBF,
+	0x00, 0x00, 0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static void apuEvent(uint64_t at);
+
+// Windowed sinc steps. The rounding left over goes on the biggest tap so
+// each version adds up exactly.
+static void makeKernel()
+{
+	for(int p = 0; p < KERNEL_PHASES; p++)
+	{
+		double taps[KERNEL_TAPS], total = 0;
+		int sum = 0, biggest = 0;
+
+		for(int k = 0; k < KERNEL_TAPS; k++)
+		{
+			double x = k - (KERNEL_TAPS / 2 - 1) - (double) p / KERNEL_PHASES;
+			double window = 0.42 + 0.5 * cos(2 * PI * x / KERNEL_TAPS) +
+				0.08 * cos(4 * PI * x / KERNEL_TAPS);
+
+			taps[k] = (x ? sin(PI * CUTOFF * x) / (PI * x) : CUTOFF) * window;
+			total += taps[k];
+		}
+		for(int k = 0; k < KERNEL_TAPS; k++)
+		{
+			kernel[p][k] = lrint(taps[k] / total * (1 << KERNEL_BITS));
+			sum += kernel[p][k];
+			if(kernel[p][k] > kernel[p][biggest])
+				biggest = k;
+		}
+		kernel[p][biggest] += (1 << KERNEL_BITS) - sum;
+	}
+}
+
+// --- Synthesis ---
+
+// The sample cycle at falls in.
+static uint64_t sampleAt(Audio* a, uint64_t at)
+{
+	return (at - a->start) * a->rate / APU_CLOCK;
+}
+
+static void emitSamples(Audio* a, uint64_t now);
+
+// Adds a step to each side at cycle at.
+static void addStep(Audio* a, uint64_t at, int left, int right)
+{
+	uint64_t t = (at - a->start) * a->rate;
+	int phase = t % APU_CLOCK * KERNEL_PHASES / APU_CLOCK;
+	int offset = t / APU_CLOCK - a->emitted;
+
+	for(int k = 0; k < KERNEL_TAPS; k++)
+	{
+		a->blip[0][offset + k] += left * kernel[phase][k];
+		a->blip[1][offset + k] += right * kernel[phase][k];
+	}
+}
+
+// What channel n outputs now, 0 to 15.
+static int channelLevel(Audio* a, int n)
+{
+	Channel* c = &a->ch[n];
+
+	if(!c->on)
+		return 0;
+	switch(n)
+	{
+		case PULSE1: case PULSE2:
+		{
+			uint8_t duty = duties[a->regs[n * 5 + 1] >> 6];
+
+			return duty >> (7 - c->position) & 1 ? c->volume : 0;
+		}
+		case WAVE:
+		{
+			uint8_t byte = a->regs[WAVE_RAM + c->position / 2];
+			int sample = c->position & 1 ? byte & 0xF : byte >> 4;
+
+			return c->volume ? sample >> (c->volume - 1) : 0;
+		}
+		default:
+			return c->lfsr & 1 ? 0 : c->volume;
+	}
+}
+
+// Steps the output to what channel n adds to it now, at cycle at.
+static void hearLevel(Audio* a, int n, uint64_t at)
+{
+	Channel* c = &a->ch[n];
+	int* heard = a->heard[n];
+
+	if(c->left == heard[0] && c->right == heard[1])
+		return;
+	addStep(a, at, c->left - heard[0], c->right - heard[1]);
+	heard[0] = c->left;
+	heard[1] = c->right;
+}
+
+// Works out what channel n adds to each side again, at cycle at.
+static void updateLevel(Audio* a, int n, uint64_t at)
+{
+	Channel* c = &a->ch[n];
+	int level = channelLevel(a, n) * AMP_SCALE;
+	uint8_t panning = a->regs[NR51], master = a->regs[NR50];
+	int left = panning >> (n + 4) & 1 ? level * ((master >> 4 & 7) + 1) : 0;
+	int right = panning >> n & 1 ? level * ((master & 7) + 1) : 0;
+
+	c->left = left;
+	c->right = right;
+	if(!a->muted)
+		hearLevel(a, n, at);
+}
+
+// Steps channel n's waveform up to cycle to.
+static void runChannel(Audio* a, int n, uint64_t to)
+{
+	Channel* c = &a->ch[n];
+
+	if(!c->on)
+		return;
+	// Noise with the clock shifted past 13 stands still.
+	if(!c->period)
+	{
+		c->next = to;
+		return;
+	}
+	while(c->next <= to)
+	{
+		if(n == NOISE)
+		{
+			int bit = (c->lfsr ^ c->lfsr >> 1) & 1;
+
+			c->lfsr = c->lfsr >> 1 | bit << 14;
+			if(a->regs[n * 5 + 3] & 8)
+				c->lfsr = (c->lfsr & ~0x40) | bit << 6;
+		}
+		else
+			c->position = (c->position + 1) & (n == WAVE ? 31 : 7);
+		updateLevel(a, n, c->next);
+		c->next += c->period;
+	}
+}
+
+static void setFreq(Audio* a, int n, int freq)
+{
+	a->ch[n].freq = freq;
+	a->ch[n].period = (2048 - freq) * (n == WAVE ? 2 : 4);
+}
+
+// Channel 1's next frequency from its sweep. Going past 2047 stops it.
+static int sweepFreq(Audio* a)
+{
+	uint8_t nr10 = a->regs[NR10];
+	int delta = a->shadowFreq >> (nr10 & 7);
+	int freq = nr10 & 8 ? a->shadowFreq - delta : a->shadowFreq + delta;
+
+	if(freq > 2047)
+		a->ch[PULSE1].on = 0;
+	return freq;
+}
+
+static void clockSweep(Audio* a, uint64_t at)
+{
+	uint8_t nr10 = a->regs[NR10];
+	int period = nr10 >> 4 & 7, freq;
+
+	if(--a->sweepTimer > 0)
+		return;
+	a->sweepTimer = period ? period : 8;
+	if(!a->sweepOn || !period)
+		return;
+
+	freq = sweepFreq(a);
+	if(freq <= 2047 && (nr10 & 7))
+	{
+		a->shadowFreq = freq;
+		setFreq(a, PULSE1, freq);
+		sweepFreq(a);
+	}
+	updateLevel(a, PULSE1, at);
+}
+
+static void clockLength(Audio* a, int n, uint64_t at)
+{
+	Channel* c = &a->ch[n];
+
+	if(c->lengthOn && c->length && !--c->length)
+	{
+		c->on = 0;
+		updateLevel(a, n, at);
+	}
+}
+
+static void clockEnvelope(Audio* a, int n, uint64_t at)
+{
+	Channel* c = &a->ch[n];
+	int period = c->envelope & 7;
+
+	if(!period || --c->envTimer > 0)
+		return;
+	c->envTimer = period;
+	if(c->envelope & 8 && c->volume < 15)
+		c->volume++;
+	else if(!(c->envelope & 8) && c->volume > 0)
+		c->volume--;
+	else
+		return;
+	updateLevel(a, n, at);
+}
+
+// Length counters on even steps, the sweep on 2 and 6 and envelopes on 7.
+static void clockSequencer(Audio* a, uint64_t at)
+{
+	int step = a->sequencerStep;
+
+	a->sequencerStep = (step + 1) & 7;
+	if(!(step & 1))
+		for(int n = 0; n < CHANNELS; n++)
+			clockLength(a, n, at);
+	if(step == 2 || step == 6)
+		clockSweep(a, at);
+	if(step == 7)
+	{
+		clockEnvelope(a, PULSE1, at);
+		clockEnvelope(a, PULSE2, at);
+		clockEnvelope(a, NOISE, at);
+	}
+}
+
+// Runs the channels and the frame sequencer up to cycle to. Goes a frame
+// at a time, summing the steps into samples when enough are waiting, so
+// they always fit in blip.
+static void synthesise(Audio* a, uint64_t to)
+{
+	while(a->now < to)
+	{
+		uint64_t end = to - a->now > FRAME_CYCLES ? a->now + FRAME_CYCLES : to;
+
+		while(a->power && a->sequencerNext <= end)
+		{
+			for(int n = 0; n < CHANNELS; n++)
+				runChannel(a, n, a->sequencerNext);
+			clockSequencer(a, a->sequencerNext);
+			a->sequencerNext += SEQUENCER_CYCLES;
+		}
+		for(int n = 0; n < CHANNELS; n++)
+			runChannel(a, n, end);
+		if(a->muted)
+			a->start += end - a->now;
+		a->now = end;
+		if(sampleAt(a, end) - a->emitted > BLIP_SIZE / 2)
+			emitSamples(a, end);
+	}
+}
+
+static void trigger(Audio* a, int n, uint64_t at)
+{
+	Channel* c = &a->ch[n];
+	uint8_t nrx2 = a->regs[n * 5 + 2];
+
+	c->on = c->dac;
+	if(!c->length)
+		c->length = n == WAVE ? 256 : 64;
+	c->next = at + c->period;
+	if(n == WAVE)
+		c->position = 0;
+	else
+	{
+		c->envelope = nrx2;
+		c->volume = nrx2 >> 4;
+		c->envTimer = nrx2 & 7;
+	}
+	if(n == NOISE)
+		c->lfsr = 0x7FFF;
+	if(n == PULSE1)
+	{
+		uint8_t nr10 = a->regs[NR10];
+
+		a->shadowFreq = c->freq;
+		a->sweepTimer = nr10 >> 4 & 7 ? nr10 >> 4 & 7 : 8;
+		a->sweepOn = (nr10 & 0x77) != 0;
+		if(nr10 & 7)
+			sweepFreq(a);
+	}
+	updateLevel(a, n, at);
+}
+
+static void setDac(Audio* a, int n, int on, uint64_t at)
+{
+	a->ch[n].dac = on != 0;
+	if(!on)
+		a->ch[n].on = 0;
+	updateLevel(a, n, at);
+}
+
+// Turning the circuit off silences and clears everything but wave RAM.
+static void setPower(Audio* a, int on, uint64_t at)
+{
+	if(on == a->power)
+		return;
+	a->power = on;
+	if(on)
+	{
+		a->sequencerStep = 0;
+		a->sequencerNext = at + SEQUENCER_CYCLES;
+		return;
+	}
+
+	memset(a->regs, 0, NR52);
+	for(int n = 0; n < CHANNELS; n++)
+	{
+		a->ch[n].on = 0;
+		updateLevel(a, n, at);
+		memset(&a->ch[n], 0, sizeof(Channel));
+	}
+}
+
+// Channel registers are five to a channel from 0xFF10.
+static void applyWrite(Audio* a, uint16_t address, uint8_t value, uint64_t at)
+{
+	int r = address - 0xFF10, n = r / 5;
+	Channel* c;
+
+	if(r == NR52)
+	{
+		setPower(a, value >> 7, at);
+		return;
+	}
+	a->regs[r] = value;
+	if(r >= WAVE_RAM)
+	{
+		updateLevel(a, WAVE, at);
+		return;
+	}
+	if(r == NR50 || r == NR51)
+	{
+		for(n = 0; n < CHANNELS; n++)
+			updateLevel(a, n, at);
+		return;
+	}
+	if(r > NR51)
+		return;
+
+	c = &a->ch[n];
+	switch(r % 5)
+	{
+		case 0:
+			if(n == WAVE)
+				setDac(a, n, value & 0x80, at);
+			break;
+		case 1:
+			c->length = n == WAVE ? 256 - value : 64 - (value & 0x3F);
+			if(n <= PULSE2)
+				updateLevel(a, n, at);
+			break;
+		case 2:
+			if(n != WAVE)
+				setDac(a, n, value & 0xF8, at);
+			else
+			{
+				c->volume = value >> 5 & 3;
+				updateLevel(a, n, at);
+			}
+			break;
+		case 3:
+			if(n == NOISE)
+				c->period = value >> 4 < 14 ? noiseDivisors[value & 7] << (value >> 4) : 0;
+			else
+				setFreq(a, n, (c->freq & 0x700) | value);
+			break;
+		case 4:
+			if(n != NOISE)
+				setFreq(a, n, (c->freq & 0xFF) | (value & 7) << 8);
+			c->lengthOn = value >> 6 & 1;
+			if(value & 0x80)
+				trigger(a, n, at);
+			break;
+	}
+}
+
+// Sums the steps up to cycle now into samples for the ring buffer, and
+// moves what is left of the steps down.
+static void emitSamples(Audio* a, uint64_t now)
+{
+	uint64_t end = sampleAt(a, now);
+	int count = end - a->emitted;
+
+	for(int i = 0; i < count; i++)
+	{
+		int16_t* out = a->ring[a->head++ % RING_SIZE];
+
+		if(a->head - a->tail > RING_SIZE)
+			a->tail++;
+		for(int side = 0; side < 2; side++)
+		{
+			int32_t sample;
+
+			a->sum[side] += a->blip[side][i];
+			sample = a->sum[side] >> KERNEL_BITS;
+			out[side] = sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample;
+			a->sum[side] -= a->sum[side] >> HIGHPASS_SHIFT;
+		}
+	}
+
+	for(int side = 0; side < 2; side++)
+	{
+		memmove(a->blip[side], a->blip[side] + count, KERNEL_TAPS * sizeof(int32_t));
+		memset(a->blip[side] + KERNEL_TAPS, 0, count * sizeof(int32_t));
+	}
+	a->emitted = end;
+}
+
+// Plays the log back and synthesises up to cycle now.
+static void playLog(Audio* a, uint64_t now)
+{
+	for(int i = 0; i < a->logged; i++)
+	{
+		LoggedWrite* w = &a->log[i];
+
+		synthesise(a, w->cycle);
+		applyWrite(a, w->address, w->value, w->cycle > a->now ? w->cycle : a->now);
+	}
+	a->logged = 0;
+	synthesise(a, now);
+	emitSamples(a, a->now);
+}
+
+// Writes are only logged by the time the run loop gets to the event, so
+// it plays up to then. It comes round again while a channel is playing.
+static void apuEvent(uint64_t at)
+{
+	Audio* a = gb->audio;
+
+	playLog(a, gb->cycles);
+	for(int n = 0; n < CHANNELS; n++)
+		if(a->ch[n].on)
+		{
+			scheduleEvent(EVENT_APU, at + FRAME_CYCLES, apuEvent);
+			return;
+		}
+}
+
+// --- Setup and registers ---
+
+void apuInit()
+{
+	static int kernelMade;
+
+	if(!kernelMade)
+	{
+		makeKernel();
+		kernelMade = 1;
+	}
+	gb->audio = (Audio*) calloc(1, sizeof(Audio));
+	gb->audio->rate = 48000;
+}
+
+void apuFree()
+{
+	free(gb->audio);
+	gb->audio = 0;
+}
+
+void apuReset()
+{
+	Audio* a = gb->audio;
+	int rate = a->rate;
+
+	memset(a, 0, sizeof(Audio));
+	a->rate = rate;
+	a->start = a->now = gb->cycles;
+	a->power = 1;
+	a->sequencerNext = gb->cycles + SEQUENCER_CYCLES;
+	a->regs[NR50] = 0x77;
+	a->regs[NR51] = 0xF3;
+	memcpy(a->regs + WAVE_RAM, gb->memory + 0xFF30, 16);
+
+	memset(gb->memory + 0xFF10, 0, 0x20);
+	gb->memory[0xFF24] = 0x77;
+	gb->memory[0xFF25] = 0xF3;
+	gb->memory[0xFF26] = 0x80;
+}
+
+void apuSetRate(int rate)
+{
+	Audio* a = gb->audio;
+
+	apuUpdate();
+	a->rate = rate < 8000 ? 8000 : rate > 192000 ? 192000 : rate;
+	a->start = a->now;
+	a->emitted = 0;
+	a->head = a->tail = 0;
+	memset(a->blip, 0, sizeof(a->blip));
+	memset(a->sum, 0, sizeof(a->sum));
+}
+
+void apuUpdate()
+{
+	playLog(gb->audio, gb->cycles);
+}
+
+void apuSave(uint8_t* state)
+{
+	apuUpdate();
+	memcpy(state, gb->audio, SAVED_SIZE);
+	memset(state + SAVED_SIZE, 0, APU_STATE_SIZE - SAVED_SIZE);
+}
+
+void apuLoad(const uint8_t* state)
+{
+	Audio* a = gb->audio;
+	uint64_t now = a->now;
+
+	memcpy(a, state, SAVED_SIZE);
+	a->logged = 0;
+
+	// Sample times are kept where they were, relative to the new cycles.
+	a->start += a->now - now;
+	for(int n = 0; n < CHANNELS && !a->muted; n++)
+		hearLevel(a, n, a->now);
+	restoreEvent(EVENT_APU, apuEvent);
+}
+
+void apuMute(int muted)
+{
+	Audio* a = gb->audio;
+
+	apuUpdate();
+	a->muted = muted;
+	for(int n = 0; n < CHANNELS && !muted; n++)
+		hearLevel(a, n, a->now);
+}
+
+int apuReadSamples(int16_t* samples, int count)
+{
+	Audio* a = gb->audio;
+	int n = 0;
+
+	apuUpdate();
+	for(; n < count && a->tail != a->head; n++, a->tail++)
+	{
+		samples[2 * n] = a->ring[a->tail % RING_SIZE][0];
+		samples[2 * n + 1] = a->ring[a->tail % RING_SIZE][1];
+	}
+	return n;
+}
+
+uint8_t apuRead(uint16_t address)
+{
+	if(address == 0xFF26)
+	{
+		uint8_t status = gb->memory[address] | readMasks[NR52];
+
+		apuUpdate();
+		for(int n = 0; n < CHANNELS; n++)
+			if(gb->audio->ch[n].on)
+				status |= 1 << n;
+		return status;
+	}
+	if(address >= 0xFF30)
+		return gb->memory[address];
+	return gb->memory[address] | readMasks[address - 0xFF10];
+}
+
+// While the circuit is off only NR52 and wave RAM take writes.
+void apuWrite(uint16_t address, uint8_t value)
+{
+	Audio* a = gb->audio;
+
+	if(address < 0xFF30 && address != 0xFF26 && !(gb->memory[0xFF26] & 0x80))
+		return;
+	if(address == 0xFF26)
+	{
+		value &= 0x80;
+		if(!value)
+			memset(gb->memory + 0xFF10, 0, NR52);
+	}
+	gb->memory[address] = value;
+
+	if(a->logged == LOG_SIZE)
+		apuUpdate();
+	a->log[a->logged].cycle = gb->cycles;
+	a->log[a->logged].address = address;
+	a->log[a->logged].value = value;
+	a->logged++;
+	if(gb->eventAt[EVENT_APU] == EVENT_NEVER)
+		scheduleEvent(EVENT_APU, gb->cycles + FRAME_CYCLES, apuEvent);
+}
+
+// --- WAV files ---
+
+static void put16(FILE* file, int value)
+{
+	fputc(value & 0xFF, file);
+	fputc(value >> 8 & 0xFF, file);
+}
+
+static void put32(FILE* file, uint32_t value)
+{
+	put16(file, value & 0xFFFF);
+	put16(file, value >> 16);
+}
+
+// The sizes are left 0 until wavClose().
+FILE* wavOpen(const char* path, int rate)
+{
+	FILE* file = fopen(path, "wb");
+
+	if(!file)
+		return 0;
+	fputs("RIFF", file);
+	put32(file, 0);
+	fputs("WAVEfmt ", file);
+	put32(file, 16);
+	put16(file, 1); // PCM
+	put16(file, 2);
+	put32(file, rate);
+	put32(file, rate * 4);
+	put16(file, 4);
+	put16(file, 16);
+	fputs("data", file);
+	put32(file, 0);
+	return file;
+}
+
+void wavWrite(FILE* file, const int16_t* samples, int count)
+{
+	for(int i = 0; i < 2 * count; i++)
+		put16(file, samples[i]);
+}
+
+void wavClose(FILE* file)
+{
+	long size = ftell(file);
+
+	fseek(file, 4, SEEK_SET);
+	put32(file, size - 8);
+	fseek(file, 40, SEEK_SET);
+	put32(file, size - 44);
+	fclose(file);
+}
@@ -0,0 +1,68 @@
+#ifndef APU_H
+#define APU_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The sound hardware: two pulse channels, the wave channel, the noise
+// channel and the frame sequencer that clocks their length counters,
+// envelopes and sweep. Nothing runs alongside the CPU. Register writes
+// are logged with the cycle they happened at, and EVENT_APU plays the log
+// back a frame after the first of them, synthesising the frame's audio in
+// one go. It comes round every frame while a channel is on. Silence is
+// only worked out when it is read.
+//
+// Channels are not stepped cycle by cycle. Each jumps from one change of
+// its output to the next, and every change is added to the output as a
+// band-limited step at the host's sample rate, which also does the
+// resampling. Samples come out 16-bit stereo into a ring buffer.
+
+// The CPU's clock, which the channels count in.
+#define APU_CLOCK 4194304
+
+// Allocates the APU's buffers, for memInit(), and frees them.
+void apuInit();
+void apuFree();
+
+// Power on: the sound circuit on with every channel off, and the ring
+// buffer emptied.
+void apuReset();
+
+// Sets the host's sample rate, 48000 until then. Drops anything queued.
+void apuSetRate(int rate);
+
+// Synthesises up to gb->cycles, so the ring buffer is up to date before
+// the end of the frame.
+void apuUpdate();
+
+// Takes up to count stereo samples out of the ring buffer, left then
+// right, after bringing it up to date. Returns how many it took.
+int apuReadSamples(int16_t* samples, int count);
+
+// Bytes the sound circuit takes in a save state. The samples waiting to
+// be read are not part of it.
+#define APU_STATE_SIZE 512
+
+// Saves the sound circuit into state, after synthesising up to gb->cycles.
+void apuSave(uint8_t* state);
+
+// Loads it, carrying on the output from where it is, with a step from what
+// the channels were playing to what they play now. Call apuUpdate() before
+// the rest of the machine is loaded.
+void apuLoad(const uint8_t* state);
+
+// Mutes the output, or unmutes it. The channels run on while it is muted,
+// but nothing they play is added to the samples and the samples' time
+// stands still. Unmuting steps to what the channels play by then.
+void apuMute(int muted);
+
+// Reads and writes 0xFF10-0xFF3F.
+uint8_t apuRead(uint16_t address);
+void apuWrite(uint16_t address, uint8_t value);
+
+// Writes 16-bit stereo WAV files, for headless runs.
+FILE* wavOpen(const char* path, int rate);
+void wavWrite(FILE* file, const int16_t* samples, int count);
+void wavClose(FILE* file);
+
+#endif
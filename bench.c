@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "apu.h"
+#include "cpu.h"
+#include "joypad.h"
+#include "memory.h"
+#include "movie.h"
+#include "output.h"
+#include "ppu.h"
+#include "render.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "state.h"
+
+// Nested loop over a mix of loads, ALU ops and branches.
+//
+//       LD B, 0
+// outer: LD C, 0
+// inner: INC A
+//       ADD A, B
+//       XOR C
+//       LD HL, 0xC000
+//       LD (HL), A
+//       DEC C
+//       JR NZ, inner
+//       DEC B
+//       JR NZ, outer
+//       STOP
+static uint8_t program[] = {
+	0x06, 0x00, 0x0E, 0x00, 0x3C, 0x80, 0xA9, 0x21, 0x00, 0xC0, 0x77,
+	0x0D, 0x20, 0xF6, 0x05, 0x20, 0xF1, 0x10, 0x00
+};
+
+// Instructions executed by one run of program.
+#define PROGRAM_INSTRS (256 * 256 * 7 + 256 * 3 + 2)
+
+#define RUNS 200
+
+// Keeps the LCD busy: scrolls every iteration and rewrites VRAM as it goes.
+//
+//       LD HL, 0x8000
+// loop: LD (HL+), A
+//       RES 5, H
+//       INC A
+//       LDH (0x43), A
+//       JR loop
+static uint8_t lcdProgram[] = {
+	0x21, 0x00, 0x80, 0x22, 0xCB, 0xAC, 0x3C, 0xE0, 0x43, 0x18, 0xF8
+};
+
+#define FRAMES 600
+
+// Frames put through each stage of output.
+#define OUTPUT_FRAMES 2000
+
+// Save states taken and loaded, each.
+#define STATE_RUNS 20000
+
+// Memory for rewinding, a keyframe a second, and frames gone back to.
+#define REWIND_BUDGET (64 << 20)
+#define REWIND_KEY_INTERVAL 60
+#define REWIND_SEEKS 100
+
+// Frames run ahead, up to.
+#define MAX_AHEAD 4
+
+// State hashes taken, each way.
+#define HASH_RUNS 2000
+
+// Frames between the hashes of the movies replayed, for each run.
+static const int movieIntervals[] = {1, 60};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchCPU()
+{
+	for(int i = 0; i < sizeof(program); i++)
+		writeMem(0x100 + i, program[i]);
+
+	double start = now();
+	for(int i = 0; i < RUNS; i++)
+		CPU();
+	double elapsed = now() - start;
+
+	double instrs = (double) PROGRAM_INSTRS * RUNS;
+	printf("%s: %.0f instructions in %.3f s, %.1f MIPS\n",
+#if defined(JIT)
+		"jit",
+#elif defined(BLOCK_CACHE)
+		"block cache",
+#elif defined(THREADED_DISPATCH)
+		"threaded dispatch",
+#else
+		"switch dispatch",
+#endif
+		instrs, elapsed, instrs / elapsed / 1e6);
+}
+
+// Frames per second drawn on the CPU's thread or on the render thread, or
+// with drawing skipped under policy.
+static void benchRender(const char* name, int threaded, int policy)
+{
+	for(int i = 0; i < sizeof(lcdProgram); i++)
+		writeMem(0x100 + i, lcdProgram[i]);
+	writeMem(0xFF47, 0xE4);
+	writeMem(0xFF40, 0x91);
+	if(threaded)
+		startRenderThread();
+	ppuSetRenderPolicy(policy, 0);
+	CPUStateInit();
+
+	double start = now();
+	for(int i = 0; i < FRAMES; i++)
+		runFrame();
+	ppuFrame();
+	double elapsed = now() - start;
+
+	stopRenderThread();
+	ppuSetRenderPolicy(RENDER_ALWAYS, 0);
+	writeMem(0xFF40, 0x00);
+	printf("%s: %d frames in %.3f s, %.0f fps\n", name, FRAMES, elapsed, FRAMES / elapsed);
+}
+
+// Frames per second through each stage of output, with each level of
+// kernels the CPU has.
+static void benchOutput()
+{
+	static const char* names[] = {"scalar", "sse2", "avx2"};
+	static uint8_t shades[SCREEN_WIDTH * SCREEN_HEIGHT];
+	static uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT], scaled[16 * SCREEN_WIDTH * SCREEN_HEIGHT];
+	int best = outputSetLevel(OUTPUT_AVX2);
+
+	for(int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+		shades[i] = (i / 7 + i / SCREEN_WIDTH / 5) % 4;
+
+	for(int level = OUTPUT_SCALAR; level <= best; level++)
+	{
+		double fps[5];
+
+		outputSetLevel(level);
+		for(int stage = 0; stage < 5; stage++)
+		{
+			double start = now();
+
+			for(int i = 0; i < OUTPUT_FRAMES; i++)
+				if(stage == 0)
+					outputConvert(shades, pixels, SCREEN_WIDTH * SCREEN_HEIGHT, outputGreys);
+				else if(stage < 4)
+					outputScale(pixels, SCREEN_WIDTH, SCREEN_HEIGHT, stage + 1, scaled);
+				else
+					outputScale2x(pixels, SCREEN_WIDTH, SCREEN_HEIGHT, scaled);
+			fps[stage] = OUTPUT_FRAMES / (now() - start);
+		}
+		printf("output %s: convert %.0f, 2x %.0f, 3x %.0f, 4x %.0f, scale2x %.0f fps\n",
+			names[level], fps[0], fps[1], fps[2], fps[3], fps[4]);
+	}
+	outputSetLevel(best);
+}
+
+// Frames per second with all four channels playing, most of it spent
+// synthesising, with the samples taken every frame.
+static void benchAudio()
+{
+	static const uint8_t regs[][2] = {
+		{0x25, 0xFF}, {0x11, 0x80}, {0x12, 0xF3}, {0x13, 0x00}, {0x14, 0x87},
+		{0x16, 0x40}, {0x17, 0xA0}, {0x18, 0x00}, {0x19, 0x86},
+		{0x1A, 0x80}, {0x1C, 0x20}, {0x1D, 0x00}, {0x1E, 0x87},
+		{0x21, 0xF0}, {0x22, 0x21}, {0x23, 0x80}
+	};
+	static int16_t samples[2 * 4096];
+
+	writeMem(0x100, 0x18);
+	writeMem(0x101, 0xFE);
+	for(int i = 0; i < 16; i++)
+		writeMem(0xFF30 + i, i * 0x11);
+	CPUStateInit();
+	for(int i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+		writeMem(0xFF00 + regs[i][0], regs[i][1]);
+
+	double start = now();
+	for(int i = 0; i < FRAMES; i++)
+	{
+		runFrame();
+		apuReadSamples(samples, 4096);
+	}
+	double elapsed = now() - start;
+
+	printf("audio: %d frames in %.3f s, %.0f fps\n", FRAMES, elapsed, FRAMES / elapsed);
+}
+
+// Microseconds to save and to load a state of the machine benchAudio()
+// left playing, against a plain copy of the same size.
+static void benchState()
+{
+	static uint8_t state[1 << 17], copy[1 << 17];
+	size_t size = stateSize();
+
+	runFrame();
+	double start = now();
+	for(int i = 0; i < STATE_RUNS; i++)
+		stateSave(state, size);
+	double saving = now() - start;
+
+	start = now();
+	for(int i = 0; i < STATE_RUNS; i++)
+		stateLoad(state, size);
+	double loading = now() - start;
+
+	start = now();
+	for(int i = 0; i < STATE_RUNS; i++)
+	{
+		memcpy(copy, state, size);
+		__asm__ volatile("" : : "r"(copy) : "memory");
+	}
+	double copying = now() - start;
+
+	printf("state: %zu bytes, save %.2f us, load %.2f us, memcpy %.2f us\n", size,
+		saving * 1e6 / STATE_RUNS, loading * 1e6 / STATE_RUNS, copying * 1e6 / STATE_RUNS);
+}
+
+// Frames per second drawing with every frame kept for rewinding, what
+// they take packed, and how long going back a frame takes.
+static void benchRewind()
+{
+	for(int i = 0; i < sizeof(lcdProgram); i++)
+		writeMem(0x100 + i, lcdProgram[i]);
+	writeMem(0xFF47, 0xE4);
+	writeMem(0xFF40, 0x91);
+	CPUStateInit();
+	rewindStart(REWIND_BUDGET, REWIND_KEY_INTERVAL);
+
+	double start = now();
+	for(int i = 0; i < FRAMES; i++)
+	{
+		runFrame();
+		rewindCapture();
+	}
+	int held = rewindFrames();
+	double elapsed = now() - start;
+	double perFrame = (double) rewindStored() / held;
+
+	start = now();
+	for(int i = 0; i < REWIND_SEEKS; i++)
+		rewindSeek(1);
+	double seeking = now() - start;
+
+	rewindStop();
+	writeMem(0xFF40, 0x00);
+	printf("rewind: %d frames in %.3f s, %.0f fps, %.0f bytes a frame (%.0f minutes in %d MiB), seek %.1f us\n",
+		FRAMES, elapsed, FRAMES / elapsed, perFrame, REWIND_BUDGET / perFrame / 3600, REWIND_BUDGET >> 20,
+		seeking * 1e6 / REWIND_SEEKS);
+}
+
+// Frames per second drawing with 0 to MAX_AHEAD frames run ahead, and
+// what running ahead adds to each frame.
+static void benchRunAhead()
+{
+	double base = 0;
+
+	for(int i = 0; i < sizeof(lcdProgram); i++)
+		writeMem(0x100 + i, lcdProgram[i]);
+	writeMem(0xFF47, 0xE4);
+	writeMem(0xFF40, 0x91);
+	for(int ahead = 0; ahead <= MAX_AHEAD; ahead++)
+	{
+		CPUStateInit();
+
+		double start = now();
+		for(int i = 0; i < FRAMES; i++)
+			runAhead(ahead);
+		double elapsed = now() - start;
+
+		if(!ahead)
+			base = elapsed;
+		printf("run ahead %d: %d frames in %.3f s, %.0f fps, %.0f us a frame more\n", ahead,
+			FRAMES, elapsed, FRAMES / elapsed, (elapsed - base) * 1e6 / FRAMES);
+	}
+	writeMem(0xFF40, 0x00);
+}
+
+// Microseconds to hash the state after a frame of drawing, hashing only
+// the pages the frame wrote against hashing them all.
+static void benchHash()
+{
+	double taken[2];
+
+	for(int i = 0; i < sizeof(lcdProgram); i++)
+		writeMem(0x100 + i, lcdProgram[i]);
+	writeMem(0xFF47, 0xE4);
+	writeMem(0xFF40, 0x91);
+	CPUStateInit();
+	for(int full = 0; full < 2; full++)
+	{
+		taken[full] = 0;
+		for(int i = 0; i < HASH_RUNS; i++)
+		{
+			runFrame();
+			if(full)
+				dirtyAll();
+
+			double start = now();
+			stateHash();
+			taken[full] += now() - start;
+		}
+	}
+	writeMem(0xFF40, 0x00);
+	printf("state hash: %.2f us a frame, %.2f us hashing every page\n",
+		taken[0] * 1e6 / HASH_RUNS, taken[1] * 1e6 / HASH_RUNS);
+}
+
+// Frames per second replaying a movie without drawing, checking a hash
+// every frame and once a second, against running the same frames plainly.
+static void benchMovie()
+{
+	for(int i = 0; i < sizeof(lcdProgram); i++)
+		writeMem(0x100 + i, lcdProgram[i]);
+	writeMem(0xFF47, 0xE4);
+	writeMem(0xFF40, 0x91);
+	ppuSetRenderPolicy(RENDER_ON_DEMAND, 0);
+	CPUStateInit();
+
+	double start = now();
+	for(int i = 0; i < FRAMES; i++)
+		runFrame();
+	double plain = now() - start;
+	printf("movie: plain %.0f fps", FRAMES / plain);
+
+	for(int i = 0; i < sizeof(movieIntervals) / sizeof(int); i++)
+	{
+		CPUStateInit();
+		movieRecord(movieIntervals[i]);
+		for(int frame = 0; frame < FRAMES; frame++)
+			movieRunFrame(frame & 0x10 ? JOYPAD_A : 0);
+
+		start = now();
+		movieReplay();
+		double elapsed = now() - start;
+		printf(", replay hashing every %d %.0f fps", movieIntervals[i], FRAMES / elapsed);
+	}
+	printf("\n");
+	movieStop();
+	ppuSetRenderPolicy(RENDER_ALWAYS, 0);
+	writeMem(0xFF40, 0x00);
+}
+
+int main()
+{
+	memInit();
+	benchCPU();
+	benchRender("render inline", 0, RENDER_ALWAYS);
+	benchRender("render thread", 1, RENDER_ALWAYS);
+	benchRender("render skipped", 0, RENDER_ON_DEMAND);
+	benchOutput();
+	benchAudio();
+	benchState();
+	benchRewind();
+	benchRunAhead();
+	benchHash();
+	benchMovie();
+	memFree();
+	return 0;
+}
@@ -0,0 +1,201 @@
+#include "block.h"
+#include "cpu.h"
+#include "memory.h"
+#include "jit.h"
+#include "opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Identifies the code at pc: the address plus, in the switchable ROM
+// window, the bank mapped there.
+static uint32_t blockKey(uint16_t pc)
+{
+	uint32_t bank = (pc >= 0x4000 && pc < 0x8000) ? gb->romBank : 0;
+	return (bank << 16) | pc;
+}
+
+// The address just past the block's last instruction.
+static uint16_t blockEnd(const Block* block)
+{
+	return block->ops[block->count - 1].next;
+}
+
+// 1 if the block's bytes overlap the size bytes from address.
+static int overlaps(const Block* block, uint16_t address, int size)
+{
+	uint16_t start = block->key;
+
+	return (uint16_t) (start - address) < size || (uint16_t) (address - start) < (uint16_t) (blockEnd(block) - start);
+}
+
+static void markCode(uint16_t address)
+{
+	int page = address >> 8;
+
+	gb->codeMap[page][(address & 0xFF) >> 3] |= 1 << (address & 7);
+	gb->codePages[page] = 1;
+	watchPage(page);
+}
+
+// Drops every block overlapping the size bytes from address. Returns 1 if
+// there were any.
+static int dropBlocks(uint16_t address, int size)
+{
+	int dropped = 0;
+
+	if(!gb->blocks)
+		return 0;
+
+	for(int i = 0; i < BLOCK_CACHE_SIZE; i++)
+	{
+		Block* block = &gb->blocks->blocks[i];
+
+		if(block->key != BLOCK_EMPTY && overlaps(block, address, size))
+		{
+			block->key = BLOCK_EMPTY;
+			block->code = 0;
+			dropped = 1;
+		}
+	}
+	return dropped;
+}
+
+// Decodes the straight-line run starting at pc into block.
+static void decodeBlock(Block* block, uint16_t pc)
+{
+	block->cycles = 0;
+	block->count = 0;
+	block->hits = 0;
+	block->code = 0;
+
+	while(block->count < BLOCK_MAX_OPS)
+	{
+		uint32_t bytes = fetchInstruction(pc);
+		uint8_t opcode = bytes;
+		const OpcodeInfo* info = opcode == 0xCB ?
+			&cbOpcodeInfo[(bytes >> 8) & 0xFF] : &opcodeInfo[opcode];
+		MicroOp* op = &block->ops[block->count++];
+
+		// An EI needs the instruction after it in the same block.
+		if(info->kind == KIND_EI && block->count == BLOCK_MAX_OPS && block->count > 1)
+		{
+			block->count--;
+			break;
+		}
+
+		op->opcode = opcode;
+		op->cycles = info->cycles;
+		op->next = pc + info->length;
+
+		if(info->length == 3)
+			op->imm = bytes >> 8;
+		else if(info->length == 2)
+			op->imm = (bytes >> 8) & 0xFF;
+		else
+			op->imm = 0;
+
+		block->cycles += op->cycles;
+
+		for(int i = 0; i < info->length; i++)
+			markCode(pc + i);
+
+		pc = op->next;
+
+		// The interrupt EI lets in comes after the next instruction, so
+		// the run loop has to see the event then.
+		if(endsBlock(info) || (block->count > 1 && opcodeInfo[block->ops[block->count - 2].opcode].kind == KIND_EI))
+			break;
+	}
+}
+
+Block* findBlock(uint16_t pc)
+{
+	uint32_t key = blockKey(pc);
+	Block* block;
+
+	if(!gb->blocks)
+	{
+		gb->blocks = (BlockCache*) calloc(1, sizeof(BlockCache));
+		flushBlocks();
+	}
+
+	block = &gb->blocks->blocks[(pc ^ (key >> 11)) & (BLOCK_CACHE_SIZE - 1)];
+	if(block->key != key)
+	{
+		decodeBlock(block, pc);
+		block->key = key;
+	}
+
+	return block;
+}
+
+void flushBlocks()
+{
+	if(gb->blocks)
+	{
+		for(int i = 0; i < BLOCK_CACHE_SIZE; i++)
+			gb->blocks->blocks[i].key = BLOCK_EMPTY;
+		gb->blocks->codeUsed = 0;
+	}
+
+	memset(gb->codePages, 0, sizeof(gb->codePages));
+	memset(gb->codeMap, 0, sizeof(gb->codeMap));
+	unwatchPages();
+}
+
+void freeBlocks()
+{
+	if(!gb->blocks)
+		return;
+
+#ifdef JIT
+	jitFree(gb->blocks);
+#endif
+	free(gb->blocks);
+	gb->blocks = 0;
+}
+
+// Only the blocks over the written byte are dropped. Their decoded ops are
+// left as they are, so the block running now carries on until it notices
+// codeWritten. The page's map is then rebuilt from the blocks left on it;
+// bits a dropped block had on the next page stay set, which only costs a
+// needless search if that byte is written.
+void invalidateCode(uint16_t address)
+{
+	int page = address >> 8;
+
+	if(!(gb->codeMap[page][(address & 0xFF) >> 3] & (1 << (address & 7))))
+		return;
+
+	dropBlocks(address, 1);
+	memset(gb->codeMap[page], 0, sizeof(gb->codeMap[page]));
+	for(int i = 0; i < BLOCK_CACHE_SIZE; i++)
+	{
+		const Block* block = &gb->blocks->blocks[i];
+
+		if(block->key != BLOCK_EMPTY && overlaps(block, page << 8, 0x100))
+			for(uint16_t a = block->key; a != blockEnd(block); a++)
+				if(a >> 8 == page)
+					gb->codeMap[page][(a & 0xFF) >> 3] |= 1 << (a & 7);
+	}
+	gb->codeWritten = 1;
+}
+
+void invalidatePages(int page, int count)
+{
+	int used = 0;
+
+	for(int i = 0; i < count; i++)
+		used |= gb->codePages[page + i];
+	if(!used)
+		return;
+
+	dropBlocks(page << 8, count << 8);
+	for(int i = 0; i < count; i++)
+	{
+		gb->codePages[page + i] = 0;
+		memset(gb->codeMap[page + i], 0, sizeof(gb->codeMap[page + i]));
+		unwatchPage(page + i);
+	}
+	gb->codeWritten = 1;
+}
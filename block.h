@@ -0,0 +1,57 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+
+// Straight-line runs of instructions, decoded once and cached. A block
+// starts at some PC and ends after the first instruction that can branch
+// (see endsBlock() in opcodes.h), after the instruction that follows an EI
+// or after BLOCK_MAX_OPS instructions.
+
+#define BLOCK_MAX_OPS 32
+#define BLOCK_CACHE_SIZE 2048 // Must be a power of 2
+
+// One decoded instruction.
+typedef struct {
+	uint16_t imm;    // Immediate, or the opcode following a CB prefix.
+	uint16_t next;   // Address of the next instruction.
+	uint8_t opcode;
+	uint8_t cycles;  // Not counting taken branches.
+} MicroOp;
+
+typedef struct Block {
+	uint32_t key;    // See blockKey(). BLOCK_EMPTY for an unused entry.
+	int cycles;      // Sum of ops' cycles.
+	uint8_t count;
+	uint16_t hits;   // Times run, in JIT builds.
+	int (*code)(void* cpu); // Native translation in JIT builds, see jit.h.
+	MicroOp ops[BLOCK_MAX_OPS];
+} Block;
+
+#define BLOCK_EMPTY 0xFFFFFFFF
+
+typedef struct BlockCache {
+	Block blocks[BLOCK_CACHE_SIZE];
+	uint8_t* code;   // Executable buffer for JIT translations.
+	int codeUsed;
+} BlockCache;
+
+// Returns the block starting at pc, decoding it on a miss.
+Block* findBlock(uint16_t pc);
+
+// Throws every block away.
+void flushBlocks();
+
+// Frees the selected machine's block cache.
+void freeBlocks();
+
+// Called before a write to a page blocks were decoded from. Drops the
+// blocks the byte at address is part of, if any. Plain pages are watched
+// for writes, see watchPage() in memory.h.
+void invalidateCode(uint16_t address);
+
+// Called when the memory mapped at count pages from page changes. Drops
+// every block with a byte there and stops watching the pages.
+void invalidatePages(int page, int count);
+
+#endif
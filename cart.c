@@ -0,0 +1,337 @@
+#include "cart.h"
+#include "block.h"
+#include "memory.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ROM_BANK_SIZE 0x4000
+#define RAM_BANK_SIZE 0x2000
+
+// Clock cycles in one second of the MBC3 clock.
+#define CYCLES_PER_SECOND 4194304
+
+#define SECONDS_PER_DAY 86400
+
+// Cartridge header fields.
+#define HEADER_TYPE 0x147
+#define HEADER_RAM_SIZE 0x149
+
+// External RAM sizes by the header's code.
+static const int ramSizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+
+// Returns the MBC_ a cartridge type byte names, or -1 if it is not supported.
+static int mbcType(uint8_t type)
+{
+	switch(type)
+	{
+		case 0x00: case 0x08: case 0x09:
+			return MBC_NONE;
+		case 0x01: case 0x02: case 0x03:
+			return MBC1;
+		case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+			return MBC3;
+		case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+			return MBC5;
+		default:
+			return -1;
+	}
+}
+
+// --- MBC3 clock ---
+
+// Seconds the clock has counted.
+static uint64_t clockNow()
+{
+	Cartridge* cart = &gb->cart;
+
+	if(cart->rtcFlags & 0x40)
+		return cart->rtcBase;
+	return cart->rtcBase + (gb->cycles - cart->rtcCycles) / CYCLES_PER_SECOND;
+}
+
+// Seconds and days of the clock. The day counter is 9 bits and sets the
+// carry bit when it overflows.
+static uint64_t clockDays(uint64_t* seconds)
+{
+	Cartridge* cart = &gb->cart;
+	uint64_t now = clockNow();
+	uint64_t days = now / SECONDS_PER_DAY;
+
+	if(days >= 512)
+	{
+		cart->rtcBase -= (days / 512) * 512 * SECONDS_PER_DAY;
+		cart->rtcFlags |= 0x80;
+		days %= 512;
+	}
+	*seconds = now % SECONDS_PER_DAY;
+	return days;
+}
+
+static void latchClock()
+{
+	Cartridge* cart = &gb->cart;
+	uint64_t seconds;
+	uint64_t days = clockDays(&seconds);
+
+	cart->rtc[0] = seconds % 60;
+	cart->rtc[1] = seconds / 60 % 60;
+	cart->rtc[2] = seconds / 3600;
+	cart->rtc[3] = days;
+	cart->rtc[4] = (days >> 8) | cart->rtcFlags;
+}
+
+// Sets one of the clock's registers. Writing any of them restarts the
+// current second.
+static void setClock(int reg, uint8_t value)
+{
+	Cartridge* cart = &gb->cart;
+	uint64_t seconds;
+	uint64_t days = clockDays(&seconds);
+	uint64_t s = seconds % 60, m = seconds / 60 % 60, h = seconds / 3600;
+
+	switch(reg)
+	{
+		case 0: s = value & 0x3F; break;
+		case 1: m = value & 0x3F; break;
+		case 2: h = value & 0x1F; break;
+		case 3: days = (days & 0x100) | value; break;
+		case 4:
+			days = (days & 0xFF) | (value & 1) << 8;
+			cart->rtcFlags = value & 0xC0;
+			break;
+	}
+
+	cart->rtcBase = days * SECONDS_PER_DAY + h * 3600 + m * 60 + s;
+	cart->rtcCycles = gb->cycles;
+	cart->rtc[reg] = value;
+}
+
+// --- Banking ---
+
+// Maps the selected ROM banks. Blocks decoded from 0x4000-0x7FFF are cached
+// by bank (see blockKey() in block.c) so they are kept, but the block
+// running now stops after the write that switched banks.
+static void mapRom()
+{
+	Cartridge* cart = &gb->cart;
+	int low = 0, high = cart->romSelect;
+	uint8_t* rom = (uint8_t*) cart->rom;
+
+	if(cart->mbc == MBC1)
+	{
+		high |= cart->ramSelect << 5;
+		if(cart->mode)
+			low = cart->ramSelect << 5;
+	}
+	low %= cart->romBanks;
+	high %= cart->romBanks;
+
+	if(pageMapped(0x00) != rom + low * ROM_BANK_SIZE)
+	{
+		mapPages(0x00, 0x40, rom + low * ROM_BANK_SIZE, 0);
+		invalidatePages(0x00, 0x40);
+	}
+
+	gb->romBank = high;
+	mapPages(0x40, 0x40, rom + high * ROM_BANK_SIZE, 0);
+	gb->codeWritten = 1;
+}
+
+// External RAM reads 0xFF while it is disabled or missing, unless an MBC3
+// clock register is selected.
+static uint8_t readRam(uint16_t address)
+{
+	Cartridge* cart = &gb->cart;
+
+	if(cart->mbc == MBC3 && cart->ramEnabled && cart->ramSelect >= 8 && cart->ramSelect <= 0xC)
+		return cart->rtc[cart->ramSelect - 8];
+	return 0xFF;
+}
+
+static void writeRam(uint16_t address, uint8_t value)
+{
+	Cartridge* cart = &gb->cart;
+
+	if(cart->mbc == MBC3 && cart->ramEnabled && cart->ramSelect >= 8 && cart->ramSelect <= 0xC)
+		setClock(cart->ramSelect - 8, value);
+}
+
+// Maps the selected RAM bank while RAM is enabled.
+static void mapRam()
+{
+	Cartridge* cart = &gb->cart;
+	int bank = cart->ramSelect;
+	uint8_t* ram = 0;
+
+	if(cart->mbc == MBC1 && !cart->mode)
+		bank = 0;
+	// MBC3 selects its clock registers with 8 and up, see readRam().
+	if(cart->ram && (cart->ramEnabled || cart->mbc == MBC_NONE) && (cart->mbc != MBC3 || bank < 8))
+		ram = cart->ram + (bank % cart->ramBanks) * RAM_BANK_SIZE;
+
+	// Watching a page replaces its write handler, so they are set again.
+	if(pageMapped(0xA0) != ram)
+	{
+		setHandlers(0xA0, 0x20, readRam, writeRam);
+		mapPages(0xA0, 0x20, ram, ram);
+		invalidatePages(0xA0, 0x20);
+	}
+}
+
+// Writes to ROM set the MBC's registers. Each MBC splits 0x0000-0x7FFF
+// into the same four 8K ranges: RAM enable, ROM bank, RAM bank and mode
+// (or clock latch).
+static void writeRom(uint16_t address, uint8_t value)
+{
+	Cartridge* cart = &gb->cart;
+	int range = address >> 13;
+
+	if(cart->mbc == MBC_NONE)
+		return;
+
+	if(range == 0)
+	{
+		cart->ramEnabled = (value & 0x0F) == 0x0A;
+		mapRam();
+		return;
+	}
+
+	switch(cart->mbc)
+	{
+		case MBC1:
+			if(range == 1)
+				cart->romSelect = (value & 0x1F) ? value & 0x1F : 1;
+			else if(range == 2)
+				cart->ramSelect = value & 3;
+			else
+				cart->mode = value & 1;
+			mapRom();
+			mapRam();
+			break;
+		case MBC3:
+			if(range == 1)
+			{
+				cart->romSelect = (value & 0x7F) ? value & 0x7F : 1;
+				mapRom();
+			}
+			else if(range == 2)
+			{
+				cart->ramSelect = value & 0x0F;
+				mapRam();
+			}
+			else
+			{
+				// Latches on a 0 then a 1.
+				if(cart->mode == 0 && value == 1)
+					latchClock();
+				cart->mode = value;
+			}
+			break;
+		case MBC5:
+			if(range == 1 && address < 0x3000)
+				cart->romSelect = (cart->romSelect & 0x100) | value;
+			else if(range == 1)
+				cart->romSelect = (cart->romSelect & 0xFF) | (value & 1) << 8;
+			if(range == 1)
+				mapRom();
+			else if(range == 2)
+			{
+				cart->ramSelect = value & 0x0F;
+				mapRam();
+			}
+			break;
+	}
+}
+
+// --- Loading ---
+
+int cartLoad(const char* path)
+{
+	Cartridge* cart = &gb->cart;
+	struct stat st;
+	const uint8_t* rom;
+	int fd = open(path, O_RDONLY);
+	int mbc, ramSize;
+
+	if(fd < 0)
+	{
+		perror(path);
+		return 0;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size < 2 * ROM_BANK_SIZE || st.st_size % ROM_BANK_SIZE)
+	{
+		fprintf(stderr, "%s: not a Gameboy ROM\n", path);
+		close(fd);
+		return 0;
+	}
+
+	rom = (const uint8_t*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(rom == MAP_FAILED)
+	{
+		perror(path);
+		return 0;
+	}
+
+	mbc = mbcType(rom[HEADER_TYPE]);
+	if(mbc < 0)
+	{
+		fprintf(stderr, "%s: unsupported cartridge type 0x%02X\n", path, rom[HEADER_TYPE]);
+		munmap((void*) rom, st.st_size);
+		return 0;
+	}
+	ramSize = rom[HEADER_RAM_SIZE] < 6 ? ramSizes[rom[HEADER_RAM_SIZE]] : 0;
+
+	cartFree();
+	cart->rom = rom;
+	cart->romSize = st.st_size;
+	cart->romBanks = st.st_size / ROM_BANK_SIZE;
+	cart->mbc = mbc;
+	cart->romSelect = 1;
+	if(ramSize)
+	{
+		// A 2K RAM is given a whole bank and mirrored no further.
+		cart->ramBanks = (ramSize + RAM_BANK_SIZE - 1) / RAM_BANK_SIZE;
+		cart->ram = (uint8_t*) calloc(cart->ramBanks, RAM_BANK_SIZE);
+	}
+
+	setHandlers(0x00, 0x80, readRam, writeRom);
+	setHandlers(0xA0, 0x20, readRam, writeRam);
+	mapPages(0xA0, 0x20, 0, 0);
+	mapRom();
+	mapRam();
+	flushBlocks();
+	dirtyAll();
+	return 1;
+}
+
+void cartRestore()
+{
+	if(!gb->cart.rom)
+		return;
+	mapRom();
+	mapRam();
+}
+
+void cartFree()
+{
+	Cartridge* cart = &gb->cart;
+
+	if(!cart->rom)
+		return;
+
+	munmap((void*) cart->rom, cart->romSize);
+	free(cart->ram);
+	memset(cart, 0, sizeof(*cart));
+
+	gb->romBank = 1;
+	mapPages(0x00, 0x80, gb->memory, gb->memory);
+	mapPages(0xA0, 0x20, gb->memory + 0xA000, gb->memory + 0xA000);
+	flushBlocks();
+	dirtyAll();
+}
@@ -0,0 +1,32 @@
+#ifndef CART_H
+#define CART_H
+
+#include <stdint.h>
+
+// Cartridges. The ROM file is mapped read-only with mmap, so machines that
+// load the same game share one copy of it, and 0x0000-0x7FFF read straight
+// from the mapping. A bank switch repoints the pages of the 0x4000-0x7FFF
+// window (and 0x0000-0x3FFF in MBC1's second mode) at the selected bank.
+// External RAM at 0xA000-0xBFFF is mapped the same way while enabled.
+//
+// Supported: no MBC, MBC1, MBC3 (with its clock) and MBC5. The clock runs
+// on emulated time, gb->cycles.
+
+#define MBC_NONE 0
+#define MBC1 1
+#define MBC3 3
+#define MBC5 5
+
+// Loads the cartridge in path into the selected machine and maps it. Call
+// after memInit(). Returns 0 if the file cannot be loaded, after printing
+// why to stderr.
+int cartLoad(const char* path);
+
+// Maps the banks the MBC's registers select, after a save state is loaded.
+void cartRestore();
+
+// Unloads the selected machine's cartridge, if any, and maps plain RAM back
+// in its place. memFree() calls it.
+void cartFree();
+
+#endif
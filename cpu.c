@@ -1,122 +1,144 @@
 #include "cpu.h"
+#include "apu.h"
+#include "dma.h"
 #include "execute.h"
-#include <malloc.h>
-
-typedef struct {
-	uint8_t first, second;
-} Pair;
-
-typedef struct {
-	Pair AF, BC, DE, HL;
-	uint16_t SP, PC;
-} CPUState;
-
-// The current state of the registers of the CPU
-CPUState* state;
-int halt;
+#include "interrupt.h"
+#include "ppu.h"
+#include "sched.h"
+#include "timer.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
 
 void CPUStateInit()
 {
-	state = (CPUState*) malloc(sizeof(CPUState));
+	memset(&gb->cpu, 0, sizeof(gb->cpu));
+	gb->cpu.PC = 0x100;
+	gb->halt = 0;
+	gb->cycles = 0;
+	resetEvents();
+	timerReset();
+	dmaReset();
+	ppuReset();
+	apuReset();
+	updateInterrupts();
+}
+
+void CPU()
+{
+	CPUStateInit();
+	runFor(EVENT_NEVER);
+}
 
-	// Set 8-bit regs to 0
-	state->AF.first = state->AF.second = state->BC.first = state->BC.second = state->DE.first = state->DE.second = state->HL.first = state->HL.second = 0;
+uint64_t runFor(uint64_t cycles)
+{
+	uint64_t start = gb->cycles;
 
-	state->SP = 0;
-	state->PC = 0x100;
+	gb->runEnd = cycles < EVENT_NEVER - start ? start + cycles : EVENT_NEVER;
+	runEvents();
+	while(!halted() && gb->cycles < gb->runEnd)
+	{
+		takeInterrupt();
+		run();
+		runEvents();
+	}
+	gb->runEnd = EVENT_NEVER;
 
-	halt = 0;
+	return gb->cycles - start;
 }
 
-void haltCPU()
+uint64_t runFrame()
 {
-	halt = 1;
+	return runFor(FRAME_CYCLES - gb->cycles % FRAME_CYCLES);
 }
 
-void CPU()
+int haltUntilInterrupt(int elapsed)
 {
-	uint8_t counter = 5;
-
-	CPUStateInit();
+	uint64_t now = gb->cycles + elapsed;
 
-	int cycles;
+	gb->cpu.waiting = 0;
+	if(interruptPending())
+		return 0;
 
-	for(;;)
+	// Nothing is scheduled that could request an interrupt.
+	if(gb->nextEvent == EVENT_NEVER)
 	{
-		unsigned char instr = readMem(PC());
+		haltCPU();
+		return 0;
+	}
 
-		execute(instr, &cycles);
+	setPC(holdPC() - 1);
+	gb->cpu.waiting = 1;
+	return gb->nextEvent > now ? gb->nextEvent - now : 0;
+}
 
-		if(halt)
+// --- Lazy Flags ---
+
+const uint8_t lazyFlagMask[] = {
+	[FLAGS_NONE] = 0,
+	[FLAGS_ADD] = FLAG_Z | FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_SUB] = FLAG_Z | FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_AND] = FLAG_Z | FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_LOGIC] = FLAG_Z | FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_INC] = FLAG_Z | FLAG_N | FLAG_H,
+	[FLAGS_DEC] = FLAG_Z | FLAG_N | FLAG_H,
+	[FLAGS_ADD16] = FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_ADDSP] = FLAG_Z | FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_SHIFT] = FLAG_Z | FLAG_N | FLAG_H | FLAG_C,
+	[FLAGS_BIT] = FLAG_Z | FLAG_N | FLAG_H,
+};
+
+uint8_t lazyFlags()
+{
+#ifdef LAZY_FLAGS
+	CPUState* cpu = &gb->cpu;
+	int x = cpu->flagX, y = cpu->flagY, carry = cpu->flagCarry;
+	int result = cpu->flagResult;
+	uint8_t zero = (result & 0xff) ? 0 : FLAG_Z;
+	uint8_t f = 0;
+
+	switch(cpu->flagOp)
+	{
+		case FLAGS_ADD:
+			f = zero;
+			if((x & 0xf) + (y & 0xf) + carry > 0xf) f |= FLAG_H;
+			if(result > 0xff) f |= FLAG_C;
+			break;
+		case FLAGS_SUB:
+			f = zero | FLAG_N;
+			if((x & 0xf) - (y & 0xf) - carry < 0) f |= FLAG_H;
+			if(result < 0) f |= FLAG_C;
+			break;
+		case FLAGS_AND: f = zero | FLAG_H; break;
+		case FLAGS_LOGIC: f = zero; break;
+		case FLAGS_INC: f = zero | ((x & 0xf) == 0xf ? FLAG_H : 0); break;
+		case FLAGS_DEC: f = zero | FLAG_N | ((x & 0xf) == 0 ? FLAG_H : 0); break;
+		case FLAGS_ADD16:
+			if((x & 0xfff) + (y & 0xfff) > 0xfff) f |= FLAG_H;
+			if(result > 0xffff) f |= FLAG_C;
 			break;
+		case FLAGS_ADDSP:
+			if((x & 0xf) + (y & 0xf) > 0xf) f |= FLAG_H;
+			if((x & 0xff) + y > 0xff) f |= FLAG_C;
+			break;
+		case FLAGS_SHIFT: f = zero | (carry ? FLAG_C : 0); break;
+		case FLAGS_BIT: f = zero | FLAG_H; break;
 	}
+
+	return (LAZY_BASE & ~lazyFlagMask[cpu->flagOp]) | f;
+#else
+	return gb->cpu.AF.low;
+#endif
 }
 
-// --- Register Gets ---
-
-uint8_t A() {return state->AF.first;}
-uint8_t F() {return state->AF.second;}
-uint8_t B() {return state->BC.first;}
-uint8_t C() {return state->BC.second;}
-uint8_t D() {return state->DE.first;}
-uint8_t E() {return state->DE.second;}
-uint8_t H() {return state->HL.first;}
-uint8_t L() {return state->HL.second;}
-uint16_t SP() {return state->SP;}
-uint16_t PC() {return state->PC++;}
-uint16_t holdPC() {return state->PC;}
-
-uint16_t AF() {return (((uint16_t) A()) << 8) | F();}
-uint16_t BC() {return (((uint16_t) B()) << 8) | C();}
-uint16_t DE() {return (((uint16_t) D()) << 8) | E();}
-uint16_t HL() {return (((uint16_t) H()) << 8) | L();}
-
-uint16_t imm8() {return readMem(PC());}
-int16_t signedImm8() {return readMem(PC());}
-uint16_t imm16() {uint16_t first = imm8(); char sec = imm8();
-	return (sec << 8) | first;}
-uint16_t imm16LSB() {uint16_t first = imm8(); char sec = imm8();
-	return (first << 8) | sec;}
-
-// --- Flag Gets ---
-
-char Zflag() {return (F() >> 7) & 1;}
-char Nflag() {return (F() >> 6) & 1;}
-char Hflag() {return (F() >> 5) & 1;}
-char Cflag() {return (F() >> 4) & 1;} //if((F() >> 4) % 2) return 1; else return 0;
-
-// --- Register Sets ---
-
-void setA(uint8_t in) {state->AF.first = in;}
-void setF(uint8_t in) {state->AF.second = in;}
-void setB(uint8_t in) {state->BC.first = in;}
-void setC(uint8_t in) {state->BC.second = in;}
-void setD(uint8_t in) {state->DE.first = in;}
-void setE(uint8_t in) {state->DE.second = in;}
-void setH(uint8_t in) {state->HL.first = in;}
-void setL(uint8_t in) {state->HL.second = in;}
-void setSP(uint16_t in) {state->SP = in;}
-void setPC(uint16_t in) {state->PC = in;}
-
-void setAF(uint16_t in) {setA(in >> 8); setF(in);}
-void setBC(uint16_t in) {setB(in >> 8); setC(in);}
-void setDE(uint16_t in) {setD(in >> 8); setE(in);}
-void setHL(uint16_t in) {setH(in >> 8); setL(in);}
-
-// --- Flag Sets ---
-
-void setZflag() {setF(F() | (1 << 7));}
-void resetZflag() {setF(F() & ~(1 << 7));}
-void setNflag() {setF(F() | (1 << 6));}
-void resetNflag() {setF(F() & ~(1 << 6));}
-void setHflag() {setF(F() | (1 << 5));}
-void resetHflag() {setF(F() & ~(1 << 5));}
-void setCflag() {setF(F() | (1 << 4));}
-void resetCflag() {setF(F() & ~(1 << 4));}
-
-// Some operations are similar to others but the C flag is left
-// unaffected, a push/pop is easier than redoing the operation
-// with the one difference.
-uint8_t tempC;
-void pushC() {tempC = Cflag();}
-void popC() {if(tempC) Cflag(); else resetCflag();}
+void checkLazyFlags()
+{
+	uint8_t lazy = lazyFlags();
+
+	if(lazy != gb->cpu.AF.low)
+	{
+		printf("Lazy flags %02X differ from eager flags %02X at PC %04X\n",
+			lazy, gb->cpu.AF.low, gb->cpu.PC);
+		assert(0);
+	}
+}
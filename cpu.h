@@ -1,79 +1,219 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "interrupt.h"
+#include "machine.h"
 #include "memory.h"
 #include <stdint.h>
 
 // Actrually runs the CPU until powered off.
 void CPU();
 
-// Stops the execution of the CPU.
-void haltCPU();
+// Runs the CPU for cycles clock cycles, or until it powers off. Stops at
+// the end of the instruction that reaches them, so it can run over by a
+// few cycles. Returns the cycles run.
+uint64_t runFor(uint64_t cycles);
+
+// Runs to the end of the current frame. Frames are FRAME_CYCLES long,
+// counted from power on, so running over one frame shortens the next.
+// Returns the cycles run.
+uint64_t runFrame();
+
+// Resets the registers to their power on values.
+void CPUStateInit();
+
+// Powers the CPU off. Headless runs end this way, on STOP or when the CPU
+// waits for something that can never happen. The run loop stops at once.
+static inline void haltCPU() {gb->halt = 1; gb->nextEvent = 0;}
+
+// Returns 1 once the CPU has been stopped.
+static inline int halted() {return gb->halt;}
+
+// Returns 1 if an enabled interrupt has been requested (IE & IF), whether
+// or not IME is set.
+static inline int interruptPending() {return (readMem(0xFFFF) & readMem(0xFF0F) & 0x1F) != 0;}
+
+// Runs HALT, elapsed cycles after gb->cycles. Returns at once if an
+// interrupt is pending. Otherwise skips to the next event and leaves PC on
+// the HALT so it runs again once the event is handled, or so the interrupt
+// the event requests returns past it. Returns the cycles skipped.
+int haltUntilInterrupt(int elapsed);
+
+// --- Flags ---
+
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
+// With LAZY_FLAGS the ALU records its last operation instead of writing F,
+// and F is only worked out when something reads it. LAZY_FLAGS_CHECK keeps
+// F eager as well and asserts the two agree every time F is read.
+#ifdef LAZY_FLAGS_CHECK
+#define LAZY_FLAGS
+#endif
+
+// The kinds of operation the ALU records. Each one decides the flags in
+// lazyFlagMask and leaves the rest of F alone.
+enum {
+	FLAGS_NONE, FLAGS_ADD, FLAGS_SUB, FLAGS_AND, FLAGS_LOGIC, FLAGS_INC,
+	FLAGS_DEC, FLAGS_ADD16, FLAGS_ADDSP, FLAGS_SHIFT, FLAGS_BIT
+};
+
+extern const uint8_t lazyFlagMask[];
+
+// Works out F from the recorded operation.
+uint8_t lazyFlags();
+
+// Aborts if the lazily computed F differs from the eager one.
+void checkLazyFlags();
+
+#ifdef LAZY_FLAGS_CHECK
+#define LAZY_BASE gb->cpu.flagBase
+#else
+#define LAZY_BASE gb->cpu.AF.low
+#endif
+
+static inline uint8_t F()
+{
+#if defined(LAZY_FLAGS_CHECK)
+	checkLazyFlags();
+#elif defined(LAZY_FLAGS)
+	if(gb->cpu.flagOp != FLAGS_NONE)
+	{
+		gb->cpu.AF.low = lazyFlags();
+		gb->cpu.flagOp = FLAGS_NONE;
+	}
+#endif
+	return gb->cpu.AF.low;
+}
+
+static inline void setF(uint8_t in)
+{
+	gb->cpu.AF.low = in;
+#ifdef LAZY_FLAGS
+	gb->cpu.flagBase = in;
+	gb->cpu.flagOp = FLAGS_NONE;
+#endif
+}
+
+#ifdef LAZY_FLAGS
+// Records an ALU operation. Flags the new operation leaves alone still
+// belong to the previous one, so that is folded into F first.
+static inline void recordFlags(int op, uint16_t x, uint16_t y, int carry, int result)
+{
+	CPUState* cpu = &gb->cpu;
+
+	if(lazyFlagMask[cpu->flagOp] & ~lazyFlagMask[op])
+		LAZY_BASE = lazyFlags();
+
+	cpu->flagOp = op;
+	cpu->flagX = x;
+	cpu->flagY = y;
+	cpu->flagCarry = carry;
+	cpu->flagResult = result;
+}
+#endif
+
+// Sets the flags in mask to value, leaving the rest of F alone.
+static inline void writeFlags(uint8_t mask, uint8_t value)
+{
+	gb->cpu.AF.low = (gb->cpu.AF.low & ~mask) | value;
+}
+
+// Sets the flags for an ALU operation. Lazy builds only record op and its
+// inputs, eager builds store value into the flags in mask.
+#if defined(LAZY_FLAGS_CHECK)
+#define SET_FLAGS(op, x, y, carry, result, mask, value) \
+	{recordFlags(op, x, y, carry, result); writeFlags(mask, value);}
+#elif defined(LAZY_FLAGS)
+#define SET_FLAGS(op, x, y, carry, result, mask, value) \
+	recordFlags(op, x, y, carry, result)
+#else
+#define SET_FLAGS(op, x, y, carry, result, mask, value) writeFlags(mask, value)
+#endif
 
 // --- Register Gets ---
 
-uint8_t A();
-uint8_t F();
-uint8_t B();
-uint8_t C();
-uint8_t D();
-uint8_t E();
-uint8_t H();
-uint8_t L();
-uint16_t SP();
-uint16_t PC(); // Increments PC after returning.
-uint16_t holdPC();
-
-uint16_t AF();
-uint16_t BC();
-uint16_t DE();
-uint16_t HL();
-
-uint16_t imm8();
-int16_t signedImm8();
-uint16_t imm16();
-uint16_t imm16LSB();
+static inline uint8_t A() {return gb->cpu.AF.high;}
+static inline uint8_t B() {return gb->cpu.BC.high;}
+static inline uint8_t C() {return gb->cpu.BC.low;}
+static inline uint8_t D() {return gb->cpu.DE.high;}
+static inline uint8_t E() {return gb->cpu.DE.low;}
+static inline uint8_t H() {return gb->cpu.HL.high;}
+static inline uint8_t L() {return gb->cpu.HL.low;}
+static inline uint16_t SP() {return gb->cpu.SP;}
+static inline uint16_t PC() {return gb->cpu.PC++;} // Increments PC after returning.
+static inline uint16_t holdPC() {return gb->cpu.PC;}
+static inline uint8_t IME() {return gb->cpu.IME;}
+
+static inline uint16_t AF() {F(); return gb->cpu.AF.word;}
+static inline uint16_t BC() {return gb->cpu.BC.word;}
+static inline uint16_t DE() {return gb->cpu.DE.word;}
+static inline uint16_t HL() {return gb->cpu.HL.word;}
+
+static inline uint16_t imm8() {return readMem(PC());}
+static inline uint16_t imm16() {uint16_t pc = holdPC(); gb->cpu.PC = pc + 2;
+	return readMem16(pc);}
 
 // --- Flag Gets ---
 
-char Zflag();
-char Nflag();
-char Hflag();
-char Cflag();
+// Conditional branches and ADC/SBC only need Z or C, which lazy builds can
+// usually read straight off the recorded result.
+static inline char Zflag()
+{
+#if defined(LAZY_FLAGS) && !defined(LAZY_FLAGS_CHECK)
+	uint8_t op = gb->cpu.flagOp;
+	if(op != FLAGS_NONE && op != FLAGS_ADD16 && op != FLAGS_ADDSP)
+		return !(gb->cpu.flagResult & 0xff);
+#endif
+	return (F() >> 7) & 1;
+}
+
+static inline char Nflag() {return (F() >> 6) & 1;}
+static inline char Hflag() {return (F() >> 5) & 1;}
+
+static inline char Cflag()
+{
+#if defined(LAZY_FLAGS) && !defined(LAZY_FLAGS_CHECK)
+	switch(gb->cpu.flagOp)
+	{
+		case FLAGS_ADD: return gb->cpu.flagResult > 0xff;
+		case FLAGS_SUB: return gb->cpu.flagResult < 0;
+		case FLAGS_AND: case FLAGS_LOGIC: return 0;
+		case FLAGS_SHIFT: return gb->cpu.flagCarry;
+	}
+#endif
+	return (F() >> 4) & 1;
+}
 
 // --- Register Sets ---
 
-void setA(uint8_t in);
-void setF(uint8_t in);
-void setB(uint8_t in);
-void setC(uint8_t in);
-void setD(uint8_t in);
-void setE(uint8_t in);
-void setH(uint8_t in);
-void setL(uint8_t in);
-void setSP(uint16_t in);
-void setPC(uint16_t in);
-
-void setAF(uint16_t in);
-void setBC(uint16_t in);
-void setDE(uint16_t in);
-void setHL(uint16_t in);
+static inline void setA(uint8_t in) {gb->cpu.AF.high = in;}
+static inline void setB(uint8_t in) {gb->cpu.BC.high = in;}
+static inline void setC(uint8_t in) {gb->cpu.BC.low = in;}
+static inline void setD(uint8_t in) {gb->cpu.DE.high = in;}
+static inline void setE(uint8_t in) {gb->cpu.DE.low = in;}
+static inline void setH(uint8_t in) {gb->cpu.HL.high = in;}
+static inline void setL(uint8_t in) {gb->cpu.HL.low = in;}
+static inline void setSP(uint16_t in) {gb->cpu.SP = in;}
+static inline void setPC(uint16_t in) {gb->cpu.PC = in;}
+static inline void setIME(uint8_t in) {gb->cpu.IME = in; updateInterrupts();}
+
+static inline void setAF(uint16_t in) {setA(in >> 8); setF(in);}
+static inline void setBC(uint16_t in) {gb->cpu.BC.word = in;}
+static inline void setDE(uint16_t in) {gb->cpu.DE.word = in;}
+static inline void setHL(uint16_t in) {gb->cpu.HL.word = in;}
 
 // --- Flag Sets ---
 
-void setZflag();
-void resetZflag();
-void setNflag();
-void resetNflag();
-void setHflag();
-void resetHflag();
-void setCflag();
-void resetCflag();
-
-// Some operations are similar to others but the C flag is left
-// unaffected, a push/pop is simpler  than redoing the operation
-// with the one difference.
-void pushC();
-void popC();
+static inline void setZflag() {setF(F() | (1 << 7));}
+static inline void resetZflag() {setF(F() & ~(1 << 7));}
+static inline void setNflag() {setF(F() | (1 << 6));}
+static inline void resetNflag() {setF(F() & ~(1 << 6));}
+static inline void setHflag() {setF(F() | (1 << 5));}
+static inline void resetHflag() {setF(F() & ~(1 << 5));}
+static inline void setCflag() {setF(F() | (1 << 4));}
+static inline void resetCflag() {setF(F() & ~(1 << 4));}
 
 #endif
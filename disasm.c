@@ -0,0 +1,61 @@
+#include "disasm.h"
+#include "memory.h"
+#include "opcodes.h"
+#include <stdio.h>
+#include <string.h>
+
+int disassemble(uint16_t address, char* out, int size)
+{
+	const OpcodeInfo* info = opcodeAt(address);
+	const char* text = info->mnemonic;
+	uint8_t lo = readMem((uint16_t) (address + 1));
+	uint8_t hi = readMem((uint16_t) (address + 2));
+	int pos = 0;
+
+	// Copy the mnemonic, replacing the immediate placeholder with its value.
+	while(*text && pos < size - 1)
+	{
+		char operand[16];
+		int skip = 0;
+
+		if(!strncmp(text, "d16", 3) || !strncmp(text, "a16", 3))
+		{
+			snprintf(operand, sizeof(operand), "$%02X%02X", hi, lo);
+			skip = 3;
+		}
+		else if(!strncmp(text, "d8", 2))
+		{
+			snprintf(operand, sizeof(operand), "$%02X", lo);
+			skip = 2;
+		}
+		else if(!strncmp(text, "a8", 2))
+		{
+			snprintf(operand, sizeof(operand), "$FF%02X", lo);
+			skip = 2;
+		}
+		else if(!strncmp(text, "r8", 2))
+		{
+			// Relative jumps show their target, SP offsets their value.
+			if(info->kind == KIND_JR)
+				snprintf(operand, sizeof(operand), "$%04X",
+					(uint16_t) (address + 2 + (int8_t) lo));
+			else
+				snprintf(operand, sizeof(operand), "%d", (int8_t) lo);
+			skip = 2;
+		}
+
+		if(skip)
+		{
+			pos += snprintf(out + pos, size - pos, "%s", operand);
+			text += skip;
+		}
+		else
+			out[pos++] = *text++;
+	}
+
+	if(pos > size - 1)
+		pos = size - 1;
+	out[pos] = 0;
+
+	return info->length;
+}
@@ -0,0 +1,10 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdint.h>
+
+// Writes the instruction at address as text into out, which holds size
+// bytes. Returns the instruction's length in bytes.
+int disassemble(uint16_t address, char* out, int size);
+
+#endif
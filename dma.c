@@ -0,0 +1,135 @@
+#include "dma.h"
+#include "memory.h"
+#include "sched.h"
+
+// Cycles OAM is locked for: 160 M-cycles, one per byte.
+#define OAM_DMA_CYCLES 640
+#define OAM_SIZE 160
+
+// Cycles the CPU is stalled for per 16-byte HDMA block.
+#define HDMA_BLOCK_CYCLES 32
+
+// OAM while a transfer is running.
+static uint8_t readLocked(uint16_t address)
+{
+	return 0xFF;
+}
+
+static void writeLocked(uint16_t address, uint8_t value)
+{
+}
+
+static void oamDmaEvent(uint64_t at)
+{
+	mapPages(0xFE, 1, gb->memory + 0xFE00, gb->memory + 0xFE00);
+}
+
+static void startOamDma(uint8_t value)
+{
+	// Sources past work RAM read its echo.
+	uint16_t source = (value >= 0xE0 ? value - 0x20 : value) << 8;
+
+	if(gb->eventAt[EVENT_DMA] != EVENT_NEVER)
+		oamDmaEvent(gb->cycles);
+
+	copyMem(0xFE00, source, OAM_SIZE);
+	setHandlers(0xFE, 1, readLocked, writeLocked);
+	mapPages(0xFE, 1, 0, 0);
+	scheduleEvent(EVENT_DMA, gb->cycles + OAM_DMA_CYCLES, oamDmaEvent);
+}
+
+// Copies count 16-byte blocks to VRAM and moves both addresses past them.
+static void copyBlocks(int count)
+{
+	Hdma* h = &gb->hdma;
+
+	for(int i = 0; i < count; i++)
+	{
+		copyMem(0x8000 | h->dest, h->source, 16);
+		h->source += 16;
+		h->dest = (h->dest + 16) & 0x1FF0;
+	}
+}
+
+void hdmaHBlank()
+{
+	Hdma* h = &gb->hdma;
+
+	if(h->control & 0x80)
+		return;
+
+	copyBlocks(1);
+	gb->cycles += HDMA_BLOCK_CYCLES;
+	h->control = h->control ? h->control - 1 : 0xFF;
+}
+
+static void startHdma(uint8_t value)
+{
+	Hdma* h = &gb->hdma;
+	int count = (value & 0x7F) + 1;
+
+	// Writing bit 7 clear stops an HBlank transfer instead.
+	if(!(h->control & 0x80) && !(value & 0x80))
+	{
+		h->control |= 0x80;
+		return;
+	}
+
+	if(value & 0x80)
+	{
+		h->control = value & 0x7F;
+		return;
+	}
+
+	copyBlocks(count);
+	gb->cycles += count * HDMA_BLOCK_CYCLES;
+	h->control = 0xFF;
+}
+
+void dmaReset()
+{
+	oamDmaEvent(gb->cycles);
+	cancelEvent(EVENT_DMA);
+	gb->hdma.source = gb->hdma.dest = 0;
+	gb->hdma.control = 0xFF;
+}
+
+void dmaRestore()
+{
+	if(gb->eventAt[EVENT_DMA] == EVENT_NEVER)
+		oamDmaEvent(gb->cycles);
+	else
+	{
+		setHandlers(0xFE, 1, readLocked, writeLocked);
+		mapPages(0xFE, 1, 0, 0);
+		restoreEvent(EVENT_DMA, oamDmaEvent);
+	}
+}
+
+uint8_t dmaRead(uint16_t address)
+{
+	switch(address)
+	{
+		case 0xFF46: return gb->memory[address];
+		case 0xFF55: return gb->hdma.control;
+		default: return 0xFF;
+	}
+}
+
+void dmaWrite(uint16_t address, uint8_t value)
+{
+	Hdma* h = &gb->hdma;
+
+	switch(address)
+	{
+		case 0xFF46:
+			gb->memory[address] = value;
+			startOamDma(value);
+			break;
+		case 0xFF51: h->source = (value << 8) | (h->source & 0xF0); break;
+		case 0xFF52: h->source = (h->source & 0xFF00) | (value & 0xF0); break;
+		case 0xFF53: h->dest = ((value & 0x1F) << 8) | (h->dest & 0xF0); break;
+		case 0xFF54: h->dest = (h->dest & 0x1F00) | (value & 0xF0); break;
+		default: startHdma(value); break;
+	}
+}
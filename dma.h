@@ -0,0 +1,32 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+
+// OAM DMA (0xFF46) and CGB HDMA (0xFF51-0xFF55). Neither steps the
+// transfer byte by byte: each is a copyMem() through the memory map.
+//
+// OAM DMA copies all 160 bytes when it is started. OAM reads 0xFF and
+// ignores writes until EVENT_DMA ends the transfer 160 M-cycles later,
+// so nothing can see the bytes arrive in the meantime.
+//
+// A general purpose HDMA copies every block at once and stalls the CPU
+// for the time it takes. An HBlank HDMA copies one 16-byte block at the
+// start of each HBlank, from the PPU's event, so it waits while the LCD
+// is off.
+
+// Power on values.
+void dmaReset();
+
+// Locks OAM again if a save state was loaded during OAM DMA, or unlocks
+// it if not.
+void dmaRestore();
+
+// Reads and writes 0xFF46 and 0xFF51-0xFF55.
+uint8_t dmaRead(uint16_t address);
+void dmaWrite(uint16_t address, uint8_t value);
+
+// Copies the next block of a running HBlank HDMA, for the PPU.
+void hdmaHBlank();
+
+#endif
@@ -7,4 +7,52 @@
 // on a Gameboy
 void execute(uint8_t instr, int* cycles);
 
+// Like execute(), but for an instruction that has already been fetched. PC
+// must point past it and imm holds its immediate.
+void executeDecoded(uint8_t instr, uint16_t imm, int* cycles);
+
+// Runs a decoded block and returns the cycles it took.
+struct Block;
+int runBlock(struct Block* block);
+
+// Reads and writes an operand (see Operand in opcodes.h). imm is the
+// instruction's immediate, if any.
+uint8_t read8(int operand, uint16_t imm);
+void write8(int operand, uint8_t value, uint16_t imm);
+
+// Stack helpers.
+void push(uint16_t value);
+uint16_t pop();
+
+// ALU helpers. They set the flags and return the result.
+uint8_t add8(uint8_t first, uint8_t second);
+uint8_t adc8(uint8_t first, uint8_t second, int carry);
+uint8_t sub8(uint8_t first, uint8_t second);
+uint8_t sbc8(uint8_t first, uint8_t second, int carry);
+uint8_t and8(uint8_t first, uint8_t second);
+uint8_t or8(uint8_t first, uint8_t second);
+uint8_t xor8(uint8_t first, uint8_t second);
+uint8_t inc8(uint8_t num);
+uint8_t dec8(uint8_t num);
+uint16_t add16(uint16_t first, uint16_t second);
+uint16_t addSP(int8_t offset);
+uint8_t daa8(uint8_t num);
+
+// Rotate, shift and bit helpers for the CB page.
+uint8_t rlc(uint8_t num);
+uint8_t rl(uint8_t num);
+uint8_t rrc(uint8_t num);
+uint8_t rr(uint8_t num);
+uint8_t sla(uint8_t num);
+uint8_t sra(uint8_t num);
+uint8_t srl(uint8_t num);
+uint8_t swap8(uint8_t num);
+void bit(int n, uint8_t num);
+
+// Executes instructions from PC until gb->cycles reaches gb->nextEvent,
+// which haltCPU() sets to 0 (see sched.h). Building with
+// THREADED_DISPATCH replaces the loop around execute() with computed-goto
+// threaded dispatch, and BLOCK_CACHE with a loop over pre-decoded blocks.
+void run();
+
 #endif
@@ -0,0 +1,66 @@
+#include "interrupt.h"
+#include "cpu.h"
+#include "execute.h"
+#include "sched.h"
+
+// Cycles it takes to push PC and jump to a handler.
+#define INTERRUPT_CYCLES 20
+
+void requestInterrupt(uint8_t bits)
+{
+	gb->memory[0xFF0F] |= bits;
+	updateInterrupts();
+}
+
+void updateInterrupts()
+{
+	gb->interrupts = gb->cpu.IME ? gb->memory[0xFFFF] & gb->memory[0xFF0F] & 0x1F : 0;
+	if(gb->interrupts)
+		gb->nextEvent = 0;
+}
+
+static void eiEvent(uint64_t at)
+{
+	setIME(1);
+}
+
+void enableInterrupts(uint64_t end)
+{
+	// The instruction after EI takes at least 4 cycles.
+	if(!IME())
+		scheduleEvent(EVENT_EI, end + 4, eiEvent);
+}
+
+void disableInterrupts()
+{
+	cancelEvent(EVENT_EI);
+	setIME(0);
+}
+
+void interruptRestore()
+{
+	restoreEvent(EVENT_EI, eiEvent);
+	updateInterrupts();
+}
+
+void takeInterrupt()
+{
+	int n;
+
+	if(!gb->interrupts)
+		return;
+
+	n = __builtin_ctz(gb->interrupts);
+	gb->memory[0xFF0F] &= ~(1 << n);
+	setIME(0);
+
+	// Returns past the HALT it woke from.
+	if(gb->cpu.waiting)
+	{
+		setPC(holdPC() + 1);
+		gb->cpu.waiting = 0;
+	}
+	push(holdPC());
+	setPC(0x40 + n * 8);
+	gb->cycles += INTERRUPT_CYCLES;
+}
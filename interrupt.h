@@ -0,0 +1,42 @@
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+
+#include <stdint.h>
+
+// The interrupt controller: IE (0xFFFF), IF (0xFF0F) and IME. Instead of
+// the CPU checking IE & IF between instructions, gb->interrupts holds the
+// interrupts it would take and is only worked out again when IE, IF or IME
+// change. When it becomes nonzero gb->nextEvent is set to 0, so the run
+// loop stops after the current instruction (or block) and takes it.
+//
+// EI sets IME one instruction late, through EVENT_EI, so the run loops
+// check for events after the instruction that follows it. HALT waits for
+// IE & IF whatever IME is set to, see haltUntilInterrupt() in cpu.h.
+
+// The interrupts, as bits of IE and IF. Lower bits come first.
+#define INT_VBLANK 0x01
+#define INT_STAT 0x02
+#define INT_TIMER 0x04
+#define INT_SERIAL 0x08
+#define INT_JOYPAD 0x10
+
+// Sets bits in IF.
+void requestInterrupt(uint8_t bits);
+
+// Works out gb->interrupts again after IE, IF or IME were changed.
+void updateInterrupts();
+
+// EI and DI. EI ends at cycle end and IME is set after the instruction
+// that follows it. DI also cancels an EI that has not taken effect yet.
+void enableInterrupts(uint64_t end);
+void disableInterrupts();
+
+// Gives EVENT_EI its handler back and works out gb->interrupts, after a
+// save state is loaded.
+void interruptRestore();
+
+// Takes the first pending interrupt, if there is one: clears IME and its
+// IF bit and calls its handler. The run loops call this when they stop.
+void takeInterrupt();
+
+#endif
@@ -0,0 +1,651 @@
+#ifdef JIT
+
+#include "jit.h"
+#include "cpu.h"
+#include "execute.h"
+#include "opcodes.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef LAZY_FLAGS
+#error "Translated code reads F directly, so the JIT needs eager flags"
+#endif
+
+#define JIT_BUFFER_SIZE (4 << 20)
+#define JIT_MAX_BLOCK 8192 // More than the longest possible translation
+
+int jitHotness = 2;
+
+enum {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15};
+
+// Host registers that hold the CPUState pointer and guest registers while a
+// translated block runs. All callee-saved, so C helpers leave them alone.
+#define REG_CPU RBX
+#define REG_A R12
+#define REG_BC R13
+#define REG_DE R14
+#define REG_HL R15
+
+#define OFF_A (offsetof(CPUState, AF) + 1)
+#define OFF_F offsetof(CPUState, AF)
+#define OFF_BC offsetof(CPUState, BC)
+#define OFF_DE offsetof(CPUState, DE)
+#define OFF_HL offsetof(CPUState, HL)
+#define OFF_SP offsetof(CPUState, SP)
+#define OFF_PC offsetof(CPUState, PC)
+
+enum {ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5};
+enum {SHIFT_SHL = 4, SHIFT_SHR = 5};
+enum {X86_JE = 0x4, X86_JNE = 0x5};
+
+#define MAX_FIXUPS (BLOCK_MAX_OPS * 4 + 4)
+
+typedef struct {
+	uint8_t* p;
+	uint8_t* fixups[MAX_FIXUPS]; // Jumps to the epilogue, patched at the end.
+	int fixupCount;
+	int before; // Cycles into the block of the instruction being translated.
+} Emitter;
+
+// --- Calls from translated code ---
+
+// gb->cycles is only brought up to date when a block exits, so these are
+// told how far into the block they run for I/O that depends on the time.
+
+static uint8_t jitRead(uint16_t address, int before)
+{
+	uint8_t value;
+
+	gb->cycles += before;
+	value = readMem(address);
+	gb->cycles -= before;
+	return value;
+}
+
+// Returns 1 if the write hit decoded code and the block has to stop.
+static int jitWrite(uint16_t address, uint8_t value, int before)
+{
+	gb->cycles += before;
+	writeMem(address, value);
+	gb->cycles -= before;
+	return gb->codeWritten;
+}
+
+// Runs an instruction the JIT does not translate. Returns 1 if it wrote to
+// decoded code.
+static int jitFallback(const MicroOp* op, int before)
+{
+	int cycles;
+
+	gb->cycles += before;
+	setPC(op->next);
+	executeDecoded(op->opcode, op->imm, &cycles);
+	gb->cycles -= before;
+	return gb->codeWritten;
+}
+
+// Runs the untranslated instruction that ends a block, before cycles into
+// it. Returns its cycles.
+static int jitFallbackLast(const MicroOp* op, int before)
+{
+	int cycles;
+
+	gb->cycles += before;
+	setPC(op->next);
+	executeDecoded(op->opcode, op->imm, &cycles);
+	gb->cycles -= before;
+	return cycles;
+}
+
+// --- x86-64 encoding ---
+
+static void emit8(Emitter* e, uint8_t b) {*e->p++ = b;}
+static void emit16(Emitter* e, uint16_t v) {memcpy(e->p, &v, 2); e->p += 2;}
+static void emit32(Emitter* e, uint32_t v) {memcpy(e->p, &v, 4); e->p += 4;}
+static void emit64(Emitter* e, uint64_t v) {memcpy(e->p, &v, 8); e->p += 8;}
+
+// REX prefix for a reg/rm pair. force emits it even when empty, which the
+// low bytes of rsp, rbp, rsi and rdi need.
+static void rex(Emitter* e, int w, int reg, int rm, int force)
+{
+	uint8_t b = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if(b != 0x40 || force)
+		emit8(e, b);
+}
+
+static void modrm(Emitter* e, int reg, int rm)
+{
+	emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [REG_CPU + offset]
+static void modrmCPU(Emitter* e, int reg, int offset)
+{
+	emit8(e, 0x80 | ((reg & 7) << 3) | REG_CPU);
+	emit32(e, offset);
+}
+
+static void movRR(Emitter* e, int dst, int src)
+{
+	rex(e, 0, src, dst, 0);
+	emit8(e, 0x89);
+	modrm(e, src, dst);
+}
+
+static void movRR64(Emitter* e, int dst, int src)
+{
+	rex(e, 1, src, dst, 0);
+	emit8(e, 0x89);
+	modrm(e, src, dst);
+}
+
+// movzx dst32, src8
+static void movzx8(Emitter* e, int dst, int src)
+{
+	rex(e, 0, dst, src, 1);
+	emit8(e, 0x0F);
+	emit8(e, 0xB6);
+	modrm(e, dst, src);
+}
+
+static void movImm(Emitter* e, int reg, uint32_t imm)
+{
+	rex(e, 0, 0, reg, 0);
+	emit8(e, 0xB8 + (reg & 7));
+	emit32(e, imm);
+}
+
+static void movImm64(Emitter* e, int reg, uint64_t imm)
+{
+	rex(e, 1, 0, reg, 0);
+	emit8(e, 0xB8 + (reg & 7));
+	emit64(e, imm);
+}
+
+static void aluImm(Emitter* e, int op, int reg, uint32_t imm)
+{
+	rex(e, 0, 0, reg, 0);
+	emit8(e, 0x81);
+	modrm(e, op, reg);
+	emit32(e, imm);
+}
+
+static void shiftImm(Emitter* e, int op, int reg, uint8_t n)
+{
+	rex(e, 0, 0, reg, 0);
+	emit8(e, 0xC1);
+	modrm(e, op, reg);
+	emit8(e, n);
+}
+
+static void orRR(Emitter* e, int dst, int src)
+{
+	rex(e, 0, src, dst, 0);
+	emit8(e, 0x09);
+	modrm(e, src, dst);
+}
+
+static void testRR(Emitter* e, int a, int b)
+{
+	rex(e, 0, b, a, 0);
+	emit8(e, 0x85);
+	modrm(e, b, a);
+}
+
+static void loadCPU8(Emitter* e, int dst, int offset)
+{
+	rex(e, 0, dst, REG_CPU, 0);
+	emit8(e, 0x0F);
+	emit8(e, 0xB6);
+	modrmCPU(e, dst, offset);
+}
+
+static void loadCPU16(Emitter* e, int dst, int offset)
+{
+	rex(e, 0, dst, REG_CPU, 0);
+	emit8(e, 0x0F);
+	emit8(e, 0xB7);
+	modrmCPU(e, dst, offset);
+}
+
+static void storeCPU8(Emitter* e, int src, int offset)
+{
+	rex(e, 0, src, REG_CPU, 1);
+	emit8(e, 0x88);
+	modrmCPU(e, src, offset);
+}
+
+static void storeCPU16(Emitter* e, int src, int offset)
+{
+	emit8(e, 0x66);
+	rex(e, 0, src, REG_CPU, 0);
+	emit8(e, 0x89);
+	modrmCPU(e, src, offset);
+}
+
+static void storeCPU16Imm(Emitter* e, int offset, uint16_t imm)
+{
+	emit8(e, 0x66);
+	emit8(e, 0xC7);
+	modrmCPU(e, 0, offset);
+	emit16(e, imm);
+}
+
+static void testCPU8Imm(Emitter* e, int offset, uint8_t imm)
+{
+	emit8(e, 0xF6);
+	modrmCPU(e, 0, offset);
+	emit8(e, imm);
+}
+
+static void call(Emitter* e, void* fn)
+{
+	movImm64(e, RAX, (uint64_t) fn);
+	emit8(e, 0xFF);
+	emit8(e, 0xD0);
+}
+
+static void pushReg(Emitter* e, int reg)
+{
+	rex(e, 0, 0, reg, 0);
+	emit8(e, 0x50 + (reg & 7));
+}
+
+static void popReg(Emitter* e, int reg)
+{
+	rex(e, 0, 0, reg, 0);
+	emit8(e, 0x58 + (reg & 7));
+}
+
+// Emits a conditional jump and returns its displacement for patch().
+static uint8_t* jcc(Emitter* e, int cc)
+{
+	emit8(e, 0x0F);
+	emit8(e, 0x80 | cc);
+	emit32(e, 0);
+	return e->p - 4;
+}
+
+static void patch(uint8_t* at, uint8_t* target)
+{
+	int32_t rel = target - (at + 4);
+	memcpy(at, &rel, 4);
+}
+
+// Jumps to the epilogue, which stores the guest registers and returns eax.
+static void jmpEpilogue(Emitter* e)
+{
+	emit8(e, 0xE9);
+	emit32(e, 0);
+	e->fixups[e->fixupCount++] = e->p - 4;
+}
+
+// Leaves the block with PC at pc, having taken cycles.
+static void exitBlock(Emitter* e, uint16_t pc, int cycles)
+{
+	storeCPU16Imm(e, OFF_PC, pc);
+	movImm(e, RAX, cycles);
+	jmpEpilogue(e);
+}
+
+// Leaves the block if the call just made reports a write to decoded code.
+static void exitIfCodeWritten(Emitter* e, uint16_t pc, int cycles)
+{
+	uint8_t* skip;
+
+	testRR(e, RAX, RAX);
+	skip = jcc(e, X86_JE);
+	exitBlock(e, pc, cycles);
+	patch(skip, e->p);
+}
+
+static void storeGuest(Emitter* e)
+{
+	storeCPU8(e, REG_A, OFF_A);
+	storeCPU16(e, REG_BC, OFF_BC);
+	storeCPU16(e, REG_DE, OFF_DE);
+	storeCPU16(e, REG_HL, OFF_HL);
+}
+
+static void loadGuest(Emitter* e)
+{
+	loadCPU8(e, REG_A, OFF_A);
+	loadCPU16(e, REG_BC, OFF_BC);
+	loadCPU16(e, REG_DE, OFF_DE);
+	loadCPU16(e, REG_HL, OFF_HL);
+}
+
+// --- Operands ---
+
+// Host register holding the pair an 8-bit guest register is half of.
+static int pairOf(int operand)
+{
+	switch(operand)
+	{
+		case R_B: case R_C: return REG_BC;
+		case R_D: case R_E: return REG_DE;
+		default: return REG_HL;
+	}
+}
+
+static int isHigh(int operand)
+{
+	return operand == R_B || operand == R_D || operand == R_H;
+}
+
+// Puts the address of a memory operand in edi. Returns 0 if operand is not
+// in memory.
+static int memAddress(Emitter* e, int operand, uint16_t imm)
+{
+	switch(operand)
+	{
+		case R_HLI: movRR(e, RDI, REG_HL); return 1;
+		case M_BC: movRR(e, RDI, REG_BC); return 1;
+		case M_DE: movRR(e, RDI, REG_DE); return 1;
+		case M_HLP:
+		case M_HLM:
+			movRR(e, RDI, REG_HL);
+			aluImm(e, operand == M_HLP ? ALU_ADD : ALU_SUB, REG_HL, 1);
+			aluImm(e, ALU_AND, REG_HL, 0xFFFF);
+			return 1;
+		case M_A8: movImm(e, RDI, 0xFF00 + (imm & 0xFF)); return 1;
+		case M_A16: movImm(e, RDI, imm); return 1;
+		default: return 0;
+	}
+}
+
+static int canWrite8(int operand)
+{
+	return (operand >= R_B && operand <= R_A) || operand == M_BC || operand == M_DE ||
+		operand == M_HLP || operand == M_HLM || operand == M_A8 || operand == M_A16;
+}
+
+static int canRead8(int operand)
+{
+	return canWrite8(operand) || operand == I_D8;
+}
+
+// Loads an 8-bit operand into eax.
+static void readOperand(Emitter* e, int operand, uint16_t imm)
+{
+	if(operand == I_D8)
+		movImm(e, RAX, imm & 0xFF);
+	else if(memAddress(e, operand, imm))
+	{
+		movImm(e, RSI, e->before);
+		call(e, jitRead);
+		movzx8(e, RAX, RAX);
+	}
+	else if(operand == R_A)
+		movzx8(e, RAX, REG_A);
+	else if(isHigh(operand))
+	{
+		movRR(e, RAX, pairOf(operand));
+		shiftImm(e, SHIFT_SHR, RAX, 8);
+	}
+	else
+		movzx8(e, RAX, pairOf(operand));
+}
+
+// Stores al into an 8-bit operand. pc and cycles say where to leave the
+// block if the store hits decoded code.
+static void writeOperand(Emitter* e, int operand, uint16_t imm, uint16_t pc, int cycles)
+{
+	if(memAddress(e, operand, imm))
+	{
+		movzx8(e, RSI, RAX);
+		movImm(e, RDX, e->before);
+		call(e, jitWrite);
+		exitIfCodeWritten(e, pc, cycles);
+	}
+	else if(operand == R_A)
+		movzx8(e, REG_A, RAX);
+	else
+	{
+		int pair = pairOf(operand);
+
+		movzx8(e, RAX, RAX);
+		if(isHigh(operand))
+		{
+			shiftImm(e, SHIFT_SHL, RAX, 8);
+			aluImm(e, ALU_AND, pair, 0xFF);
+		}
+		else
+			aluImm(e, ALU_AND, pair, 0xFF00);
+		orRR(e, pair, RAX);
+	}
+}
+
+// Host register for a 16-bit guest register, or -1 if it is not pinned.
+static int reg16(int operand)
+{
+	switch(operand)
+	{
+		case R_BC: return REG_BC;
+		case R_DE: return REG_DE;
+		case R_HL: return REG_HL;
+		default: return -1;
+	}
+}
+
+// --- Translation ---
+
+// Calls an ALU helper on A and the value in eax.
+static void alu(Emitter* e, void* fn, int keep)
+{
+	movzx8(e, RSI, RAX);
+	movzx8(e, RDI, REG_A);
+	call(e, fn);
+	if(keep)
+		movzx8(e, REG_A, RAX);
+}
+
+// Translates a jump that ends the block. used is the block's cycles so far,
+// including the jump's own untaken cycles.
+static void translateJump(Emitter* e, const MicroOp* op, const OpcodeInfo* info, int used)
+{
+	int taken = used - info->cycles + info->cyclesTaken;
+	uint16_t target = info->kind == KIND_JR ? op->next + (int8_t) op->imm : op->imm;
+	uint8_t* notTaken = 0;
+
+	switch(info->dst)
+	{
+		case CC_NZ: testCPU8Imm(e, OFF_F, FLAG_Z); notTaken = jcc(e, X86_JNE); break;
+		case CC_Z: testCPU8Imm(e, OFF_F, FLAG_Z); notTaken = jcc(e, X86_JE); break;
+		case CC_NC: testCPU8Imm(e, OFF_F, FLAG_C); notTaken = jcc(e, X86_JNE); break;
+		case CC_C: testCPU8Imm(e, OFF_F, FLAG_C); notTaken = jcc(e, X86_JE); break;
+	}
+
+	if(info->src == R_HL)
+	{
+		storeCPU16(e, REG_HL, OFF_PC);
+		movImm(e, RAX, taken);
+		jmpEpilogue(e);
+	}
+	else
+		exitBlock(e, target, taken);
+
+	if(notTaken)
+	{
+		patch(notTaken, e->p);
+		exitBlock(e, op->next, used);
+	}
+}
+
+// Emits native code for op. Returns 0 if it has to go through the
+// interpreter instead.
+static int translate(Emitter* e, const MicroOp* op, int used)
+{
+	const OpcodeInfo* info = &opcodeInfo[op->opcode];
+	int dst = info->dst, src = info->src;
+
+	switch(info->kind)
+	{
+		case KIND_NOP:
+			return 1;
+
+		case KIND_LD:
+			if(!canRead8(src) || !canWrite8(dst))
+				return 0;
+			readOperand(e, src, op->imm);
+			writeOperand(e, dst, op->imm, op->next, used);
+			return 1;
+
+		case KIND_LD16:
+			if(src != I_D16)
+				return 0;
+			if(dst == R_SP)
+				storeCPU16Imm(e, OFF_SP, op->imm);
+			else if(reg16(dst) >= 0)
+				movImm(e, reg16(dst), op->imm);
+			else
+				return 0;
+			return 1;
+
+		case KIND_INC16:
+		case KIND_DEC16:
+			if(reg16(dst) < 0)
+				return 0;
+			aluImm(e, info->kind == KIND_INC16 ? ALU_ADD : ALU_SUB, reg16(dst), 1);
+			aluImm(e, ALU_AND, reg16(dst), 0xFFFF);
+			return 1;
+
+		case KIND_ADD: case KIND_SUB: case KIND_AND: case KIND_XOR:
+		case KIND_OR: case KIND_CP:
+			if(!canRead8(src))
+				return 0;
+			readOperand(e, src, op->imm);
+			switch(info->kind)
+			{
+				case KIND_ADD: alu(e, add8, 1); break;
+				case KIND_SUB: alu(e, sub8, 1); break;
+				case KIND_AND: alu(e, and8, 1); break;
+				case KIND_XOR: alu(e, xor8, 1); break;
+				case KIND_OR: alu(e, or8, 1); break;
+				case KIND_CP: alu(e, sub8, 0); break;
+			}
+			return 1;
+
+		case KIND_INC:
+		case KIND_DEC:
+			if(!canWrite8(dst))
+				return 0;
+			readOperand(e, dst, op->imm);
+			movzx8(e, RDI, RAX);
+			call(e, info->kind == KIND_INC ? (void*) inc8 : (void*) dec8);
+			writeOperand(e, dst, op->imm, op->next, used);
+			return 1;
+
+		case KIND_JP:
+		case KIND_JR:
+			if(src != I_D16 && src != I_R8 && src != R_HL)
+				return 0;
+			translateJump(e, op, info, used);
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+void jitCompile(Block* block)
+{
+	BlockCache* cache = gb->blocks;
+	Emitter e;
+	uint8_t* start;
+	int used = 0;
+	int ended = 0;
+
+	if(!cache->code)
+	{
+		void* code = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(code == MAP_FAILED)
+			return;
+		cache->code = (uint8_t*) code;
+	}
+
+	// Out of room. Translations of blocks dropped by invalidateCode() are
+	// only reclaimed here, by starting over; this block gets translated
+	// again once it is hot again.
+	if(cache->codeUsed + JIT_MAX_BLOCK > JIT_BUFFER_SIZE)
+	{
+		flushBlocks();
+		return;
+	}
+
+	e.p = start = cache->code + cache->codeUsed;
+	e.fixupCount = 0;
+
+	pushReg(&e, RBX);
+	pushReg(&e, R12);
+	pushReg(&e, R13);
+	pushReg(&e, R14);
+	pushReg(&e, R15);
+	movRR64(&e, REG_CPU, RDI);
+	loadGuest(&e);
+
+	for(int i = 0; i < block->count; i++)
+	{
+		const MicroOp* op = &block->ops[i];
+		int last = i == block->count - 1;
+
+		e.before = used;
+		used += op->cycles;
+
+		if(translate(&e, op, used))
+		{
+			if(last && endsBlock(&opcodeInfo[op->opcode]))
+				ended = 1;
+			continue;
+		}
+
+		storeGuest(&e);
+		movImm64(&e, RDI, (uint64_t) op);
+
+		if(last && endsBlock(&opcodeInfo[op->opcode]))
+		{
+			// The interpreter sets PC and returns the cycles, which may
+			// include a taken branch.
+			movImm(&e, RSI, used - op->cycles);
+			call(&e, jitFallbackLast);
+			loadGuest(&e);
+			aluImm(&e, ALU_ADD, RAX, used - op->cycles);
+			jmpEpilogue(&e);
+			ended = 1;
+		}
+		else
+		{
+			movImm(&e, RSI, used - op->cycles);
+			call(&e, jitFallback);
+			loadGuest(&e);
+			exitIfCodeWritten(&e, op->next, used);
+		}
+	}
+
+	if(!ended)
+		exitBlock(&e, block->ops[block->count - 1].next, used);
+
+	for(int i = 0; i < e.fixupCount; i++)
+		patch(e.fixups[i], e.p);
+	storeGuest(&e);
+	popReg(&e, R15);
+	popReg(&e, R14);
+	popReg(&e, R13);
+	popReg(&e, R12);
+	popReg(&e, RBX);
+	emit8(&e, 0xC3);
+
+	cache->codeUsed = (e.p - cache->code + 15) & ~15;
+	block->code = (int (*)(void*)) start;
+}
+
+void jitFree(BlockCache* cache)
+{
+	if(cache->code)
+		munmap(cache->code, JIT_BUFFER_SIZE);
+	cache->code = 0;
+}
+
+#endif
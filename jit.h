@@ -0,0 +1,24 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "block.h"
+
+// x86-64 translation of hot blocks, in JIT builds (make DISPATCH=jit).
+//
+// A translated block is called with &gb->cpu and returns the cycles it
+// took. Guest A, BC, DE and HL live in r12-r15 for the length of the block.
+// Loads, register moves, 8-bit ALU ops, INC/DEC and relative and absolute
+// jumps are translated; everything else calls back into executeDecoded().
+
+// Blocks run this many times in the interpreter before being translated.
+extern int jitHotness;
+
+// Translates block into native code and sets block->code. Leaves it unset
+// if the translation does not fit in the code buffer. A block dropped by
+// invalidateCode() loses only its own translation.
+void jitCompile(Block* block);
+
+// Releases the code buffer of a block cache.
+void jitFree(BlockCache* cache);
+
+#endif
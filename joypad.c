@@ -0,0 +1,34 @@
+#include "joypad.h"
+#include "interrupt.h"
+#include "machine.h"
+
+// The keys of buttons that P1 selects, in its low bits.
+static uint8_t selected(uint8_t buttons)
+{
+	uint8_t p1 = gb->memory[0xFF00], keys = 0;
+
+	if(!(p1 & 0x10))
+		keys |= buttons & 0x0F;
+	if(!(p1 & 0x20))
+		keys |= buttons >> 4;
+	return keys;
+}
+
+void joypadSet(uint8_t buttons)
+{
+	uint8_t pressed = buttons & ~gb->buttons;
+
+	gb->buttons = buttons;
+	if(selected(pressed))
+		requestInterrupt(INT_JOYPAD);
+}
+
+uint8_t joypadRead()
+{
+	return 0xC0 | (gb->memory[0xFF00] & 0x30) | (~selected(gb->buttons) & 0x0F);
+}
+
+void joypadWrite(uint8_t value)
+{
+	gb->memory[0xFF00] = value & 0x30;
+}
@@ -0,0 +1,30 @@
+#ifndef JOYPAD_H
+#define JOYPAD_H
+
+#include <stdint.h>
+
+// The joypad, P1 (0xFF00). Bits 4 and 5 select the direction keys and
+// the buttons, each when 0, and the low bits read 0 for the selected keys
+// held down. Pressing a key in a selected group requests INT_JOYPAD.
+//
+// What is held down is the host's input, set between frames, so it is not
+// part of save states.
+
+// Keys, as bits of gb->buttons.
+#define JOYPAD_RIGHT 0x01
+#define JOYPAD_LEFT 0x02
+#define JOYPAD_UP 0x04
+#define JOYPAD_DOWN 0x08
+#define JOYPAD_A 0x10
+#define JOYPAD_B 0x20
+#define JOYPAD_SELECT 0x40
+#define JOYPAD_START 0x80
+
+// Sets the keys held down.
+void joypadSet(uint8_t buttons);
+
+// Reads and writes P1.
+uint8_t joypadRead();
+void joypadWrite(uint8_t value);
+
+#endif
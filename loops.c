@@ -0,0 +1,269 @@
+#include "loops.h"
+#include "cpu.h"
+#include "execute.h"
+#include "opcodes.h"
+#include <string.h>
+
+// Longest loop, in bytes, checked for being a spin loop.
+#define SPIN_MAX_LENGTH 16
+
+int loopIdioms = 1;
+
+static const uint8_t copyLoop16[] = {0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8};
+
+// 1 if opcode is DEC B, C, D or E, whose operand is R_B + (opcode >> 3).
+static int decCounter(uint8_t opcode)
+{
+	return (opcode & 0xC7) == 0x05 && opcode < 0x20;
+}
+
+// 1 if writing n bytes from address would overwrite the loop itself.
+static int overwritesLoop(uint16_t address, int n, uint16_t start, int length)
+{
+	for(int i = 0; i < length; i++)
+		if((uint16_t) (start + i - address) < n)
+			return 1;
+	return 0;
+}
+
+// How many of the n iterations left, each taking cycles and the last 4
+// fewer, can run before the next event is due, elapsed cycles after
+// gb->cycles. When that is not all of them, the rest are left to run an
+// instruction at a time from the top of the loop, so the event comes
+// between the same two instructions as it would have without the idiom.
+static int batch(uint16_t start, int n, int cycles, int elapsed)
+{
+	uint64_t now = gb->cycles + elapsed;
+	uint64_t room = gb->nextEvent > now ? gb->nextEvent - now : 0;
+
+	if(room >= (uint64_t) n * cycles - 4)
+		return n;
+	setPC(start);
+	return room / cycles;
+}
+
+// Copy with a 16-bit counter in BC. 52 cycles an iteration, 48 for the
+// last. Each iteration ends with A = B | C and the flags of that OR.
+static int copy16(uint16_t start, int length, int elapsed)
+{
+	int n = BC(), k;
+
+	if(overwritesLoop(DE(), n, start, length))
+		return 0;
+
+	k = batch(start, n, 52, elapsed);
+	if(!k)
+		return 0;
+	copyMem(DE(), HL(), k);
+	setHL(HL() + k);
+	setDE(DE() + k);
+	setBC(n - k);
+	setA(or8(B(), C()));
+	return k < n ? k * 52 : n * 52 - 4;
+}
+
+// Copy with an 8-bit counter. 40 cycles an iteration, 36 for the last.
+// Each iteration ends with A holding the byte it copied.
+static int copy8(uint16_t start, int length, int counter, int elapsed)
+{
+	int n = read8(counter, 0), k;
+
+	if(overwritesLoop(DE(), n, start, length))
+		return 0;
+
+	k = batch(start, n, 40, elapsed);
+	if(!k)
+		return 0;
+	setA(copyMem(DE(), HL(), k));
+	setHL(HL() + k);
+	setDE(DE() + k);
+	write8(counter, dec8(n - k + 1), 0);
+	return k < n ? k * 40 : n * 40 - 4;
+}
+
+// Fill upwards (step 1) or downwards (step -1) from HL. 24 cycles an
+// iteration, 20 for the last.
+static int fill(uint16_t start, int length, int counter, int step, int elapsed)
+{
+	int n = read8(counter, 0), k;
+	uint16_t low = step > 0 ? HL() : HL() - (n - 1);
+
+	if(overwritesLoop(low, n, start, length))
+		return 0;
+
+	k = batch(start, n, 24, elapsed);
+	if(!k)
+		return 0;
+	low = step > 0 ? HL() : HL() - (k - 1);
+	fillMem(low, A(), k);
+	setHL(HL() + step * k);
+	write8(counter, dec8(n - k + 1), 0);
+	return k < n ? k * 24 : n * 24 - 4;
+}
+
+// Registers an operand reads, as a mask of 1 << (register - R_B). -1 if
+// reading it has side effects.
+static int operandReads(int operand)
+{
+	switch(operand)
+	{
+		case R_B: case R_C: case R_D: case R_E: case R_H: case R_L: case R_A:
+			return 1 << (operand - R_B);
+		case R_HLI: return 1 << (R_H - R_B) | 1 << (R_L - R_B);
+		case M_BC: return 1 << (R_B - R_B) | 1 << (R_C - R_B);
+		case M_DE: return 1 << (R_D - R_B) | 1 << (R_E - R_B);
+		case M_C: return 1 << (R_C - R_B);
+		case M_A8: case M_A16: case I_D8: return 0;
+		default: return -1;
+	}
+}
+
+// 1 if the byte at address only changes when the CPU writes it or an event
+// runs: plain memory and HRAM. The I/O registers are left out, since DIV,
+// TIMA, LY and the STAT mode, among others, are worked out from the cycle
+// count when read and have no event of their own.
+static int spinReadable(uint16_t address)
+{
+	if(address >= 0xFF00)
+		return address >= 0xFF80 && address < 0xFFFF;
+	return gb->readMap[address >> 8] != 0;
+}
+
+// The address the operand of the instruction at pc reads from, as it is
+// now, or -1 if the operand is not in memory.
+static int operandAddress(int operand, uint16_t pc)
+{
+	switch(operand)
+	{
+		case R_HLI: return HL();
+		case M_BC: return BC();
+		case M_DE: return DE();
+		case M_C: return 0xFF00 | C();
+		case M_A8: return 0xFF00 | readMem(pc + 1);
+		case M_A16: return readMem16(pc + 1);
+		default: return -1;
+	}
+}
+
+// Returns the cycles one iteration of the loop from start to the JR at
+// branch takes, if the loop only reads memory and sets registers from what
+// it read. Once such a loop has gone round once, every further iteration
+// does exactly the same thing until something else changes memory.
+// Returns 0 for any other loop.
+static int spinCycles(uint16_t start, uint16_t branch)
+{
+	int read = 0, written = 0;
+	int cycles = opcodeInfo[0x20].cyclesTaken;
+	uint16_t pc = start;
+
+	while(pc != branch)
+	{
+		const OpcodeInfo* info = opcodeAt(pc);
+		int uses, sets = 0, from = info->src, address;
+
+		if((uint16_t) (branch - pc) < info->length)
+			return 0;
+
+		switch(info->kind)
+		{
+			case KIND_NOP:
+				uses = 0;
+				break;
+			case KIND_LD:
+				if(info->dst < R_B || info->dst > R_A || info->dst == R_HLI)
+					return 0;
+				uses = operandReads(info->src);
+				sets = operandReads(info->dst);
+				break;
+			case KIND_AND: case KIND_OR: case KIND_XOR:
+				sets = 1 << (R_A - R_B);
+				// Fall through
+			case KIND_CP:
+				uses = operandReads(info->src) | 1 << (R_A - R_B);
+				break;
+			case KIND_BIT:
+				from = info->dst;
+				uses = operandReads(from);
+				break;
+			default:
+				return 0;
+		}
+
+		if(uses < 0)
+			return 0;
+
+		// What it reads has to be somewhere only an event can change, at an
+		// address that stays the same every time round.
+		address = operandAddress(from, pc);
+		if(address >= 0 && ((operandReads(from) & written) || !spinReadable(address)))
+			return 0;
+		read |= uses & ~written;
+		written |= sets;
+		cycles += info->cycles;
+		pc += info->length;
+	}
+
+	// A register the loop sets must not carry over between iterations.
+	return (read & written) ? 0 : cycles;
+}
+
+// Skips whole iterations of a spin loop up to the next event or the end of
+// the run, leaving PC at the top of the loop. With neither in sight the
+// loop just goes on running.
+static int skipSpin(uint16_t start, int iteration, int elapsed)
+{
+	uint64_t now = gb->cycles + elapsed;
+	uint64_t skip;
+
+	setPC(start);
+	if(gb->nextEvent == EVENT_NEVER || gb->nextEvent <= now)
+		return 0;
+
+	skip = (gb->nextEvent - now) / iteration;
+	if(skip > (1 << 30) / iteration)
+		skip = (1 << 30) / iteration;
+	return skip * iteration;
+}
+
+int runLoopIdiom(uint16_t branch, int elapsed)
+{
+	uint16_t start = holdPC();
+	int length = (uint16_t) (branch + 2 - start);
+	uint8_t code[sizeof(copyLoop16)];
+	int cycles = 0;
+
+	if(!loopIdioms)
+		return 0;
+
+	if(length <= sizeof(code))
+	{
+		for(int i = 0; i < length; i++)
+			code[i] = readMem(start + i);
+
+		// The loops end when the branch falls through.
+		setPC(branch + 2);
+
+		if(length == 8 && !memcmp(code, copyLoop16, length))
+			cycles = copy16(start, length, elapsed);
+		else if(length == 6 && code[0] == 0x2A && code[1] == 0x12 && code[2] == 0x13 &&
+			(code[3] == 0x05 || code[3] == 0x0D) && code[4] == 0x20)
+			cycles = copy8(start, length, R_B + (code[3] >> 3), elapsed);
+		else if(length == 4 && (code[0] == 0x22 || code[0] == 0x32) && decCounter(code[1]) &&
+			code[2] == 0x20)
+			cycles = fill(start, length, R_B + (code[1] >> 3), code[0] == 0x22 ? 1 : -1, elapsed);
+
+		if(cycles)
+			return cycles;
+		setPC(start);
+	}
+
+	if(length <= SPIN_MAX_LENGTH)
+	{
+		int iteration = spinCycles(start, branch);
+
+		if(iteration)
+			return skipSpin(start, iteration, elapsed);
+	}
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef LOOPS_H
+#define LOOPS_H
+
+#include <stdint.h>
+
+// Recognises a few loops that games spend a lot of time in and runs the
+// rest of them at once instead of an instruction at a time:
+//
+//   copy:  LD A,(HL+) / LD (DE),A / INC DE / DEC BC / LD A,B / OR C / JR NZ
+//          LD A,(HL+) / LD (DE),A / INC DE / DEC B or C / JR NZ
+//   fill:  LD (HL+),A or LD (HL-),A / DEC B, C, D or E / JR NZ
+//
+// It also spots spin loops, which only read memory and compare what they
+// read, like LDH A,(a8) / CP d8 / JR NZ or BIT n,(HL) / JR Z. When what
+// they read is plain memory or HRAM only an event can change it, so they
+// skip straight to the next one or to the end of the run. Loops that poll
+// an I/O register run as they are.
+//
+// The check happens when a JR jumps backwards, so the first iteration
+// always runs normally. A copy or fill only runs the iterations that end
+// before the next event and leaves the rest to the interpreter, so events
+// and interrupts still come when they are due. Registers, memory, flags
+// and cycles end up exactly as if every iteration had been executed.
+
+// Set to 0 to run every loop an instruction at a time.
+extern int loopIdioms;
+
+// Called after the JR at branch has jumped back to PC, elapsed cycles after
+// gb->cycles. If the loop is one of the idioms, runs what is left of it up
+// to the next event, leaves PC where the loop exits or at its top, and
+// returns the cycles that took. Otherwise returns 0 and changes nothing.
+int runLoopIdiom(uint16_t branch, int elapsed);
+
+#endif
@@ -0,0 +1,9 @@
+#include "machine.h"
+
+Machine defaultMachine;
+Machine* gb = &defaultMachine;
+
+void machineSelect(Machine* m)
+{
+	gb = m;
+}
@@ -0,0 +1,193 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Handle reads and writes of memory pages that are not plain RAM.
+typedef uint8_t (*ReadHandler)(uint16_t address);
+typedef void (*WriteHandler)(uint16_t address, uint8_t value);
+
+// A register pair. Assumes a little-endian host so the pair can be read
+// and written as one 16-bit word.
+typedef union {
+	uint16_t word;
+	struct {
+		uint8_t low, high;
+	};
+} Pair;
+
+typedef struct {
+	Pair AF, BC, DE, HL;
+	uint16_t SP, PC;
+	uint8_t IME; // Interrupt master enable
+	uint8_t waiting; // HALT is waiting for an interrupt, PC still on it.
+
+	// The last flag-setting ALU operation in LAZY_FLAGS builds, see cpu.h.
+	uint8_t flagOp, flagCarry;
+	uint8_t flagBase; // Eager flags are checked against this copy of F.
+	uint16_t flagX, flagY;
+	int flagResult;
+} CPUState;
+
+// The inserted cartridge, see cart.h.
+typedef struct {
+	const uint8_t* rom; // Read-only mapping of the ROM file, 0 if none.
+	size_t romSize;
+	int romBanks;       // 16K each
+	uint8_t* ram;       // External RAM
+	int ramBanks;       // 8K each
+	uint8_t mbc;
+
+	// The MBC's registers as last written, see cart.c.
+	uint8_t ramEnabled;
+	uint16_t romSelect;
+	uint8_t ramSelect;
+	uint8_t mode;
+
+	// MBC3 clock: rtcBase seconds at cycle rtcCycles, the halt and day
+	// carry bits of its last register, and the latched registers.
+	uint64_t rtcBase, rtcCycles;
+	uint8_t rtcFlags;
+	uint8_t rtc[5];
+} Cartridge;
+
+// The timer, see timer.h. TIMA held tima at cycle timaCycle and the
+// divider was reset at cycle divBase.
+typedef struct {
+	uint64_t divBase;
+	uint64_t timaCycle;
+	uint64_t reloadAt; // TIMA overflowed and is reloaded then, or EVENT_NEVER.
+	uint8_t tima, tma, tac;
+} Timer;
+
+// The LCD, see ppu.h. Its registers are kept in memory at 0xFF40-0xFF4B
+// and its VRAM, tiles and framebuffer in the Video it points at.
+typedef struct {
+	uint64_t frameStart; // Cycle the LCD was last turned on at.
+	uint64_t frames;     // Frames finished, counted at VBlank.
+	uint8_t windowLine;  // Lines of the window drawn this frame.
+	uint8_t vramBank;
+
+	// Which frames are drawn (RENDER_ in ppu.h), and whether this one is.
+	uint8_t renderPolicy;
+	int renderEvery;
+	uint8_t frameRequested;
+	uint8_t drawing;
+} Ppu;
+
+// CGB HDMA, see dma.h. dest is an offset into VRAM.
+typedef struct {
+	uint16_t source, dest;
+	uint8_t control; // HDMA5 as it reads: blocks left less one, bit 7 set when idle.
+} Hdma;
+
+// nextEvent when nothing is scheduled.
+#define EVENT_NEVER UINT64_MAX
+
+// Pages of memory a save state holds, 256 bytes each: all 64K of memory
+// from 0, both VRAM banks from PAGES_VRAM and up to 16 8K banks of
+// cartridge RAM from PAGES_CART. See memory.h.
+#define PAGES_VRAM 0x100
+#define PAGES_CART 0x140
+#define STATE_PAGES 0x340
+
+// Things that happen at a set time, see sched.h. Each can be scheduled once.
+typedef enum {
+	EVENT_TIMER, EVENT_PPU, EVENT_SERIAL, EVENT_DMA, EVENT_EI, EVENT_APU,
+	EVENT_COUNT
+} Event;
+
+// Called when an event is due, with the cycle it was due at.
+typedef void (*EventHandler)(uint64_t at);
+
+// Everything one emulated Gameboy owns. The accessors in cpu.h and memory.h
+// are inline and operate on the selected machine, gb.
+typedef struct {
+	CPUState cpu;
+	int halt;
+
+	// IE & IF while IME is set, see interrupt.h.
+	uint8_t interrupts;
+
+	// The keys held down, see joypad.h.
+	uint8_t buttons;
+
+	// Clock cycles since power on, up to the start of the instruction
+	// running now, and the cycle the next timed event is due at. Time
+	// spent waiting on HALT or in a spin loop can be skipped up to it.
+	uint64_t cycles;
+	uint64_t nextEvent;
+
+	// When each event is due (EVENT_NEVER if it is not scheduled) and
+	// what runs it, and where the current runFor() stops. See sched.h.
+	uint64_t eventAt[EVENT_COUNT];
+	EventHandler eventHandler[EVENT_COUNT];
+	uint64_t runEnd;
+
+	// The actual memory of the Gameboy. Addresses are 16-bits and each
+	// address hold 8-bits
+	uint8_t* memory;
+
+	// The memory map, one entry per 256-byte page. readMap and writeMap
+	// point at the host memory behind a page, less the page's address so
+	// the whole address indexes it, or are 0 if accesses to it go through
+	// the page's handler instead. See memory.h.
+	uint8_t* readMap[256];
+	uint8_t* writeMap[256];
+	ReadHandler readHandler[256];
+	WriteHandler writeHandler[256];
+
+	// Dirty pages, see memory.h: the state page each page of the map
+	// writes to (STATE_PAGES if none), the epoch each state page was last
+	// written in, and the epoch now.
+	uint16_t statePage[256];
+	uint32_t pageEpoch[STATE_PAGES + 1];
+	uint32_t epoch;
+
+	// stateHash()'s hash of each state page, their sum, and the epoch it
+	// last hashed them in. See state.h.
+	uint64_t pageHash[STATE_PAGES];
+	uint64_t pagesHash;
+	uint32_t hashEpoch;
+
+	Timer timer;
+	Ppu ppu;
+	struct Video* video;
+	Hdma hdma;
+
+	// The sound circuit and its output, see apu.h.
+	struct Audio* audio;
+
+	// Recent frames to go back to, see rewind.h. 0 until rewindStart().
+	struct Rewind* rewind;
+
+	// The state runAhead() goes back to each frame, see runahead.h.
+	uint8_t* aheadState;
+	size_t aheadSize;
+
+	// The movie recorded or replayed, see movie.h. 0 until movieRecord()
+	// or movieLoad().
+	struct Movie* movie;
+
+	// ROM bank mapped at 0x4000-0x7FFF.
+	int romBank;
+	Cartridge cart;
+
+	// Decoded blocks in BLOCK_CACHE builds, see block.h. codePages marks the
+	// 256-byte pages blocks were decoded from, codeMap has a bit for each
+	// byte of them and codeWritten is set when one of those bytes is written.
+	struct BlockCache* blocks;
+	uint8_t codePages[256];
+	uint8_t codeMap[256][32];
+	uint8_t codeWritten;
+} Machine;
+
+// The machine the core is currently running. Starts out pointing at a
+// default machine so single-instance programs never need to touch it.
+extern Machine* gb;
+
+// Makes m the machine the core runs.
+void machineSelect(Machine* m);
+
+#endif
@@ -1,9 +1,95 @@
+#include "apu.h"
+#include "cart.h"
 #include "cpu.h"
+#include "movie.h"
+#include "ppu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef AOT
+#include "aot.h"
+#endif
 
+#ifndef AOT
+#define WAV_RATE 48000
+
+// Runs for seconds without drawing, writing the sound to path.
+static int recordAudio(const char* path, int seconds)
+{
+	int16_t samples[2 * 4096];
+	FILE* file = wavOpen(path, WAV_RATE);
+	int count;
+
+	if(!file)
+	{
+		perror(path);
+		return 1;
+	}
+	ppuSetRenderPolicy(RENDER_ON_DEMAND, 0);
+	CPUStateInit();
+	apuSetRate(WAV_RATE);
+	while(gb->cycles < (uint64_t) seconds * APU_CLOCK && !halted())
+	{
+		runFrame();
+		while((count = apuReadSamples(samples, 4096)) > 0)
+			wavWrite(file, samples, count);
+	}
+	wavClose(file);
+	return 0;
+}
+
+// Replays the movie at path without drawing and reports whether this build
+// still runs it as the one that recorded it did.
+static int replayMovie(const char* path)
+{
+	struct timespec start, end;
+	double seconds;
+	int frame;
+
+	if(!movieLoad(path))
+		return 1;
+	ppuSetRenderPolicy(RENDER_ON_DEMAND, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	frame = movieReplay();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if(frame < 0)
+	{
+		fprintf(stderr, "%s: recorded from another game or version\n", path);
+		return 1;
+	}
+	if(frame)
+	{
+		printf("%s: diverged by frame %d, after %.3f s\n", path, frame, seconds);
+		return 1;
+	}
+	printf("%s: %d frames matched in %.3f s, %.0f fps\n", path, movieFrames(), seconds,
+		movieFrames() / seconds);
+	return 0;
+}
+#endif
+
+// run game.gb plays the game. run game.gb out.wav seconds runs it headless
+// and writes what it played to out.wav. run game.gb movie.gbm replays a
+// movie recorded with movie.h and checks it.
 int main(int argc, char* argv[])
 {
+	int status = 0;
+
 	memInit();
-	CPU();
+	if(argc > 1 && !cartLoad(argv[1]))
+		return 1;
+#ifdef AOT
+	status = !runAOT();
+#else
+	if(argc > 3)
+		status = recordAudio(argv[2], atoi(argv[3]));
+	else if(argc > 2)
+		status = replayMovie(argv[2]);
+	else
+		CPU();
+#endif
 	memFree();
-	return 0;
-}
\ No newline at end of file
+	return status;
+}
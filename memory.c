@@ -1,38 +1,311 @@
 #include "memory.h"
+#include "apu.h"
+#include "block.h"
+#include "cart.h"
+#include "dma.h"
+#include "interrupt.h"
+#include "joypad.h"
+#include "opcodes.h"
+#include "ppu.h"
+#include "movie.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "timer.h"
 #include <stdlib.h>
+#include <string.h>
 
-// The actual memory of the Gameboy. Addresses are 16-bits and each address
-// hold 8-bits
-uint8_t *memory;
+// The 0xFF page: I/O registers, HRAM and IE. Registers nothing is
+// emulated behind read back what was written. Code can run from HRAM.
+static uint8_t readIO(uint16_t address)
+{
+	if(address >= 0xFF10 && address < 0xFF40)
+		return apuRead(address);
+	switch(address)
+	{
+		case 0xFF00:
+			return joypadRead();
+		case 0xFF04: case 0xFF05: case 0xFF06: case 0xFF07:
+			return timerRead(address);
+		case 0xFF0F:
+			// The top three bits are not wired.
+			timerUpdate();
+			return gb->memory[address] | 0xE0;
+		case 0xFF41: case 0xFF44: case 0xFF4F:
+			return ppuRead(address);
+		case 0xFF46: case 0xFF51: case 0xFF52: case 0xFF53: case 0xFF54: case 0xFF55:
+			return dmaRead(address);
+	}
+	return gb->memory[address];
+}
+
+static void writeIO(uint16_t address, uint8_t value)
+{
+	if(address >= 0xFF10 && address < 0xFF40)
+	{
+		apuWrite(address, value);
+		return;
+	}
+	switch(address)
+	{
+		case 0xFF00:
+			joypadWrite(value);
+			return;
+		case 0xFF04: case 0xFF05: case 0xFF06: case 0xFF07:
+			timerWrite(address, value);
+			return;
+		case 0xFF40: case 0xFF41: case 0xFF44: case 0xFF4F:
+			ppuWrite(address, value);
+			return;
+		case 0xFF46: case 0xFF51: case 0xFF52: case 0xFF53: case 0xFF54: case 0xFF55:
+			dmaWrite(address, value);
+			return;
+		case 0xFF0F:
+			// An overflow that is due lands before the write.
+			timerUpdate();
+			gb->memory[address] = value;
+			updateInterrupts();
+			return;
+		case 0xFFFF:
+			gb->memory[address] = value;
+			updateInterrupts();
+			return;
+	}
+	// Of this page, only HRAM can hold code.
+	if(address >= 0xFF80 && gb->codePages[0xFF])
+		invalidateCode(address);
+	gb->memory[address] = value;
+}
+
+// A plain page blocks were decoded from, or one not yet written this epoch.
+// The read pointer still points at its memory. writeHandled() stamps it.
+static void writeWatched(uint16_t address, uint8_t value)
+{
+	int page = address >> 8;
+
+	invalidateCode(address);
+	gb->readMap[page][address] = value;
+	if(!gb->codePages[page])
+		gb->writeMap[page] = gb->readMap[page];
+}
+
+// The state page host memory at p is, or STATE_PAGES if it is not part
+// of the state.
+static int statePageOf(const uint8_t* p)
+{
+	const Cartridge* cart = &gb->cart;
+
+	if(p >= gb->memory && p < gb->memory + 0x10000)
+		return (p - gb->memory) >> 8;
+	if(gb->video && p >= gb->video->vram[0] && p < gb->video->vram[0] + sizeof(gb->video->vram))
+		return PAGES_VRAM + ((p - gb->video->vram[0]) >> 8);
+	if(cart->ram && p >= cart->ram && p < cart->ram + cart->ramBanks * 0x2000)
+		return PAGES_CART + ((p - cart->ram) >> 8);
+	return STATE_PAGES;
+}
 
 void memInit()
 {
-	memory = (uint8_t*) malloc(65536);
+	gb->memory = (uint8_t*) calloc(65536, 1);
+	gb->romBank = 1;
+	gb->epoch = 1;
+
+	mapPages(0x00, 0xE0, gb->memory, gb->memory);
+	mapPages(0xE0, 0x1E, gb->memory + 0xC000, gb->memory + 0xC000);
+	mapPages(0xFE, 1, gb->memory + 0xFE00, gb->memory + 0xFE00);
+	setHandlers(0xFF, 1, readIO, writeIO);
+	mapPages(0xFF, 1, 0, 0);
+	ppuInit();
+	apuInit();
+
+	flushBlocks();
+	dirtyAll();
 }
 
 void memFree()
 {
-	free(memory);
+	rewindStop();
+	movieStop();
+	runAheadFree();
+	cartFree();
+	ppuFree();
+	apuFree();
+	free(gb->memory);
+	gb->memory = 0;
+	freeBlocks();
 }
 
-uint8_t readMem(uint16_t address)
+uint8_t readHandled(uint16_t address)
 {
-	return memory[address];
+	return gb->readHandler[address >> 8](address);
 }
 
-void writeMem(uint16_t address, uint8_t value)
+void writeHandled(uint16_t address, uint8_t value)
 {
-	memory[address] = value;
+	gb->writeHandler[address >> 8](address, value);
+	gb->pageEpoch[gb->statePage[address >> 8]] = gb->epoch;
 }
 
-uint16_t readMem16(uint16_t address)
+uint32_t fetchSlow(uint16_t address)
 {
-	uint16_t ret = readMem(address) << 8;
-	return ret | readMem((uint16_t) (address + 1));
+	uint8_t opcode = readMem(address);
+	uint32_t bytes = opcode;
+
+	for(int i = 1; i < opcodeInfo[opcode].length; i++)
+		bytes |= readMem((uint16_t) (address + i)) << (8 * i);
+	return bytes;
+}
+
+void mapPages(int page, int count, uint8_t* read, uint8_t* write)
+{
+	for(int i = 0; i < count; i++)
+	{
+		gb->readMap[page + i] = read ? read - (page << 8) : 0;
+		gb->writeMap[page + i] = write ? write - (page << 8) : 0;
+		gb->statePage[page + i] = write ? statePageOf(write + (i << 8)) : read ? statePageOf(read + (i << 8)) : STATE_PAGES;
+		if(gb->codePages[page + i] || gb->pageEpoch[gb->statePage[page + i]] != gb->epoch)
+			watchPage(page + i);
+	}
+}
+
+void setHandlers(int page, int count, ReadHandler read, WriteHandler write)
+{
+	for(int i = 0; i < count; i++)
+	{
+		gb->readHandler[page + i] = read;
+		gb->writeHandler[page + i] = write;
+	}
+}
+
+uint32_t newEpoch()
+{
+	for(int page = 0; page < 256; page++)
+		watchPage(page);
+	return ++gb->epoch;
+}
+
+int dirtyPages(uint32_t since, uint16_t* pages)
+{
+	int count = 0;
+
+	for(int page = 0; page < STATE_PAGES; page++)
+		if(gb->pageEpoch[page] >= since || page == 0xFF)
+			pages[count++] = page;
+	return count;
+}
+
+void dirtyAll()
+{
+	for(int page = 0; page < STATE_PAGES; page++)
+		gb->pageEpoch[page] = gb->epoch;
+}
+
+void watchPage(int page)
+{
+	if(gb->writeMap[page])
+	{
+		gb->writeMap[page] = 0;
+		gb->writeHandler[page] = writeWatched;
+	}
+}
+
+void unwatchPage(int page)
+{
+	if(!gb->writeMap[page] && gb->writeHandler[page] == writeWatched && !gb->codePages[page]
+		&& gb->pageEpoch[gb->statePage[page]] == gb->epoch)
+		gb->writeMap[page] = gb->readMap[page];
+}
+
+void unwatchPages()
+{
+	for(int page = 0; page < 256; page++)
+		unwatchPage(page);
+}
+
+// Both bytes are moved at once when they are on the same plain page. The
+// host is little-endian like the Gameboy (see machine.h).
+
+uint16_t readMem16Slow(uint16_t address)
+{
+	return readMem(address) | (readMem((uint16_t) (address + 1)) << 8);
 }
 
 void writeMem16(uint16_t address, uint16_t value)
 {
-	writeMem((uint16_t) (address + 1), value);
-	writeMem(address, value >> 8);
+	uint8_t* page = gb->writeMap[address >> 8];
+
+	if(page && (address & 0xFF) != 0xFF)
+	{
+		memcpy(page + address, &value, 2);
+		return;
+	}
+	writeMem(address, value);
+	writeMem((uint16_t) (address + 1), value >> 8);
+}
+
+// Both copies and fills go a page at a time, with memmove or memset when
+// the page is plain memory.
+
+uint8_t copyMem(uint16_t dst, uint16_t src, int n)
+{
+	uint8_t value = 0;
+
+	while(n > 0)
+	{
+		int chunk = n;
+		uint8_t* from = gb->readMap[src >> 8];
+		uint8_t* to = gb->writeMap[dst >> 8];
+
+		if(chunk > 0x100 - (src & 0xFF))
+			chunk = 0x100 - (src & 0xFF);
+		if(chunk > 0x100 - (dst & 0xFF))
+			chunk = 0x100 - (dst & 0xFF);
+
+		// A forward copy only differs from memmove() when the destination
+		// starts inside the source, where it repeats the bytes between.
+		if(from && to)
+		{
+			from += src;
+			to += dst;
+		}
+		if(from && to && !(to > from && to < from + chunk))
+		{
+			memmove(to, from, chunk);
+			value = to[chunk - 1];
+		}
+		else
+		{
+			for(int i = 0; i < chunk; i++)
+			{
+				value = readMem((uint16_t) (src + i));
+				writeMem((uint16_t) (dst + i), value);
+			}
+		}
+
+		src += chunk;
+		dst += chunk;
+		n -= chunk;
+	}
+
+	return value;
+}
+
+void fillMem(uint16_t address, uint8_t value, int n)
+{
+	while(n > 0)
+	{
+		int chunk = 0x100 - (address & 0xFF);
+		uint8_t* to = gb->writeMap[address >> 8];
+
+		if(chunk > n)
+			chunk = n;
+
+		if(to)
+			memset(to + address, value, chunk);
+		else
+			for(int i = 0; i < chunk; i++)
+				writeMem((uint16_t) (address + i), value);
+
+		address += chunk;
+		n -= chunk;
+	}
 }
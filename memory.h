@@ -1,7 +1,28 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include "block.h"
+#include "machine.h"
 #include <stdint.h>
+#include <string.h>
+
+// Memory is mapped in 256-byte pages (see readMap and writeMap in
+// machine.h). Plain pages are a pointer into host memory, so reading or
+// writing them is one indexed load or store. Other pages go through a
+// handler. Without a cartridge (see cart.h), 0x0000-0x7FFF is plain RAM so
+// programs can be poked straight into it. VRAM is read straight from the
+// bank VBK selects but written through the PPU, which keeps decoded tiles
+// (see ppu.h). 0xE000-0xFDFF echoes 0xC000-0xDDFF and the 0xFF page (I/O
+// registers, HRAM and IE) is handled.
+
+// Every write also stamps the page of the save state it lands in (see
+// STATE_PAGES in machine.h) with the current epoch, so what changed since
+// any epoch can be found without looking at the memory itself. Each user
+// keeps the epoch it last looked in. Plain pages are watched (see
+// watchPage()) until their first write of an epoch, which stamps them, so
+// writeMem() stores to a page that is already stamped without doing it
+// again. The 0xFF page is stored to directly by the devices, so it is
+// never counted as clean.
 
 // Initializes Gameboy memory.
 void memInit();
@@ -9,16 +30,110 @@ void memInit();
 // Frees Gameboy memory after execution.
 void memFree();
 
+// Read and write through a page's handler, for readMem() and writeMem().
+uint8_t readHandled(uint16_t address);
+void writeHandled(uint16_t address, uint8_t value);
+
+// fetchInstruction() for an instruction that crosses a page or is not in
+// plain memory.
+uint32_t fetchSlow(uint16_t address);
+
+// Points count pages from page at host memory, reads at read and writes at
+// write. Accesses to a page whose pointer is 0 go through its handler. Any
+// pages the block cache is watching stay watched, but the caller must
+// invalidatePages() if the code it decoded from a page is no longer there.
+void mapPages(int page, int count, uint8_t* read, uint8_t* write);
+
+// The host memory mapped for reading at page, or 0 if it is handled.
+static inline uint8_t* pageMapped(int page)
+{
+	return gb->readMap[page] ? gb->readMap[page] + (page << 8) : 0;
+}
+
+// Sets the handlers of count pages from page.
+void setHandlers(int page, int count, ReadHandler read, WriteHandler write);
+
+// Starts a new epoch and returns it. Writes from now on are stamped with it.
+uint32_t newEpoch();
+
+// Puts the state pages written in epoch since or later, in order, in
+// pages, which has room for STATE_PAGES. Returns how many there are.
+int dirtyPages(uint32_t since, uint16_t* pages);
+
+// Counts every state page as written now, for when memory is replaced
+// wholesale.
+void dirtyAll();
+
+// Sends writes to a plain page through writeHandled() so they can be
+// watched, for the block cache and the dirty pages. unwatchPage() puts one
+// back, once it has no code and has been written this epoch, and
+// unwatchPages() all of them.
+void watchPage(int page);
+void unwatchPage(int page);
+void unwatchPages();
+
 // Reads one byte of memory at address.
-uint8_t readMem(uint16_t address);
+static inline uint8_t readMem(uint16_t address)
+{
+	uint8_t* page = gb->readMap[address >> 8];
+
+	if(__builtin_expect(page != 0, 1))
+		return page[address];
+	return readHandled(address);
+}
 
 // Writes one byte of memory at address.
-void writeMem(uint16_t address, uint8_t value);
+static inline void writeMem(uint16_t address, uint8_t value)
+{
+	uint8_t* page = gb->writeMap[address >> 8];
+
+	if(__builtin_expect(page != 0, 1))
+		page[address] = value;
+	else
+		writeHandled(address, value);
+}
+
+// Reads the instruction at address: the opcode in the low byte and its
+// immediate above. Bytes past the end of the instruction may be set too.
+// Plain pages are read in one load.
+static inline uint32_t fetchInstruction(uint16_t address)
+{
+	uint8_t* page = gb->readMap[address >> 8];
+	uint32_t bytes;
+
+	if(page && (address & 0xFF) <= 0xFC)
+	{
+		memcpy(&bytes, page + address, 4);
+		return bytes & 0xFFFFFF;
+	}
+	return fetchSlow(address);
+}
 
-// Read two bytes of memory as one 16-bit value at address.
-uint16_t readMem16(uint16_t address);
+// readMem16() for two bytes that are not both on one plain page.
+uint16_t readMem16Slow(uint16_t address);
 
-// Writes two bytes of memory as one 16-bit value at address.
+// Reads two bytes of memory as one little-endian 16-bit value at address.
+static inline uint16_t readMem16(uint16_t address)
+{
+	uint8_t* page = gb->readMap[address >> 8];
+	uint16_t value;
+
+	if(__builtin_expect(page && (address & 0xFF) != 0xFF, 1))
+	{
+		memcpy(&value, page + address, 2);
+		return value;
+	}
+	return readMem16Slow(address);
+}
+
+// Writes a 16-bit value as two bytes at address, low byte first.
 void writeMem16(uint16_t address, uint16_t value);
 
+// Copies n bytes from src to dst one at a time, in increasing order, like
+// a loop of readMem() and writeMem(). Returns the last byte copied.
+uint8_t copyMem(uint16_t dst, uint16_t src, int n);
+
+// Writes value to the n bytes from address up, like a loop of writeMem().
+void fillMem(uint16_t address, uint8_t value, int n);
+
 #endif
@@ -0,0 +1,169 @@
+#include "movie.h"
+#include "cpu.h"
+#include "joypad.h"
+#include "machine.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_MAGIC "GBMV"
+
+// Frames room is first made for.
+#define MIN_CAPACITY 1024
+
+typedef struct Movie {
+	MovieHeader header;
+	uint8_t* state;
+	uint8_t* keys;
+	uint64_t* hashes;
+	uint32_t capacity; // Frames keys has room for.
+} Movie;
+
+static int hashCount(const Movie* m)
+{
+	return m->header.frames / m->header.hashInterval;
+}
+
+static void allocate(Movie* m, uint32_t capacity)
+{
+	m->capacity = capacity;
+	m->keys = (uint8_t*) realloc(m->keys, capacity);
+	m->hashes = (uint64_t*) realloc(m->hashes, (capacity / m->header.hashInterval + 1) * sizeof(uint64_t));
+}
+
+static Movie* newMovie(int hashInterval, uint64_t stateSize)
+{
+	Movie* m;
+
+	movieStop();
+	m = (Movie*) calloc(1, sizeof(Movie));
+	memcpy(m->header.magic, MOVIE_MAGIC, 4);
+	m->header.version = MOVIE_VERSION;
+	m->header.hashInterval = hashInterval > 0 ? hashInterval : 1;
+	m->header.stateSize = stateSize;
+	m->state = (uint8_t*) malloc(stateSize);
+	gb->movie = m;
+	return m;
+}
+
+void movieRecord(int hashInterval)
+{
+	Movie* m = newMovie(hashInterval, stateSize());
+
+	stateSave(m->state, m->header.stateSize);
+	m->header.startKeys = gb->buttons;
+}
+
+uint64_t movieRunFrame(uint8_t keys)
+{
+	Movie* m = gb->movie;
+	uint64_t ran;
+
+	if(m->header.frames == m->capacity)
+		allocate(m, m->capacity ? m->capacity * 2 : MIN_CAPACITY);
+	m->keys[m->header.frames++] = keys;
+	joypadSet(keys);
+	ran = runFrame();
+	if(m->header.frames % m->header.hashInterval == 0)
+		m->hashes[hashCount(m) - 1] = stateHash();
+	return ran;
+}
+
+void movieStop()
+{
+	Movie* m = gb->movie;
+
+	if(!m)
+		return;
+
+	free(m->state);
+	free(m->keys);
+	free(m->hashes);
+	free(m);
+	gb->movie = 0;
+}
+
+int movieSave(const char* path)
+{
+	Movie* m = gb->movie;
+	FILE* file = fopen(path, "wb");
+	int written;
+
+	if(!file)
+	{
+		perror(path);
+		return 0;
+	}
+	written = fwrite(&m->header, sizeof(m->header), 1, file) == 1
+		&& fwrite(m->state, m->header.stateSize, 1, file) == 1
+		&& fwrite(m->keys, 1, m->header.frames, file) == m->header.frames
+		&& fwrite(m->hashes, sizeof(uint64_t), hashCount(m), file) == (size_t) hashCount(m);
+	if(fclose(file) || !written)
+	{
+		perror(path);
+		return 0;
+	}
+	return 1;
+}
+
+int movieLoad(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	MovieHeader header;
+	Movie* m;
+	int read;
+
+	if(!file)
+	{
+		perror(path);
+		return 0;
+	}
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, MOVIE_MAGIC, 4)
+		|| header.version != MOVIE_VERSION || !header.hashInterval || header.stateSize > (1u << 30))
+	{
+		fprintf(stderr, "%s: not a movie of this version\n", path);
+		fclose(file);
+		return 0;
+	}
+
+	m = newMovie(header.hashInterval, header.stateSize);
+	m->header.startKeys = header.startKeys;
+	m->header.frames = header.frames;
+	allocate(m, header.frames);
+	read = fread(m->state, header.stateSize, 1, file) == 1
+		&& fread(m->keys, 1, header.frames, file) == header.frames
+		&& fread(m->hashes, sizeof(uint64_t), hashCount(m), file) == (size_t) hashCount(m);
+	fclose(file);
+	if(!read)
+	{
+		fprintf(stderr, "%s: movie cut short\n", path);
+		movieStop();
+		return 0;
+	}
+	return 1;
+}
+
+int movieFrames()
+{
+	return gb->movie ? gb->movie->header.frames : 0;
+}
+
+int movieReplay()
+{
+	const Movie* m = gb->movie;
+	uint32_t interval = m->header.hashInterval;
+
+	if(!stateLoad(m->state, m->header.stateSize))
+		return -1;
+	gb->buttons = m->header.startKeys;
+
+	for(uint32_t frame = 1; frame <= m->header.frames; frame++)
+	{
+		joypadSet(m->keys[frame - 1]);
+		runFrame();
+		if(frame % interval == 0 && stateHash() != m->hashes[frame / interval - 1])
+			return frame;
+	}
+	return 0;
+}
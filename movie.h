@@ -0,0 +1,53 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+
+// Input movies. A movie is a save state to start from, the keys held
+// during each frame after it, and stateHash() taken every hashInterval
+// frames. Replaying one loads the state, runs the frames with the same
+// keys and checks each hash, so it shows whether a build still runs the
+// game exactly as the one that recorded it, and from which frame it does
+// not. Record with a hashInterval of 1 to find the very frame.
+//
+// A movie file is a MovieHeader, the state, one byte of keys a frame and
+// then the hashes, in the host's byte order like state files.
+
+#define MOVIE_VERSION 1
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t frames;
+	uint32_t hashInterval;
+	uint64_t stateSize;
+	uint8_t startKeys;  // Held when the state was saved.
+} MovieHeader;
+
+// Starts recording the selected machine from the state it is in now,
+// throwing away any movie it had.
+void movieRecord(int hashInterval);
+
+// Runs a frame like runFrame() with keys held (see joypad.h) and adds it
+// to the movie being recorded. Returns the cycles run.
+uint64_t movieRunFrame(uint8_t keys);
+
+// Frees the movie. memFree() calls it.
+void movieStop();
+
+// Writes the movie to path, or reads one from it in its place. Return 0
+// after printing why to stderr if the file cannot be used.
+int movieSave(const char* path);
+int movieLoad(const char* path);
+
+// Frames in the movie.
+int movieFrames();
+
+// Plays the movie back as fast as it runs. Returns 0 if every hash
+// matched, or the first frame, counting from 1, whose hash did not. That
+// frame is where it stops, and the frame hashInterval before it was the
+// last known to match. Returns -1 if the start state is not one for this
+// ROM and version.
+int movieReplay();
+
+#endif
@@ -0,0 +1,35 @@
+#include "opcodes.h"
+#include "memory.h"
+
+#define OP(code, mnemonic, kind, dst, src, n, length, cycles, cyclesTaken, flags) \
+	[code] = {mnemonic, flags, KIND_##kind, dst, src, n, length, cycles, cyclesTaken},
+const OpcodeInfo opcodeInfo[256] = {
+#include "opcodes.def"
+};
+
+#define CB(code, mnemonic, kind, dst, src, n, length, cycles, cyclesTaken, flags) \
+	[code] = {mnemonic, flags, KIND_##kind, dst, src, n, length, cycles, cyclesTaken},
+const OpcodeInfo cbOpcodeInfo[256] = {
+#include "opcodes.def"
+};
+
+const OpcodeInfo* opcodeAt(uint16_t address)
+{
+	uint8_t opcode = readMem(address);
+	if(opcode == 0xCB)
+		return &cbOpcodeInfo[readMem((uint16_t) (address + 1))];
+	return &opcodeInfo[opcode];
+}
+
+int endsBlock(const OpcodeInfo* info)
+{
+	switch(info->kind)
+	{
+		case KIND_JP: case KIND_JR: case KIND_CALL: case KIND_RET:
+		case KIND_RETI: case KIND_RST: case KIND_HALT: case KIND_STOP:
+		case KIND_ILLEGAL:
+			return 1;
+		default:
+			return 0;
+	}
+}
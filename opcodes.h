@@ -0,0 +1,62 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include <stdint.h>
+
+// Static metadata for every SM83 instruction. Both the handlers in
+// execute.c and the tables here are generated from opcodes.def so the two
+// can never disagree.
+
+// What an instruction does. Every row of opcodes.def names one of these and
+// execute.c has a matching EXEC_<kind> handler template.
+typedef enum {
+	KIND_NOP, KIND_LD, KIND_LD16, KIND_PUSH, KIND_POP,
+	KIND_ADD, KIND_ADC, KIND_SUB, KIND_SBC, KIND_AND, KIND_XOR, KIND_OR, KIND_CP,
+	KIND_INC, KIND_DEC, KIND_ADD16, KIND_INC16, KIND_DEC16, KIND_ADDSP, KIND_LDHLSP,
+	KIND_RLCA, KIND_RRCA, KIND_RLA, KIND_RRA, KIND_DAA, KIND_CPL, KIND_SCF, KIND_CCF,
+	KIND_JP, KIND_JR, KIND_CALL, KIND_RET, KIND_RETI, KIND_RST,
+	KIND_HALT, KIND_STOP, KIND_DI, KIND_EI, KIND_PREFIX, KIND_ILLEGAL,
+	// CB page
+	KIND_RLC, KIND_RRC, KIND_RL, KIND_RR, KIND_SLA, KIND_SRA, KIND_SWAP, KIND_SRL,
+	KIND_BIT, KIND_RES, KIND_SET
+} OpKind;
+
+// Where an instruction reads from or writes to. The 8-bit registers are in
+// the same order the CPU encodes them in (B, C, D, E, H, L, (HL), A).
+typedef enum {
+	NONE,
+	R_B, R_C, R_D, R_E, R_H, R_L, R_HLI, R_A,
+	R_BC, R_DE, R_HL, R_SP, R_AF,
+	M_BC,  // (BC)
+	M_DE,  // (DE)
+	M_HLP, // (HL+)
+	M_HLM, // (HL-)
+	M_C,   // ($FF00 + C)
+	M_A8,  // ($FF00 + a8)
+	M_A16, // (a16)
+	I_D8, I_D16, I_R8,
+	CC_NZ, CC_Z, CC_NC, CC_C
+} Operand;
+
+typedef struct {
+	const char* mnemonic; // Immediates appear as d8, d16, a8, a16 or r8.
+	const char* flags;    // Effect on Z, N, H, C: letter = computed, 0/1 = forced, - = untouched.
+	uint8_t kind;         // OpKind
+	uint8_t dst, src;     // Operand
+	uint8_t n;            // Bit number for BIT/RES/SET, vector for RST.
+	uint8_t length;       // Bytes including the opcode (and the CB prefix).
+	uint8_t cycles;       // Clock cycles when not branching.
+	uint8_t cyclesTaken;  // Clock cycles when a conditional branch is taken.
+} OpcodeInfo;
+
+extern const OpcodeInfo opcodeInfo[256];
+extern const OpcodeInfo cbOpcodeInfo[256];
+
+// Returns the info for the instruction at address, following the CB prefix.
+const OpcodeInfo* opcodeAt(uint16_t address);
+
+// Returns 1 if execution may not continue at the next instruction: jumps,
+// calls, returns, HALT, STOP and illegal opcodes.
+int endsBlock(const OpcodeInfo* info);
+
+#endif
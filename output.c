@@ -0,0 +1,362 @@
+#include "output.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OUTPUT_X86
+#include <immintrin.h>
+// The kernels are built for their instruction sets one function at a
+// time, so the rest of the emulator does not need them.
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+const uint32_t outputGreys[4] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
+
+// The kernels in use, or -1 until the CPU has been asked.
+static int level = -1;
+
+static int bestLevel()
+{
+#ifdef OUTPUT_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return OUTPUT_AVX2;
+	if(__builtin_cpu_supports("sse2"))
+		return OUTPUT_SSE2;
+#endif
+	return OUTPUT_SCALAR;
+}
+
+static int currentLevel()
+{
+	if(level < 0)
+		level = bestLevel();
+	return level;
+}
+
+int outputSetLevel(int want)
+{
+	int best = bestLevel();
+
+	level = want < best ? want : best;
+	return level;
+}
+
+// --- Scalar ---
+
+static void convertPixels(const uint8_t* shades, uint32_t* out, int first, int count,
+	const uint32_t palette[4])
+{
+	for(int i = first; i < count; i++)
+		out[i] = palette[shades[i] & 3];
+}
+
+static void scalePixels(const uint32_t* in, int first, int width, int scale, uint32_t* out)
+{
+	for(int x = first; x < width; x++)
+		for(int i = 0; i < scale; i++)
+			out[x * scale + i] = in[x];
+}
+
+// Scale2x for pixels first to last - 1 of line y, into lines 2y and 2y + 1
+// of out. Pixels past the edges are taken to be the same as the edge.
+static void scale2xPixels(const uint32_t* in, int width, int height, int y, int first,
+	int last, uint32_t* out)
+{
+	const uint32_t* row = in + y * width;
+	const uint32_t* above = y > 0 ? row - width : row;
+	const uint32_t* below = y < height - 1 ? row + width : row;
+	uint32_t* top = out + y * 4 * width;
+	uint32_t* bottom = top + 2 * width;
+
+	for(int x = first; x < last; x++)
+	{
+		uint32_t b = above[x], e = row[x], h = below[x];
+		uint32_t d = row[x > 0 ? x - 1 : x], f = row[x < width - 1 ? x + 1 : x];
+		int edge = b != h && d != f;
+
+		top[2 * x] = edge && d == b ? d : e;
+		top[2 * x + 1] = edge && b == f ? f : e;
+		bottom[2 * x] = edge && d == h ? d : e;
+		bottom[2 * x + 1] = edge && h == f ? f : e;
+	}
+}
+
+#ifdef OUTPUT_X86
+
+// --- SSE2 ---
+// Each returns how many pixels it did, leaving the rest to the scalar code.
+
+// SSE2 has no variable shuffle, so the shades are packed four to a byte,
+// which picks their four colours from a table made for the palette. Too
+// few shades are not worth making it for.
+SSE2 static int convertSSE2(const uint8_t* shades, uint32_t* out, int count,
+	const uint32_t palette[4])
+{
+	__m128i table[256], three = _mm_set1_epi8(3);
+	int i;
+
+	if(count < 1024)
+		return 0;
+	for(int n = 0; n < 256; n++)
+		table[n] = _mm_setr_epi32(palette[n & 3], palette[n >> 2 & 3], palette[n >> 4 & 3],
+			palette[n >> 6]);
+
+	for(i = 0; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*) (shades + i)), three);
+		uint32_t packed[4];
+
+		// The low byte of each 32 bits ends up holding its four shades.
+		v = _mm_or_si128(v, _mm_srli_epi16(v, 6));
+		v = _mm_or_si128(v, _mm_srli_epi32(v, 12));
+		_mm_storeu_si128((__m128i*) packed, v);
+		for(int j = 0; j < 4; j++)
+			_mm_storeu_si128((__m128i*) (out + i) + j, table[packed[j] & 0xFF]);
+	}
+	return i;
+}
+
+SSE2 static int scaleSSE2(const uint32_t* in, int width, int scale, uint32_t* out)
+{
+	int x = 0;
+
+	switch(scale)
+	{
+		case 2:
+			for(; x + 4 <= width; x += 4)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*) (in + x));
+				__m128i* o = (__m128i*) (out + x * 2);
+
+				_mm_storeu_si128(o, _mm_unpacklo_epi32(v, v));
+				_mm_storeu_si128(o + 1, _mm_unpackhi_epi32(v, v));
+			}
+			break;
+		case 3:
+			for(; x + 4 <= width; x += 4)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*) (in + x));
+				__m128i* o = (__m128i*) (out + x * 3);
+
+				_mm_storeu_si128(o, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+				_mm_storeu_si128(o + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+				_mm_storeu_si128(o + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+			}
+			break;
+		case 4:
+			for(; x + 4 <= width; x += 4)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*) (in + x));
+				__m128i* o = (__m128i*) (out + x * 4);
+
+				_mm_storeu_si128(o, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+				_mm_storeu_si128(o + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+				_mm_storeu_si128(o + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+				_mm_storeu_si128(o + 3, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+			}
+			break;
+	}
+	return x;
+}
+
+// a where mask is set, otherwise b.
+SSE2 static inline __m128i select128(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Does the pixels with neighbours on both sides in the line.
+SSE2 static int scale2xSSE2(const uint32_t* in, int width, int height, int y, uint32_t* out)
+{
+	const uint32_t* row = in + y * width;
+	const uint32_t* above = y > 0 ? row - width : row;
+	const uint32_t* below = y < height - 1 ? row + width : row;
+	uint32_t* top = out + y * 4 * width;
+	uint32_t* bottom = top + 2 * width;
+	int x;
+
+	for(x = 1; x + 5 <= width; x += 4)
+	{
+		__m128i b = _mm_loadu_si128((const __m128i*) (above + x));
+		__m128i d = _mm_loadu_si128((const __m128i*) (row + x - 1));
+		__m128i e = _mm_loadu_si128((const __m128i*) (row + x));
+		__m128i f = _mm_loadu_si128((const __m128i*) (row + x + 1));
+		__m128i h = _mm_loadu_si128((const __m128i*) (below + x));
+		__m128i flat = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+		__m128i e0 = select128(_mm_andnot_si128(flat, _mm_cmpeq_epi32(d, b)), d, e);
+		__m128i e1 = select128(_mm_andnot_si128(flat, _mm_cmpeq_epi32(b, f)), f, e);
+		__m128i e2 = select128(_mm_andnot_si128(flat, _mm_cmpeq_epi32(d, h)), d, e);
+		__m128i e3 = select128(_mm_andnot_si128(flat, _mm_cmpeq_epi32(h, f)), f, e);
+
+		_mm_storeu_si128((__m128i*) (top + 2 * x), _mm_unpacklo_epi32(e0, e1));
+		_mm_storeu_si128((__m128i*) (top + 2 * x) + 1, _mm_unpackhi_epi32(e0, e1));
+		_mm_storeu_si128((__m128i*) (bottom + 2 * x), _mm_unpacklo_epi32(e2, e3));
+		_mm_storeu_si128((__m128i*) (bottom + 2 * x) + 1, _mm_unpackhi_epi32(e2, e3));
+	}
+	return x;
+}
+
+// --- AVX2 ---
+
+// Eight shades at a time, each picking its colour with a permute.
+AVX2 static int convertAVX2(const uint8_t* shades, uint32_t* out, int count,
+	const uint32_t palette[4])
+{
+	__m256i colours = _mm256_setr_epi32(palette[0], palette[1], palette[2], palette[3],
+		palette[0], palette[1], palette[2], palette[3]);
+	__m256i three = _mm256_set1_epi32(3);
+	int i;
+
+	for(i = 0; i + 8 <= count; i += 8)
+	{
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (shades + i)));
+
+		_mm256_storeu_si256((__m256i*) (out + i),
+			_mm256_permutevar8x32_epi32(colours, _mm256_and_si256(index, three)));
+	}
+	return i;
+}
+
+// Output register i holds pixels (8i + j) / scale of the eight read.
+AVX2 static int scaleAVX2(const uint32_t* in, int width, int scale, uint32_t* out)
+{
+	__m256i index[4];
+	int x;
+
+	if(scale < 2 || scale > 4)
+		return 0;
+	for(int i = 0; i < scale; i++)
+	{
+		int32_t pixels[8];
+
+		for(int j = 0; j < 8; j++)
+			pixels[j] = (8 * i + j) / scale;
+		index[i] = _mm256_loadu_si256((const __m256i*) pixels);
+	}
+
+	for(x = 0; x + 8 <= width; x += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*) (in + x));
+		__m256i* o = (__m256i*) (out + x * scale);
+
+		for(int i = 0; i < scale; i++)
+			_mm256_storeu_si256(o + i, _mm256_permutevar8x32_epi32(v, index[i]));
+	}
+	return x;
+}
+
+AVX2 static inline __m256i select256(__m256i mask, __m256i a, __m256i b)
+{
+	return _mm256_or_si256(_mm256_and_si256(mask, a), _mm256_andnot_si256(mask, b));
+}
+
+// As scale2xSSE2. The unpacks work within each 128-bit half, so the halves
+// are put back in order before they are stored.
+AVX2 static int scale2xAVX2(const uint32_t* in, int width, int height, int y, uint32_t* out)
+{
+	const uint32_t* row = in + y * width;
+	const uint32_t* above = y > 0 ? row - width : row;
+	const uint32_t* below = y < height - 1 ? row + width : row;
+	uint32_t* top = out + y * 4 * width;
+	uint32_t* bottom = top + 2 * width;
+	int x;
+
+	for(x = 1; x + 9 <= width; x += 8)
+	{
+		__m256i b = _mm256_loadu_si256((const __m256i*) (above + x));
+		__m256i d = _mm256_loadu_si256((const __m256i*) (row + x - 1));
+		__m256i e = _mm256_loadu_si256((const __m256i*) (row + x));
+		__m256i f = _mm256_loadu_si256((const __m256i*) (row + x + 1));
+		__m256i h = _mm256_loadu_si256((const __m256i*) (below + x));
+		__m256i flat = _mm256_or_si256(_mm256_cmpeq_epi32(b, h), _mm256_cmpeq_epi32(d, f));
+		__m256i e0 = select256(_mm256_andnot_si256(flat, _mm256_cmpeq_epi32(d, b)), d, e);
+		__m256i e1 = select256(_mm256_andnot_si256(flat, _mm256_cmpeq_epi32(b, f)), f, e);
+		__m256i e2 = select256(_mm256_andnot_si256(flat, _mm256_cmpeq_epi32(d, h)), d, e);
+		__m256i e3 = select256(_mm256_andnot_si256(flat, _mm256_cmpeq_epi32(h, f)), f, e);
+		__m256i lo, hi;
+
+		lo = _mm256_unpacklo_epi32(e0, e1);
+		hi = _mm256_unpackhi_epi32(e0, e1);
+		_mm256_storeu_si256((__m256i*) (top + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*) (top + 2 * x) + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+		lo = _mm256_unpacklo_epi32(e2, e3);
+		hi = _mm256_unpackhi_epi32(e2, e3);
+		_mm256_storeu_si256((__m256i*) (bottom + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*) (bottom + 2 * x) + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return x;
+}
+
+#endif
+
+// --- Entry points ---
+
+void outputConvert(const uint8_t* shades, uint32_t* out, int count, const uint32_t palette[4])
+{
+	int done = 0;
+
+	switch(currentLevel())
+	{
+#ifdef OUTPUT_X86
+		case OUTPUT_AVX2:
+			done = convertAVX2(shades, out, count, palette);
+			break;
+		case OUTPUT_SSE2:
+			done = convertSSE2(shades, out, count, palette);
+			break;
+#endif
+	}
+	convertPixels(shades, out, done, count, palette);
+}
+
+// Scales each line across, then copies it down.
+void outputScale(const uint32_t* in, int width, int height, int scale, uint32_t* out)
+{
+	int outWidth = width * scale;
+
+	for(int y = 0; y < height; y++)
+	{
+		const uint32_t* row = in + y * width;
+		uint32_t* line = out + y * scale * outWidth;
+		int done = 0;
+
+		switch(currentLevel())
+		{
+#ifdef OUTPUT_X86
+			case OUTPUT_AVX2:
+				done = scaleAVX2(row, width, scale, line);
+				break;
+			case OUTPUT_SSE2:
+				done = scaleSSE2(row, width, scale, line);
+				break;
+#endif
+		}
+		scalePixels(row, done, width, scale, line);
+		for(int i = 1; i < scale; i++)
+			memcpy(line + i * outWidth, line, outWidth * sizeof(uint32_t));
+	}
+}
+
+void outputScale2x(const uint32_t* in, int width, int height, uint32_t* out)
+{
+	for(int y = 0; y < height; y++)
+	{
+		int done = 0;
+
+		switch(currentLevel())
+		{
+#ifdef OUTPUT_X86
+			case OUTPUT_AVX2:
+				done = scale2xAVX2(in, width, height, y, out);
+				break;
+			case OUTPUT_SSE2:
+				done = scale2xSSE2(in, width, height, y, out);
+				break;
+#endif
+		}
+		if(done)
+			scale2xPixels(in, width, height, y, 0, 1, out);
+		scale2xPixels(in, width, height, y, done, width, out);
+	}
+}
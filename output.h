@@ -0,0 +1,34 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+
+// Turning frames from ppuFrame() into 32-bit pixels for whatever shows or
+// records them: a palette lookup from shades to colours, then, if wanted,
+// an integer upscale. Each step has a scalar version and SSE2 and AVX2
+// ones, which give the same pixels. The best the CPU has is used unless
+// outputSetLevel() says otherwise.
+//
+// Images are rows of pixels with no padding between them.
+
+enum {OUTPUT_SCALAR, OUTPUT_SSE2, OUTPUT_AVX2};
+
+// White to black as RGBA8888, the bytes R, G, B, A in memory.
+extern const uint32_t outputGreys[4];
+
+// Uses the kernels for level, or the best below it the CPU has. Returns
+// the level used.
+int outputSetLevel(int level);
+
+// Looks count shades, 0 to 3, up in palette.
+void outputConvert(const uint8_t* shades, uint32_t* out, int count, const uint32_t palette[4]);
+
+// Scales a width by height image up by scale, 2, 3 or 4, repeating each
+// pixel. out holds width * scale by height * scale pixels.
+void outputScale(const uint32_t* in, int width, int height, int scale, uint32_t* out);
+
+// Scales an image up by 2 with Scale2x, which rounds off diagonal edges
+// using only the colours already there.
+void outputScale2x(const uint32_t* in, int width, int height, uint32_t* out);
+
+#endif
@@ -0,0 +1,431 @@
+#include "ppu.h"
+#include "block.h"
+#include "dma.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "render.h"
+#include "sched.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Cycles into a line the transfer to the LCD starts and HBlank starts at.
+// The transfer takes its shortest time, whatever is on the line.
+#define OAM_SEARCH_CYCLES 80
+#define HBLANK_START 252
+
+#define LCDC_BG 0x01
+#define LCDC_OBJ 0x02
+#define LCDC_TALL_OBJ 0x04
+#define LCDC_BG_MAP 0x08
+#define LCDC_TILE_DATA 0x10
+#define LCDC_WINDOW 0x20
+#define LCDC_WINDOW_MAP 0x40
+#define LCDC_ON 0x80
+
+// STAT interrupt enables.
+#define STAT_HBLANK 0x08
+#define STAT_VBLANK 0x10
+#define STAT_OAM 0x20
+#define STAT_LYC 0x40
+
+#define OBJ_PER_LINE 10
+
+// Object attributes.
+#define OBJ_PALETTE 0x10
+#define OBJ_FLIP_X 0x20
+#define OBJ_FLIP_Y 0x40
+#define OBJ_BEHIND 0x80
+
+static int lcdOn()
+{
+	return gb->memory[0xFF40] & LCDC_ON;
+}
+
+// Cycles into the frame at cycle now.
+static uint64_t frameCycle(uint64_t now)
+{
+	return (now - gb->ppu.frameStart) % FRAME_CYCLES;
+}
+
+static int currentLine()
+{
+	return lcdOn() ? frameCycle(gb->cycles) / LINE_CYCLES : 0;
+}
+
+static int currentMode()
+{
+	int dot = frameCycle(gb->cycles) % LINE_CYCLES;
+
+	if(!lcdOn())
+		return 0;
+	if(currentLine() >= VISIBLE_LINES)
+		return 1;
+	if(dot < OAM_SEARCH_CYCLES)
+		return 2;
+	return dot < HBLANK_START ? 3 : 0;
+}
+
+// --- Tiles ---
+
+static void decodeTile(Video* v, int tile)
+{
+	const uint8_t* data = v->vram[tile / 384] + (tile % 384) * 16;
+	uint8_t* pixels = v->tiles[tile];
+
+	for(int row = 0; row < 8; row++)
+	{
+		uint8_t low = data[row * 2], high = data[row * 2 + 1];
+
+		for(int x = 0; x < 8; x++)
+			pixels[row * 8 + x] = ((low >> (7 - x)) & 1) | (((high >> (7 - x)) & 1) << 1);
+	}
+	v->tileValid[tile] = 1;
+}
+
+// The 8 colour numbers of one row of a tile.
+static const uint8_t* tileRow(Video* v, int tile, int row)
+{
+	if(!v->tileValid[tile])
+		decodeTile(v, tile);
+	return v->tiles[tile] + row * 8;
+}
+
+static void writeVram(uint16_t address, uint8_t value)
+{
+	int bank = gb->ppu.vramBank;
+	int offset = address - 0x8000;
+
+	if(gb->codePages[address >> 8])
+		invalidateCode(address);
+	gb->video->vram[bank][offset] = value;
+	if(offset < 0x1800)
+		gb->video->tileValid[bank * 384 + offset / 16] = 0;
+	if(gb->video->thread)
+		vramWritten(bank, offset);
+}
+
+static void mapVram()
+{
+	uint8_t* vram = gb->video->vram[gb->ppu.vramBank];
+
+	if(pageMapped(0x80) != vram)
+		invalidatePages(0x80, 0x20);
+	setHandlers(0x80, 0x20, 0, writeVram);
+	mapPages(0x80, 0x20, vram, 0);
+}
+
+// --- Drawing ---
+
+// Draws n pixels of the tile map at map, starting from pixel (x, y) of its
+// 256x256, as colour numbers. Whole tiles are copied, so up to 7 pixels
+// either side of the n are written too.
+static void drawMap(Video* v, const LineRegs* r, uint8_t* line, int n, uint16_t map, int x, int y)
+{
+	const uint8_t* tiles = v->vram[0] + (map - 0x8000) + (y / 8) * 32;
+
+	for(int i = -(x & 7); i < n; i += 8, x += 8)
+	{
+		int tile = tiles[(x / 8) & 31];
+
+		if(!(r->lcdc & LCDC_TILE_DATA) && tile < 128)
+			tile += 256;
+		memcpy(line + i, tileRow(v, tile, y & 7), 8);
+	}
+}
+
+// Draws the objects on the line over the background colour numbers bg and
+// the shades already in out. The first object in OAM order among those
+// with the lowest X wins a pixel, and only then is its priority against
+// the background checked.
+static void drawObjects(Video* v, const uint8_t* oam, const LineRegs* r, const uint8_t* bg, uint8_t* out)
+{
+	int height = r->lcdc & LCDC_TALL_OBJ ? 16 : 8;
+	uint8_t colour[SCREEN_WIDTH + 8] = {0}, attr[SCREEN_WIDTH + 8];
+	int found[OBJ_PER_LINE], count = 0;
+
+	for(int i = 0; i < 40 && count < OBJ_PER_LINE; i++)
+	{
+		int row = r->ly + 16 - oam[i * 4];
+
+		if(row >= 0 && row < height)
+			found[count++] = i;
+	}
+
+	// Insertion sort by X, keeping OAM order on ties.
+	for(int i = 1; i < count; i++)
+	{
+		int obj = found[i], j = i;
+
+		for(; j > 0 && oam[found[j - 1] * 4 + 1] > oam[obj * 4 + 1]; j--)
+			found[j] = found[j - 1];
+		found[j] = obj;
+	}
+
+	// colour and attr are offset by 8 so objects can hang off the left.
+	for(int i = 0; i < count; i++)
+	{
+		const uint8_t* o = oam + found[i] * 4;
+		int row = r->ly + 16 - o[0], tile = o[2];
+		const uint8_t* pixels;
+
+		if(o[3] & OBJ_FLIP_Y)
+			row = height - 1 - row;
+		if(height == 16)
+			tile = (tile & 0xFE) + row / 8;
+		pixels = tileRow(v, tile, row & 7);
+
+		for(int x = 0; x < 8; x++)
+		{
+			int at = o[1] + x;
+			uint8_t c = pixels[o[3] & OBJ_FLIP_X ? 7 - x : x];
+
+			if(c && at < SCREEN_WIDTH + 8 && !colour[at])
+			{
+				colour[at] = c;
+				attr[at] = o[3];
+			}
+		}
+	}
+
+	for(int x = 0; x < SCREEN_WIDTH; x++)
+	{
+		uint8_t c = colour[x + 8];
+
+		if(c && !((attr[x + 8] & OBJ_BEHIND) && bg[x]))
+		{
+			uint8_t palette = attr[x + 8] & OBJ_PALETTE ? r->obp1 : r->obp0;
+
+			out[x] = (palette >> (c * 2)) & 3;
+		}
+	}
+}
+
+// 1 if the window covers part of the line.
+static int windowShown(const LineRegs* r)
+{
+	return (r->lcdc & LCDC_BG) && (r->lcdc & LCDC_WINDOW) && r->ly >= r->wy && r->wx < SCREEN_WIDTH + 7;
+}
+
+void drawLine(Video* v, const uint8_t* oam, const LineRegs* r)
+{
+	uint8_t buffer[8 + SCREEN_WIDTH + 16] = {0};
+	uint8_t* bg = buffer + 8;
+	uint8_t* out = v->frame[r->ly];
+
+	if(r->lcdc & LCDC_BG)
+		drawMap(v, r, bg, SCREEN_WIDTH, r->lcdc & LCDC_BG_MAP ? 0x9C00 : 0x9800, r->scx, (r->scy + r->ly) & 0xFF);
+	if(windowShown(r))
+		drawMap(v, r, bg + r->wx - 7, SCREEN_WIDTH + 7 - r->wx, r->lcdc & LCDC_WINDOW_MAP ? 0x9C00 : 0x9800,
+			0, r->windowLine);
+
+	for(int x = 0; x < SCREEN_WIDTH; x++)
+		out[x] = (r->bgp >> (bg[x] * 2)) & 3;
+	if(!(r->lcdc & LCDC_BG))
+		memset(out, 0, SCREEN_WIDTH);
+
+	if(r->lcdc & LCDC_OBJ)
+		drawObjects(v, oam, r, bg, out);
+}
+
+// The registers line ly is drawn with. Counts the line if it shows the
+// window.
+static void lineRegs(int ly, LineRegs* r)
+{
+	const uint8_t* io = gb->memory + 0xFF00;
+
+	r->ly = ly;
+	r->lcdc = io[0x40];
+	r->scy = io[0x42];
+	r->scx = io[0x43];
+	r->bgp = io[0x47];
+	r->obp0 = io[0x48];
+	r->obp1 = io[0x49];
+	r->wy = io[0x4A];
+	r->wx = io[0x4B];
+	r->windowLine = gb->ppu.windowLine;
+	if(windowShown(r))
+		gb->ppu.windowLine++;
+}
+
+// --- Timing ---
+
+static void statInterrupt(uint8_t enable)
+{
+	if(gb->memory[0xFF41] & enable)
+		requestInterrupt(INT_STAT);
+}
+
+// Decides whether to draw the frame that is starting.
+static int drawThisFrame()
+{
+	Ppu* p = &gb->ppu;
+
+	switch(p->renderPolicy)
+	{
+		case RENDER_EVERY:
+			return p->frames % p->renderEvery == 0;
+		case RENDER_ON_DEMAND:
+			if(!p->frameRequested)
+				return 0;
+			p->frameRequested = 0;
+			return 1;
+		default:
+			return 1;
+	}
+}
+
+// Runs at the start of every line and of every HBlank.
+static void ppuEvent(uint64_t at)
+{
+	uint64_t cycle = frameCycle(at);
+	int line = cycle / LINE_CYCLES;
+	uint64_t lineStart = at - cycle % LINE_CYCLES;
+
+	if(cycle % LINE_CYCLES == HBLANK_START)
+	{
+		LineRegs r;
+
+		// Decided as the first line is drawn, so a request made up to then
+		// still counts. The window line counts on frames that are skipped.
+		if(line == 0)
+			gb->ppu.drawing = drawThisFrame();
+		lineRegs(line, &r);
+		if(gb->ppu.drawing && gb->video->thread)
+			queueLine(&r);
+		else if(gb->ppu.drawing)
+			drawLine(gb->video, gb->memory + 0xFE00, &r);
+		statInterrupt(STAT_HBLANK);
+		hdmaHBlank();
+		scheduleEvent(EVENT_PPU, lineStart + LINE_CYCLES, ppuEvent);
+		return;
+	}
+
+	if(line == gb->memory[0xFF45])
+		statInterrupt(STAT_LYC);
+	if(line == 0)
+		gb->ppu.windowLine = 0;
+
+	if(line < VISIBLE_LINES)
+	{
+		statInterrupt(STAT_OAM);
+		scheduleEvent(EVENT_PPU, lineStart + HBLANK_START, ppuEvent);
+		return;
+	}
+
+	if(line == VISIBLE_LINES)
+	{
+		if(gb->ppu.drawing && gb->video->thread)
+			queueFrame();
+		else if(gb->ppu.drawing)
+			memcpy(gb->video->shown, gb->video->frame, sizeof(gb->video->frame));
+		gb->ppu.frames++;
+		requestInterrupt(INT_VBLANK);
+		statInterrupt(STAT_VBLANK);
+	}
+	scheduleEvent(EVENT_PPU, lineStart + LINE_CYCLES, ppuEvent);
+}
+
+// --- Setup and registers ---
+
+void ppuInit()
+{
+	gb->video = (Video*) calloc(1, sizeof(Video));
+	gb->ppu.vramBank = 0;
+	mapVram();
+}
+
+void ppuFree()
+{
+	if(gb->video->thread)
+		stopRenderThread();
+	free(gb->video);
+	gb->video = 0;
+}
+
+void ppuReset()
+{
+	gb->ppu.windowLine = 0;
+	gb->ppu.frameStart = gb->cycles;
+	if(lcdOn())
+		scheduleEvent(EVENT_PPU, gb->cycles, ppuEvent);
+	else
+		cancelEvent(EVENT_PPU);
+}
+
+void ppuRestore(const uint8_t* vram)
+{
+	Video* v = gb->video;
+
+	for(int offset = 0; offset < 0x4000; offset += 16)
+	{
+		int bank = offset / 0x2000;
+
+		if(!memcmp(v->vram[0] + offset, vram + offset, 16))
+			continue;
+		memcpy(v->vram[0] + offset, vram + offset, 16);
+		if(offset % 0x2000 < 0x1800)
+			v->tileValid[bank * 384 + offset % 0x2000 / 16] = 0;
+		if(v->thread)
+			vramWritten(bank, offset % 0x2000);
+	}
+	mapVram();
+	restoreEvent(EVENT_PPU, ppuEvent);
+}
+
+void ppuSetRenderPolicy(int policy, int n)
+{
+	gb->ppu.renderPolicy = policy;
+	gb->ppu.renderEvery = n > 0 ? n : 1;
+}
+
+void ppuRequestFrame()
+{
+	gb->ppu.frameRequested = 1;
+}
+
+const uint8_t* ppuFrame()
+{
+	if(gb->video->thread)
+		return renderedFrame();
+	return &gb->video->shown[0][0];
+}
+
+uint8_t ppuRead(uint16_t address)
+{
+	switch(address)
+	{
+		case 0xFF41:
+		{
+			uint8_t stat = gb->memory[address] | 0x80 | currentMode();
+
+			if(currentLine() == gb->memory[0xFF45])
+				stat |= 0x04;
+			return stat;
+		}
+		case 0xFF44: return currentLine();
+		case 0xFF4F: return 0xFE | gb->ppu.vramBank;
+		default: return gb->memory[address];
+	}
+}
+
+void ppuWrite(uint16_t address, uint8_t value)
+{
+	switch(address)
+	{
+		case 0xFF40:
+		{
+			int wasOn = lcdOn();
+
+			gb->memory[address] = value;
+			if(wasOn != lcdOn())
+				ppuReset();
+			break;
+		}
+		case 0xFF41: gb->memory[address] = value & 0x78; break;
+		case 0xFF44: break;
+		case 0xFF4F:
+			gb->ppu.vramBank = value & 1;
+			mapVram();
+			break;
+	}
+}
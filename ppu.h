@@ -0,0 +1,79 @@
+#ifndef PPU_H
+#define PPU_H
+
+#include <stdint.h>
+
+// The LCD controller. Each line is drawn whole into the framebuffer at
+// the start of its HBlank, from the registers as they are then. LY and the
+// STAT mode are worked out from gb->cycles when they are read, so the only
+// events are the start of each line and each HBlank, which also raise the
+// VBlank and STAT interrupts and run HBlank HDMA (see dma.h).
+//
+// Tiles are kept decoded to one colour number per byte. VRAM is read
+// straight through the memory map but written through a handler that
+// marks the tile it hits, if any, to be decoded again the next time it is
+// drawn.
+
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 144
+
+// 384 tiles in each of the two VRAM banks.
+#define TILE_COUNT 768
+
+typedef struct Video {
+	uint8_t vram[2][0x2000];
+	uint8_t tiles[TILE_COUNT][64]; // Colour numbers, 8 rows of 8.
+	uint8_t tileValid[TILE_COUNT];
+
+	// Shades 0 (white) to 3 (black), after the palettes: the frame being
+	// drawn, and the last one finished.
+	uint8_t frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+	uint8_t shown[SCREEN_HEIGHT][SCREEN_WIDTH];
+
+	// Draws the lines instead when set, see render.h.
+	struct RenderThread* thread;
+} Video;
+
+// The registers a line is drawn with, as they were at its HBlank, and the
+// line of the window it shows.
+typedef struct {
+	uint8_t ly, lcdc, scy, scx, bgp, obp0, obp1, wy, wx, windowLine;
+} LineRegs;
+
+// Allocates VRAM and maps it, for memInit(), and frees it.
+void ppuInit();
+void ppuFree();
+
+// Restarts the LCD at gb->cycles, if LCDC has it on.
+void ppuReset();
+
+// Copies in a save state's VRAM, both banks, maps the VRAM bank and gives
+// EVENT_PPU its handler back. Only tiles whose bytes change are decoded
+// again.
+void ppuRestore(const uint8_t* vram);
+
+// Which frames are drawn. Frames that are skipped keep their timing,
+// interrupts and HDMA, but no tile is decoded and no pixel is drawn, and
+// ppuFrame() keeps returning the last frame that was.
+enum {RENDER_ALWAYS, RENDER_EVERY, RENDER_ON_DEMAND};
+
+// Sets which frames are drawn, from the next one on. RENDER_EVERY draws
+// the frames whose number (gb->ppu.frames) is a multiple of n.
+void ppuSetRenderPolicy(int policy, int n);
+
+// Has the next frame drawn under RENDER_ON_DEMAND, for a screenshot.
+void ppuRequestFrame();
+
+// The last frame drawn, SCREEN_HEIGHT rows of SCREEN_WIDTH shades.
+const uint8_t* ppuFrame();
+
+// Draws a line into v->frame from v's VRAM and tiles and oam. Uses nothing
+// else, so it can run on another thread.
+void drawLine(Video* v, const uint8_t* oam, const LineRegs* r);
+
+// Reads and writes the registers the PPU works out or acts on: LCDC,
+// STAT, LY and VBK.
+uint8_t ppuRead(uint16_t address);
+void ppuWrite(uint16_t address, uint8_t value);
+
+#endif
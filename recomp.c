@@ -0,0 +1,494 @@
+// Static recompiler: translates a ROM's reachable code into C, one function
+// per basic block. See aot.h.
+//
+// Usage: recomp game.gb aot_rom.c
+
+#include "aot.h"
+#include "disasm.h"
+#include "opcodes.h"
+#include <stdio.h>
+
+#define SEEN 1   // An instruction starts here.
+#define LEADER 2 // A block starts here.
+
+static uint8_t marks[AOT_ROM_SIZE];
+static uint16_t worklist[AOT_ROM_SIZE];
+static int worklistCount;
+
+// 1 if the instruction at address lies in one bank of the recompiled ROM.
+static int inOneBank(uint16_t address, const OpcodeInfo* info)
+{
+	uint16_t last = address + info->length - 1;
+
+	return last < AOT_ROM_SIZE && (address ^ last) < AOT_BANK_SIZE;
+}
+
+// Queues address as the start of a block.
+static void addLeader(uint16_t address)
+{
+	if(address >= AOT_ROM_SIZE || (marks[address] & LEADER))
+		return;
+	marks[address] |= LEADER;
+	worklist[worklistCount++] = address;
+}
+
+static uint16_t immediate(uint16_t address, const OpcodeInfo* info)
+{
+	if(info->length == 3)
+		return readMem(address + 1) | (readMem(address + 2) << 8);
+	return info->length == 2 ? readMem(address + 1) : 0;
+}
+
+// Target of a JP, JR or CALL with an immediate, or of an RST. -1 if the
+// target is only known at run time.
+static int branchTarget(uint16_t address, const OpcodeInfo* info)
+{
+	uint16_t next = address + info->length;
+
+	switch(info->kind)
+	{
+		case KIND_JP: return info->src == I_D16 ? immediate(address, info) : -1;
+		case KIND_JR: return (uint16_t) (next + (int8_t) immediate(address, info));
+		case KIND_CALL: return immediate(address, info);
+		case KIND_RST: return info->n;
+		default: return -1;
+	}
+}
+
+// 1 if execution can carry on at the next instruction: everything but
+// unconditional jumps and returns, STOP and illegal opcodes. Calls and RSTs
+// count, since they come back.
+static int fallsThrough(const OpcodeInfo* info)
+{
+	switch(info->kind)
+	{
+		case KIND_JP: case KIND_JR: case KIND_RET:
+			return info->dst != NONE;
+		case KIND_RETI: case KIND_STOP: case KIND_ILLEGAL:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+// Follows every path from the queued leaders, marking instructions and
+// the blocks they start.
+static void discover()
+{
+	while(worklistCount)
+	{
+		uint16_t address = worklist[--worklistCount];
+
+		while(address < AOT_ROM_SIZE && !(marks[address] & SEEN))
+		{
+			const OpcodeInfo* info = opcodeAt(address);
+			uint16_t next = address + info->length;
+
+			if(info->kind == KIND_ILLEGAL || !inOneBank(address, info))
+				break;
+			marks[address] |= SEEN;
+
+			if(branchTarget(address, info) >= 0)
+				addLeader(branchTarget(address, info));
+
+			// runAOT() has to see EVENT_EI right after the next instruction.
+			if(info->kind == KIND_EI && next < AOT_ROM_SIZE && !endsBlock(opcodeAt(next)))
+				addLeader(next + opcodeAt(next)->length);
+
+			if(!endsBlock(info))
+			{
+				// Blocks stop where bank 1 starts, see emitBlock().
+				if(next == AOT_BANK_SIZE)
+				{
+					addLeader(next);
+					break;
+				}
+				address = next;
+				continue;
+			}
+			if(fallsThrough(info))
+				addLeader(next);
+			break;
+		}
+	}
+}
+
+// --- C expressions for operands ---
+
+// Statement to run before an operand is used: the HL+ and HL- side effect.
+static const char* prologue(int operand)
+{
+	switch(operand)
+	{
+		case M_HLP: return "uint16_t hl = HL(); setHL(hl + 1); ";
+		case M_HLM: return "uint16_t hl = HL(); setHL(hl - 1); ";
+		default: return "";
+	}
+}
+
+static void readExpr8(char* out, int operand, uint16_t imm)
+{
+	switch(operand)
+	{
+		case R_B: sprintf(out, "B()"); break;
+		case R_C: sprintf(out, "C()"); break;
+		case R_D: sprintf(out, "D()"); break;
+		case R_E: sprintf(out, "E()"); break;
+		case R_H: sprintf(out, "H()"); break;
+		case R_L: sprintf(out, "L()"); break;
+		case R_HLI: sprintf(out, "readMem(HL())"); break;
+		case R_A: sprintf(out, "A()"); break;
+		case M_BC: sprintf(out, "readMem(BC())"); break;
+		case M_DE: sprintf(out, "readMem(DE())"); break;
+		case M_HLP: case M_HLM: sprintf(out, "readMem(hl)"); break;
+		case M_C: sprintf(out, "readMem(0xFF00 + C())"); break;
+		case M_A8: sprintf(out, "readMem(0x%04X)", 0xFF00 + (imm & 0xFF)); break;
+		case M_A16: sprintf(out, "readMem(0x%04X)", imm); break;
+		case I_D8: sprintf(out, "0x%02X", imm & 0xFF); break;
+	}
+}
+
+static void writeStmt8(char* out, int operand, uint16_t imm, const char* value)
+{
+	switch(operand)
+	{
+		case R_B: sprintf(out, "setB(%s);", value); break;
+		case R_C: sprintf(out, "setC(%s);", value); break;
+		case R_D: sprintf(out, "setD(%s);", value); break;
+		case R_E: sprintf(out, "setE(%s);", value); break;
+		case R_H: sprintf(out, "setH(%s);", value); break;
+		case R_L: sprintf(out, "setL(%s);", value); break;
+		case R_HLI: sprintf(out, "writeMem(HL(), %s);", value); break;
+		case R_A: sprintf(out, "setA(%s);", value); break;
+		case M_BC: sprintf(out, "writeMem(BC(), %s);", value); break;
+		case M_DE: sprintf(out, "writeMem(DE(), %s);", value); break;
+		case M_HLP: case M_HLM: sprintf(out, "writeMem(hl, %s);", value); break;
+		case M_C: sprintf(out, "writeMem(0xFF00 + C(), %s);", value); break;
+		case M_A8: sprintf(out, "writeMem(0x%04X, %s);", 0xFF00 + (imm & 0xFF), value); break;
+		case M_A16: sprintf(out, "writeMem(0x%04X, %s);", imm, value); break;
+	}
+}
+
+static void readExpr16(char* out, int operand, uint16_t imm)
+{
+	switch(operand)
+	{
+		case R_BC: sprintf(out, "BC()"); break;
+		case R_DE: sprintf(out, "DE()"); break;
+		case R_HL: sprintf(out, "HL()"); break;
+		case R_SP: sprintf(out, "SP()"); break;
+		case R_AF: sprintf(out, "AF()"); break;
+		case I_D16: sprintf(out, "0x%04X", imm); break;
+	}
+}
+
+static void writeStmt16(char* out, int operand, uint16_t imm, const char* value)
+{
+	switch(operand)
+	{
+		case R_BC: sprintf(out, "setBC(%s);", value); break;
+		case R_DE: sprintf(out, "setDE(%s);", value); break;
+		case R_HL: sprintf(out, "setHL(%s);", value); break;
+		case R_SP: sprintf(out, "setSP(%s);", value); break;
+		case R_AF: sprintf(out, "setAF((%s) & 0xFFF0);", value); break;
+		case M_A16: sprintf(out, "writeMem16(0x%04X, %s);", imm, value); break;
+	}
+}
+
+static const char* conditionExpr(int operand)
+{
+	switch(operand)
+	{
+		case CC_NZ: return "!Zflag()";
+		case CC_Z: return "Zflag()";
+		case CC_NC: return "!Cflag()";
+		case CC_C: return "Cflag()";
+		default: return 0;
+	}
+}
+
+// --- Code generation ---
+
+// Name of the helper for ALU and CB page kinds that go through one.
+static const char* helper(int kind)
+{
+	switch(kind)
+	{
+		case KIND_ADD: return "add8"; case KIND_SUB: return "sub8";
+		case KIND_AND: return "and8"; case KIND_XOR: return "xor8";
+		case KIND_OR: return "or8"; case KIND_CP: return "sub8";
+		case KIND_ADC: return "adc8"; case KIND_SBC: return "sbc8";
+		case KIND_INC: return "inc8"; case KIND_DEC: return "dec8";
+		case KIND_RLC: return "rlc"; case KIND_RRC: return "rrc";
+		case KIND_RL: return "rl"; case KIND_RR: return "rr";
+		case KIND_SLA: return "sla"; case KIND_SRA: return "sra";
+		case KIND_SWAP: return "swap8"; case KIND_SRL: return "srl";
+		default: return 0;
+	}
+}
+
+// Writes a block exit: PC goes to pc, which may be an expression, and the
+// block returns cycles.
+static void emitExit(FILE* out, const char* indent, const char* pc, int cycles)
+{
+	fprintf(out, "%ssetPC(%s); return %d;\n", indent, pc, cycles);
+}
+
+// Writes the C for the instruction at address. used is the block's cycles
+// up to and including this instruction, not counting a taken branch.
+static void emitInstruction(FILE* out, uint16_t address, const OpcodeInfo* info, int used)
+{
+	uint16_t imm = immediate(address, info);
+	uint16_t next = address + info->length;
+	int taken = used - info->cycles + info->cyclesTaken;
+	int target = branchTarget(address, info);
+	const char* cc = conditionExpr(info->dst);
+	char a[64], b[96], c[160], pc[16];
+
+	sprintf(pc, "0x%04X", target);
+
+	switch(info->kind)
+	{
+		case KIND_NOP:
+			return;
+
+		case KIND_LD:
+			readExpr8(a, info->src, imm);
+			writeStmt8(b, info->dst, imm, a);
+			fprintf(out, "\t{%s%s%s}\n", prologue(info->src), prologue(info->dst), b);
+			return;
+
+		case KIND_LD16:
+			readExpr16(a, info->src, imm);
+			writeStmt16(b, info->dst, imm, a);
+			fprintf(out, "\t%s\n", b);
+			return;
+
+		case KIND_PUSH:
+			readExpr16(a, info->src, imm);
+			fprintf(out, "\tpush(%s);\n", a);
+			return;
+
+		case KIND_POP:
+			writeStmt16(b, info->dst, imm, "pop()");
+			fprintf(out, "\t%s\n", b);
+			return;
+
+		case KIND_ADD: case KIND_SUB: case KIND_AND: case KIND_XOR:
+		case KIND_OR: case KIND_CP: case KIND_ADC: case KIND_SBC:
+			readExpr8(a, info->src, imm);
+			if(info->kind == KIND_ADC || info->kind == KIND_SBC)
+				sprintf(b, "%s(A(), %s, Cflag())", helper(info->kind), a);
+			else
+				sprintf(b, "%s(A(), %s)", helper(info->kind), a);
+			if(info->kind == KIND_CP)
+				fprintf(out, "\t%s;\n", b);
+			else
+				fprintf(out, "\tsetA(%s);\n", b);
+			return;
+
+		case KIND_INC: case KIND_DEC:
+		case KIND_RLC: case KIND_RRC: case KIND_RL: case KIND_RR:
+		case KIND_SLA: case KIND_SRA: case KIND_SWAP: case KIND_SRL:
+			readExpr8(a, info->dst, imm);
+			sprintf(b, "%s(%s)", helper(info->kind), a);
+			writeStmt8(c, info->dst, imm, b);
+			fprintf(out, "\t%s\n", c);
+			return;
+
+		case KIND_BIT:
+			readExpr8(a, info->dst, imm);
+			fprintf(out, "\tbit(%d, %s);\n", info->n, a);
+			return;
+
+		case KIND_RES: case KIND_SET:
+			readExpr8(a, info->dst, imm);
+			if(info->kind == KIND_RES)
+				sprintf(b, "%s & 0x%02X", a, ~(1 << info->n) & 0xFF);
+			else
+				sprintf(b, "%s | 0x%02X", a, 1 << info->n);
+			writeStmt8(c, info->dst, imm, b);
+			fprintf(out, "\t%s\n", c);
+			return;
+
+		case KIND_ADD16:
+			readExpr16(a, info->src, imm);
+			fprintf(out, "\tsetHL(add16(HL(), %s));\n", a);
+			return;
+
+		case KIND_INC16: case KIND_DEC16:
+			readExpr16(a, info->dst, imm);
+			sprintf(b, "%s %c 1", a, info->kind == KIND_INC16 ? '+' : '-');
+			writeStmt16(c, info->dst, imm, b);
+			fprintf(out, "\t%s\n", c);
+			return;
+
+		case KIND_ADDSP: fprintf(out, "\tsetSP(addSP(%d));\n", (int8_t) imm); return;
+		case KIND_LDHLSP: fprintf(out, "\tsetHL(addSP(%d));\n", (int8_t) imm); return;
+
+		// The accumulator rotates always clear Z, unlike their CB versions.
+		case KIND_RLCA: fprintf(out, "\tsetA(rlc(A())); resetZflag();\n"); return;
+		case KIND_RRCA: fprintf(out, "\tsetA(rrc(A())); resetZflag();\n"); return;
+		case KIND_RLA: fprintf(out, "\tsetA(rl(A())); resetZflag();\n"); return;
+		case KIND_RRA: fprintf(out, "\tsetA(rr(A())); resetZflag();\n"); return;
+		case KIND_DAA: fprintf(out, "\tsetA(daa8(A()));\n"); return;
+		case KIND_CPL: fprintf(out, "\tsetA(~A()); setNflag(); setHflag();\n"); return;
+		case KIND_SCF: fprintf(out, "\tresetNflag(); resetHflag(); setCflag();\n"); return;
+		case KIND_CCF:
+			fprintf(out, "\tif(Cflag()) resetCflag(); else setCflag(); resetNflag(); resetHflag();\n");
+			return;
+		case KIND_DI: fprintf(out, "\tdisableInterrupts();\n"); return;
+		case KIND_EI: fprintf(out, "\tenableInterrupts(gb->cycles + %d);\n", used); return;
+
+		// Branches end the block, so each one sets PC and returns.
+		case KIND_JP: case KIND_JR: case KIND_CALL: case KIND_RET:
+			if(cc)
+				fprintf(out, "\tif(%s) {", cc);
+			else
+				fprintf(out, "\t{");
+			if(info->kind == KIND_CALL)
+				fprintf(out, "push(0x%04X); ", next);
+			if(info->kind == KIND_RET)
+				sprintf(pc, "pop()");
+			else if(target < 0)
+				sprintf(pc, "HL()");
+			emitExit(out, "", pc, cc ? taken : used);
+			fprintf(out, "\t}\n");
+			if(cc)
+			{
+				sprintf(pc, "0x%04X", next);
+				emitExit(out, "\t", pc, used);
+			}
+			return;
+
+		case KIND_RETI:
+			fprintf(out, "\tsetIME(1);\n");
+			emitExit(out, "\t", "pop()", used);
+			return;
+
+		case KIND_RST:
+			fprintf(out, "\tpush(0x%04X);\n", next);
+			emitExit(out, "\t", pc, used);
+			return;
+
+		case KIND_HALT:
+			fprintf(out, "\tsetPC(0x%04X); return %d + haltUntilInterrupt(%d);\n", next, used, used);
+			return;
+
+		case KIND_STOP:
+			fprintf(out, "\thaltCPU();\n");
+			sprintf(pc, "0x%04X", next);
+			emitExit(out, "\t", pc, used);
+			return;
+	}
+}
+
+// Writes the function for the block at start. It runs until an instruction
+// that ends a block, the start of another block, the other bank, or code
+// recomp could not follow, and leaves PC there for runAOT().
+static void emitBlock(FILE* out, uint16_t start)
+{
+	uint16_t address = start;
+	int used = 0;
+	char text[32], pc[16];
+
+	fprintf(out, "static int block_%04X(void)\n{\n", start);
+
+	for(;;)
+	{
+		const OpcodeInfo* info = opcodeAt(address);
+
+		if(address != start && (marks[address] & LEADER))
+			break;
+		if(info->kind == KIND_ILLEGAL || !inOneBank(address, info) || (address ^ start) >= AOT_BANK_SIZE)
+			break;
+
+		disassemble(address, text, sizeof(text));
+		fprintf(out, "\t// %04X: %s\n", address, text);
+		used += info->cycles;
+		emitInstruction(out, address, info, used);
+
+		if(endsBlock(info))
+		{
+			fprintf(out, "}\n\n");
+			return;
+		}
+		address += info->length;
+	}
+
+	sprintf(pc, "0x%04X", address);
+	emitExit(out, "\t", pc, used);
+	fprintf(out, "}\n\n");
+}
+
+int main(int argc, char* argv[])
+{
+	FILE* rom;
+	FILE* out;
+	unsigned size;
+	int blocks = 0;
+
+	if(argc != 3)
+	{
+		fprintf(stderr, "Usage: %s game.gb aot_rom.c\n", argv[0]);
+		return 1;
+	}
+
+	rom = fopen(argv[1], "rb");
+	if(!rom)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	memInit();
+	for(size = 0; size < AOT_ROM_SIZE; size++)
+	{
+		int c = fgetc(rom);
+		if(c == EOF)
+			break;
+		writeMem(size, c);
+	}
+	fclose(rom);
+
+	// Entry point, then the RST and interrupt vectors.
+	addLeader(0x100);
+	for(int vector = 0; vector <= 0x60; vector += 8)
+		if(vector < size)
+			addLeader(vector);
+	discover();
+
+	out = fopen(argv[2], "w");
+	if(!out)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+
+	fprintf(out, "// Generated by recomp from %s. Do not edit.\n\n", argv[1]);
+	fprintf(out, "#include \"aot.h\"\n\n");
+
+	for(unsigned i = 0; i < AOT_ROM_SIZE; i++)
+		if((marks[i] & LEADER) && (marks[i] & SEEN))
+		{
+			emitBlock(out, i);
+			blocks++;
+		}
+
+	fprintf(out, "const AotBlock aotBlocks[AOT_ROM_SIZE] = {\n");
+	for(unsigned i = 0; i < AOT_ROM_SIZE; i++)
+		if((marks[i] & LEADER) && (marks[i] & SEEN))
+			fprintf(out, "\t[0x%04X] = block_%04X,\n", i, i);
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "const unsigned aotRomSize = %u;\n", size);
+	fprintf(out, "const uint8_t aotRom[] = {");
+	for(unsigned i = 0; i < size; i++)
+		fprintf(out, "%s0x%02X,", i % 16 ? " " : "\n\t", readMem(i));
+	fprintf(out, "\n};\n");
+
+	fclose(out);
+	memFree();
+	printf("%s: %d blocks\n", argv[2], blocks);
+	return 0;
+}
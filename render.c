@@ -0,0 +1,238 @@
+#include "render.h"
+#include "machine.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Records the ring holds. Must be a power of 2.
+#define RING_SIZE 4096
+
+// VRAM and OAM are sent in 16-byte chunks. VRAM chunks are numbered
+// through both banks.
+#define CHUNK_SIZE 16
+#define VRAM_CHUNKS (2 * 0x2000 / CHUNK_SIZE)
+#define OAM_SIZE 160
+
+// Empty polls the render thread yields for before it sleeps between them.
+#define IDLE_SPINS 1000
+#define IDLE_SLEEP_NS 100000
+
+enum {RECORD_VRAM, RECORD_OAM, RECORD_LINE, RECORD_FRAME};
+
+typedef struct {
+	uint8_t kind;
+	uint16_t offset; // Into VRAM, through both banks, or into OAM.
+	union {
+		uint8_t bytes[CHUNK_SIZE];
+		LineRegs regs;
+	};
+} Record;
+
+typedef struct RenderThread {
+	Record ring[RING_SIZE];
+	atomic_uint head; // Only written by the CPU thread.
+	atomic_uint tail; // Only written by the render thread.
+	atomic_int stop;
+	pthread_t thread;
+
+	// The render thread's copy of VRAM, its tiles and frames, and OAM.
+	Video video;
+	uint8_t oam[OAM_SIZE];
+
+	// The CPU thread's side: the VRAM chunks written since the last line
+	// was queued, and OAM as it was then.
+	uint8_t dirty[VRAM_CHUNKS];
+	uint16_t dirtyList[VRAM_CHUNKS];
+	int dirtyCount;
+	uint8_t sentOam[OAM_SIZE];
+} RenderThread;
+
+// --- Render thread ---
+
+static void applyRecord(RenderThread* t, const Record* r)
+{
+	Video* v = &t->video;
+
+	switch(r->kind)
+	{
+		case RECORD_VRAM:
+		{
+			int bank = r->offset / 0x2000, offset = r->offset % 0x2000;
+
+			memcpy(v->vram[bank] + offset, r->bytes, CHUNK_SIZE);
+			if(offset < 0x1800)
+				v->tileValid[bank * 384 + offset / 16] = 0;
+			break;
+		}
+		case RECORD_OAM:
+			memcpy(t->oam + r->offset, r->bytes, CHUNK_SIZE);
+			break;
+		case RECORD_LINE:
+			drawLine(v, t->oam, &r->regs);
+			break;
+		case RECORD_FRAME:
+			memcpy(v->shown, v->frame, sizeof(v->frame));
+			break;
+	}
+}
+
+static void idle(int* spins)
+{
+	struct timespec pause = {0, IDLE_SLEEP_NS};
+
+	if(++*spins < IDLE_SPINS)
+		sched_yield();
+	else
+		nanosleep(&pause, 0);
+}
+
+// Applies records until told to stop with the ring empty.
+static void* renderMain(void* arg)
+{
+	RenderThread* t = (RenderThread*) arg;
+	int spins = 0;
+
+	for(;;)
+	{
+		unsigned tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+
+		if(tail == atomic_load_explicit(&t->head, memory_order_acquire))
+		{
+			if(atomic_load(&t->stop))
+				return 0;
+			idle(&spins);
+			continue;
+		}
+
+		spins = 0;
+		applyRecord(t, &t->ring[tail % RING_SIZE]);
+		atomic_store_explicit(&t->tail, tail + 1, memory_order_release);
+	}
+}
+
+// --- CPU thread ---
+
+// The next free record. Waits while the ring is full.
+static Record* reserve(RenderThread* t, int kind)
+{
+	unsigned head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	Record* r;
+
+	while(head - atomic_load_explicit(&t->tail, memory_order_acquire) == RING_SIZE)
+		sched_yield();
+	r = &t->ring[head % RING_SIZE];
+	r->kind = kind;
+	return r;
+}
+
+// Hands the reserved record to the render thread.
+static void publish(RenderThread* t)
+{
+	unsigned head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+	atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+// Queues the VRAM and OAM chunks that changed since the last line.
+static void queueChanges(RenderThread* t)
+{
+	const uint8_t* vram = gb->video->vram[0];
+	const uint8_t* oam = gb->memory + 0xFE00;
+
+	for(int i = 0; i < t->dirtyCount; i++)
+	{
+		int chunk = t->dirtyList[i];
+		Record* r = reserve(t, RECORD_VRAM);
+
+		r->offset = chunk * CHUNK_SIZE;
+		memcpy(r->bytes, vram + r->offset, CHUNK_SIZE);
+		publish(t);
+		t->dirty[chunk] = 0;
+	}
+	t->dirtyCount = 0;
+
+	for(int offset = 0; offset < OAM_SIZE; offset += CHUNK_SIZE)
+		if(memcmp(t->sentOam + offset, oam + offset, CHUNK_SIZE))
+		{
+			Record* r = reserve(t, RECORD_OAM);
+
+			r->offset = offset;
+			memcpy(r->bytes, oam + offset, CHUNK_SIZE);
+			memcpy(t->sentOam + offset, oam + offset, CHUNK_SIZE);
+			publish(t);
+		}
+}
+
+void vramWritten(int bank, int offset)
+{
+	RenderThread* t = gb->video->thread;
+	int chunk = (bank * 0x2000 + offset) / CHUNK_SIZE;
+
+	if(!t->dirty[chunk])
+	{
+		t->dirty[chunk] = 1;
+		t->dirtyList[t->dirtyCount++] = chunk;
+	}
+}
+
+void queueLine(const LineRegs* regs)
+{
+	RenderThread* t = gb->video->thread;
+	Record* r;
+
+	queueChanges(t);
+	r = reserve(t, RECORD_LINE);
+	r->regs = *regs;
+	publish(t);
+}
+
+void queueFrame()
+{
+	RenderThread* t = gb->video->thread;
+
+	reserve(t, RECORD_FRAME);
+	publish(t);
+}
+
+const uint8_t* renderedFrame()
+{
+	RenderThread* t = gb->video->thread;
+
+	while(atomic_load_explicit(&t->tail, memory_order_acquire) !=
+		atomic_load_explicit(&t->head, memory_order_relaxed))
+		sched_yield();
+	return &t->video.shown[0][0];
+}
+
+void startRenderThread()
+{
+	RenderThread* t;
+
+	if(gb->video->thread)
+		return;
+
+	t = (RenderThread*) calloc(1, sizeof(RenderThread));
+	t->video = *gb->video;
+	memcpy(t->oam, gb->memory + 0xFE00, OAM_SIZE);
+	memcpy(t->sentOam, gb->memory + 0xFE00, OAM_SIZE);
+	pthread_create(&t->thread, 0, renderMain, t);
+	gb->video->thread = t;
+}
+
+void stopRenderThread()
+{
+	RenderThread* t = gb->video->thread;
+
+	if(!t)
+		return;
+
+	atomic_store(&t->stop, 1);
+	pthread_join(t->thread, 0);
+	memcpy(gb->video->frame, t->video.frame, sizeof(t->video.frame));
+	memcpy(gb->video->shown, t->video.shown, sizeof(t->video.shown));
+	gb->video->thread = 0;
+	free(t);
+}
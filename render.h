@@ -0,0 +1,32 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "ppu.h"
+
+// Drawing lines on a thread of their own, so the CPU and the PPU's pixel
+// work run side by side. The thread has its own copy of VRAM, OAM and the
+// tile cache. At each HBlank the CPU thread queues the VRAM and OAM bytes
+// that changed since the last line, 16 at a time, and then the line's
+// registers. The thread applies them in order and draws the line with
+// drawLine(), so the frames come out exactly as without it.
+//
+// The queue is a single producer, single consumer ring with no locks.
+// The CPU thread only waits when it is full, and the render thread polls
+// it while it is empty, sleeping once it has been empty for a while.
+
+// Starts and stops the render thread for the selected machine. Stopping
+// waits for it to finish what is queued.
+void startRenderThread();
+void stopRenderThread();
+
+// Waits for the render thread to catch up and returns the last frame it
+// finished, for ppuFrame().
+const uint8_t* renderedFrame();
+
+// For the PPU: VRAM bytes from offset in bank were written, a line is due
+// and VBlank started.
+void vramWritten(int bank, int offset);
+void queueLine(const LineRegs* r);
+void queueFrame();
+
+#endif
@@ -0,0 +1,370 @@
+#include "rewind.h"
+#include "machine.h"
+#include "state.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// States the CPU thread can get ahead of the packing by. Must be a power
+// of 2.
+#define QUEUE_SIZE 4
+
+// Frames the index holds, a little over 18 minutes at 60 fps.
+#define MAX_FRAMES 65536
+
+// Zero bytes that end a run of other bytes. Fewer cost more to count
+// than to copy.
+#define MIN_ZEROS 4
+
+// Room pack() can need beyond the bytes it packs.
+#define PACK_SLACK 64
+
+// Frames the store has to hold at the least.
+#define MIN_FRAMES 4
+
+// Empty polls the rewind thread yields for before it sleeps between them.
+#define IDLE_SPINS 1000
+#define IDLE_SLEEP_NS 100000
+
+// A packed frame in the store.
+typedef struct {
+	size_t offset;
+	uint32_t length;
+	uint32_t key; // Number of its keyframe, its own if it is one.
+} Frame;
+
+typedef struct Rewind {
+	size_t size; // Of one state.
+	int keyInterval;
+
+	// States waiting to be packed.
+	uint8_t* queue;
+	atomic_uint head; // Only written by the CPU thread.
+	atomic_uint tail; // Only written by the rewind thread.
+	atomic_int stop;
+	pthread_t thread;
+
+	// The newest keyframe, whole, and the deltas stored since it, -1 to
+	// make the next frame a keyframe. rewindSeek() unpacks into key, so
+	// the frame after it is always one.
+	uint8_t* key;
+	uint32_t keyNumber;
+	int sinceKey;
+	uint8_t* packed;
+
+	// The packed frames in a ring of bytes, and where each one is. Frames
+	// are numbered from rewindStart() and first to first + count - 1 are
+	// held. The oldest is always a keyframe.
+	uint8_t* store;
+	size_t storeSize, storeHead;
+	Frame frames[MAX_FRAMES];
+	uint32_t first, count;
+} Rewind;
+
+// --- Packing ---
+
+static uint8_t* putCount(uint8_t* out, size_t n)
+{
+	for(; n >= 0x80; n >>= 7)
+		*out++ = n | 0x80;
+	*out++ = n;
+	return out;
+}
+
+static const uint8_t* getCount(const uint8_t* in, size_t* n)
+{
+	int shift = 0;
+
+	*n = 0;
+	do
+	{
+		*n |= (size_t) (*in & 0x7F) << shift;
+		shift += 7;
+	} while(*in++ & 0x80);
+	return in;
+}
+
+// Byte i of a XOR b, or of a when there is no b.
+static inline uint8_t byteAt(const uint8_t* a, const uint8_t* b, size_t i)
+{
+	return b ? a[i] ^ b[i] : a[i];
+}
+
+static inline uint64_t wordAt(const uint8_t* a, const uint8_t* b, size_t i)
+{
+	uint64_t x, y = 0;
+
+	memcpy(&x, a + i, 8);
+	if(b)
+		memcpy(&y, b + i, 8);
+	return x ^ y;
+}
+
+// Packs n bytes of a XOR b, or of a when b is 0, into out as runs of
+// zeros and of other bytes: the length of each, then the other bytes.
+// Returns the bytes written, at most n + PACK_SLACK.
+static size_t pack(const uint8_t* a, const uint8_t* b, size_t n, uint8_t* out)
+{
+	uint8_t* o = out;
+	size_t i = 0;
+
+	while(i < n)
+	{
+		size_t start = i, end;
+		int zeros = 0;
+
+		while(i + 8 <= n && !wordAt(a, b, i))
+			i += 8;
+		while(i < n && !byteAt(a, b, i))
+			i++;
+		o = putCount(o, i - start);
+
+		for(start = i; i < n && zeros < MIN_ZEROS; i++)
+			zeros = byteAt(a, b, i) ? 0 : zeros + 1;
+		end = i = zeros == MIN_ZEROS ? i - MIN_ZEROS : i;
+		o = putCount(o, end - start);
+		for(; start < end; start++)
+			*o++ = byteAt(a, b, start);
+	}
+	return o - out;
+}
+
+// Unpacks length bytes from pack() into out, or XORs them into it.
+static void unpack(const uint8_t* in, size_t length, uint8_t* out, int xor)
+{
+	const uint8_t* end = in + length;
+
+	while(in < end)
+	{
+		size_t zeros, bytes;
+
+		in = getCount(in, &zeros);
+		in = getCount(in, &bytes);
+		if(!xor)
+			memset(out, 0, zeros);
+		out += zeros;
+		if(xor)
+			for(size_t i = 0; i < bytes; i++)
+				out[i] ^= in[i];
+		else
+			memcpy(out, in, bytes);
+		out += bytes;
+		in += bytes;
+	}
+}
+
+// --- Rewind thread ---
+
+// Throws the oldest keyframe and its deltas away.
+static void dropOldest(Rewind* r)
+{
+	uint32_t key = r->frames[r->first % MAX_FRAMES].key;
+
+	do
+	{
+		r->first++;
+		r->count--;
+	} while(r->count && r->frames[r->first % MAX_FRAMES].key == key);
+}
+
+// Drops frames until length bytes fit after the newest, or at the start
+// of the store if they would run past its end, and returns where.
+static size_t makeRoom(Rewind* r, size_t length)
+{
+	for(;; dropOldest(r))
+	{
+		size_t head = r->storeHead, tail;
+
+		if(!r->count)
+			return 0;
+		if(r->count == MAX_FRAMES)
+			continue;
+
+		tail = r->frames[r->first % MAX_FRAMES].offset;
+		if(head > tail)
+		{
+			if(length <= r->storeSize - head)
+				return head;
+			if(length <= tail)
+				return 0;
+		}
+		else if(length <= tail - head)
+			return head;
+	}
+}
+
+// Packs a state and stores it as the newest frame.
+static void storeFrame(Rewind* r, const uint8_t* state)
+{
+	uint32_t number = r->first + r->count;
+	int key = r->sinceKey < 0 || r->sinceKey >= r->keyInterval - 1;
+	size_t length = pack(state, key ? 0 : r->key, r->size, r->packed);
+	size_t offset = makeRoom(r, length);
+	Frame* f;
+
+	// Making room threw its keyframe away.
+	if(!key && r->first > r->keyNumber)
+	{
+		key = 1;
+		length = pack(state, 0, r->size, r->packed);
+		offset = makeRoom(r, length);
+	}
+
+	memcpy(r->store + offset, r->packed, length);
+	r->storeHead = offset + length;
+	f = &r->frames[number % MAX_FRAMES];
+	f->offset = offset;
+	f->length = length;
+	f->key = key ? number : r->keyNumber;
+	r->count++;
+
+	if(key)
+	{
+		memcpy(r->key, state, r->size);
+		r->keyNumber = number;
+		r->sinceKey = 0;
+	}
+	else
+		r->sinceKey++;
+}
+
+static void idle(int* spins)
+{
+	struct timespec pause = {0, IDLE_SLEEP_NS};
+
+	if(++*spins < IDLE_SPINS)
+		sched_yield();
+	else
+		nanosleep(&pause, 0);
+}
+
+// Stores the states queued until told to stop with none left.
+static void* rewindMain(void* arg)
+{
+	Rewind* r = (Rewind*) arg;
+	int spins = 0;
+
+	for(;;)
+	{
+		unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+		if(tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		{
+			if(atomic_load(&r->stop))
+				return 0;
+			idle(&spins);
+			continue;
+		}
+
+		spins = 0;
+		storeFrame(r, r->queue + (tail % QUEUE_SIZE) * r->size);
+		atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	}
+}
+
+// --- CPU thread ---
+
+// Waits for the rewind thread to store everything queued.
+static void waitStored(Rewind* r)
+{
+	while(atomic_load_explicit(&r->tail, memory_order_acquire) !=
+		atomic_load_explicit(&r->head, memory_order_relaxed))
+		sched_yield();
+}
+
+int rewindStart(size_t budget, int keyInterval)
+{
+	size_t size = stateSize();
+	size_t fixed = sizeof(Rewind) + (QUEUE_SIZE + 2) * size + PACK_SLACK;
+	Rewind* r;
+
+	rewindStop();
+	if(budget < fixed + MIN_FRAMES * (size + PACK_SLACK))
+		return 0;
+
+	r = (Rewind*) calloc(1, sizeof(Rewind));
+	r->size = size;
+	r->keyInterval = keyInterval > 0 ? keyInterval : 1;
+	r->sinceKey = -1;
+	r->queue = (uint8_t*) malloc(QUEUE_SIZE * size);
+	r->key = (uint8_t*) malloc(size);
+	r->packed = (uint8_t*) malloc(size + PACK_SLACK);
+	r->storeSize = budget - fixed;
+	r->store = (uint8_t*) malloc(r->storeSize);
+	pthread_create(&r->thread, 0, rewindMain, r);
+	gb->rewind = r;
+	return 1;
+}
+
+void rewindStop()
+{
+	Rewind* r = gb->rewind;
+
+	if(!r)
+		return;
+
+	atomic_store(&r->stop, 1);
+	pthread_join(r->thread, 0);
+	free(r->queue);
+	free(r->key);
+	free(r->packed);
+	free(r->store);
+	free(r);
+	gb->rewind = 0;
+}
+
+void rewindCapture()
+{
+	Rewind* r = gb->rewind;
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	while(head - atomic_load_explicit(&r->tail, memory_order_acquire) == QUEUE_SIZE)
+		sched_yield();
+	stateSave(r->queue + (head % QUEUE_SIZE) * r->size, r->size);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+int rewindFrames()
+{
+	waitStored(gb->rewind);
+	return gb->rewind->count;
+}
+
+size_t rewindStored()
+{
+	Rewind* r = gb->rewind;
+	size_t stored = 0;
+
+	waitStored(r);
+	for(uint32_t n = r->first; n != r->first + r->count; n++)
+		stored += r->frames[n % MAX_FRAMES].length;
+	return stored;
+}
+
+int rewindSeek(int back)
+{
+	Rewind* r = gb->rewind;
+	uint32_t number;
+	const Frame* f;
+	const Frame* key;
+
+	waitStored(r);
+	if(back < 0 || (uint32_t) back >= r->count)
+		return 0;
+
+	number = r->first + r->count - 1 - back;
+	f = &r->frames[number % MAX_FRAMES];
+	key = &r->frames[f->key % MAX_FRAMES];
+	unpack(r->store + key->offset, key->length, r->key, 0);
+	if(f != key)
+		unpack(r->store + f->offset, f->length, r->key, 1);
+	stateLoad(r->key, r->size);
+
+	r->count = number - r->first + 1;
+	r->storeHead = f->offset + f->length;
+	r->sinceKey = -1;
+	return 1;
+}
@@ -0,0 +1,38 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+
+// Going back through recent frames. A save state (see state.h) is taken
+// after each frame and kept in a fixed budget of memory. Every
+// keyInterval-th frame is a keyframe. The others are kept as the XOR of
+// their state and their keyframe's, which is mostly zeros. Both are
+// packed as runs of zeros and of other bytes, so getting any frame back
+// takes unpacking at most one keyframe and one delta.
+//
+// The CPU thread only copies the state out. A thread of its own packs it
+// and stores it, throwing the oldest keyframe and its deltas away when the
+// budget is used up.
+
+// Starts keeping the selected machine's history in at most budget bytes,
+// everything included. Call after cartLoad(). Returns 0 if budget does not
+// hold at least a few frames.
+int rewindStart(size_t budget, int keyInterval);
+
+// Stops and frees it. memFree() calls it.
+void rewindStop();
+
+// Keeps the state as it is now as the newest frame. Call between frames.
+void rewindCapture();
+
+// Frames held, the newest included, and the bytes they take packed. Both
+// wait for the frames being packed first.
+int rewindFrames();
+size_t rewindStored();
+
+// Loads the frame back frames before the newest, 0 for the newest, and
+// forgets the ones after it, so going on makes new history from there.
+// Returns 0 if that frame is no longer held.
+int rewindSeek(int back);
+
+#endif
@@ -0,0 +1,45 @@
+#include "runahead.h"
+#include "apu.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "state.h"
+#include <stdlib.h>
+
+uint64_t runAhead(int frames)
+{
+	int policy = gb->ppu.renderPolicy, every = gb->ppu.renderEvery;
+	uint64_t ran;
+
+	if(frames <= 0)
+		return runFrame();
+	if(gb->aheadSize != stateSize())
+	{
+		free(gb->aheadState);
+		gb->aheadSize = stateSize();
+		gb->aheadState = (uint8_t*) malloc(gb->aheadSize);
+	}
+
+	ppuSetRenderPolicy(frames == 1 ? RENDER_ALWAYS : RENDER_ON_DEMAND, 0);
+	ran = runFrame();
+	stateSave(gb->aheadState, gb->aheadSize);
+
+	apuMute(1);
+	for(int i = 1; i <= frames; i++)
+	{
+		if(i == frames - 1)
+			ppuSetRenderPolicy(RENDER_ALWAYS, 0);
+		runFrame();
+	}
+	stateLoad(gb->aheadState, gb->aheadSize);
+	apuMute(0);
+
+	ppuSetRenderPolicy(policy, every);
+	return ran;
+}
+
+void runAheadFree()
+{
+	free(gb->aheadState);
+	gb->aheadState = 0;
+	gb->aheadSize = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+
+#include <stdint.h>
+
+// Run-ahead, which hides some of a game's own input lag. Each frame runs
+// as usual with the keys as they are, then the machine is saved, frames
+// more frames are run with the sound muted, and the save is loaded again.
+// The screen shows the last frame run ahead, so a key pressed now shows
+// up that many frames sooner. The machine and its sound go on exactly as
+// they would have without it.
+//
+// Only the frames that could end up shown are drawn: whatever finishes in
+// the last two frames run, wherever the LCD's frames fall in them. The
+// render policy is put back afterwards.
+
+// Runs a frame like runFrame() and shows the one frames after it, or only
+// runs it when frames is 0. Returns the cycles run.
+uint64_t runAhead(int frames);
+
+// Frees the state it goes back to, for memFree().
+void runAheadFree();
+
+#endif
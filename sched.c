@@ -0,0 +1,62 @@
+#include "sched.h"
+#include "cpu.h"
+
+// Sets gb->nextEvent to the earliest event, or the end of the run.
+static void updateNextEvent()
+{
+	uint64_t next = gb->runEnd;
+
+	for(int i = 0; i < EVENT_COUNT; i++)
+		if(gb->eventAt[i] < next)
+			next = gb->eventAt[i];
+	gb->nextEvent = halted() ? 0 : next;
+}
+
+void scheduleEvent(Event event, uint64_t at, EventHandler handler)
+{
+	gb->eventAt[event] = at;
+	gb->eventHandler[event] = handler;
+	if(at < gb->nextEvent)
+		gb->nextEvent = at;
+}
+
+void cancelEvent(Event event)
+{
+	gb->eventAt[event] = EVENT_NEVER;
+}
+
+void resetEvents()
+{
+	for(int i = 0; i < EVENT_COUNT; i++)
+		gb->eventAt[i] = EVENT_NEVER;
+	gb->runEnd = EVENT_NEVER;
+	gb->nextEvent = EVENT_NEVER;
+}
+
+void restoreEvent(Event event, EventHandler handler)
+{
+	if(gb->eventAt[event] != EVENT_NEVER)
+		gb->eventHandler[event] = handler;
+}
+
+void runEvents()
+{
+	for(;;)
+	{
+		int due = -1;
+		uint64_t at;
+
+		for(int i = 0; i < EVENT_COUNT; i++)
+			if(gb->eventAt[i] <= gb->cycles && (due < 0 || gb->eventAt[i] < gb->eventAt[due]))
+				due = i;
+		if(due < 0)
+			break;
+
+		// The handler may schedule it again.
+		at = gb->eventAt[due];
+		gb->eventAt[due] = EVENT_NEVER;
+		gb->eventHandler[due](at);
+	}
+
+	updateNextEvent();
+}
@@ -0,0 +1,39 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "machine.h"
+#include <stdint.h>
+
+// Timed events. Instead of checking every subsystem after every
+// instruction, each one schedules the cycle it next needs attention at
+// (see Event in machine.h) and the CPU runs uninterrupted until the
+// earliest of them, gb->nextEvent. The run loops then call runEvents().
+//
+// gb->nextEvent only ever moves later in runEvents(). Anything else that
+// needs the run loop to stop, like haltCPU(), sets it to 0.
+
+// Cycles in one frame: 154 lines of 456, 144 drawn and then 10 of VBlank.
+#define FRAME_CYCLES 70224
+#define LINE_CYCLES 456
+#define FRAME_LINES 154
+#define VISIBLE_LINES 144
+
+// Schedules event to be run by handler at cycle at, replacing any time it
+// was already scheduled for.
+void scheduleEvent(Event event, uint64_t at, EventHandler handler);
+
+// Unschedules event.
+void cancelEvent(Event event);
+
+// Unschedules every event, for power on.
+void resetEvents();
+
+// Gives event its handler back after a save state is loaded, if it is
+// scheduled. Each device does this for its own events.
+void restoreEvent(Event event, EventHandler handler);
+
+// Runs every event due by gb->cycles, earliest first, then works out
+// gb->nextEvent again.
+void runEvents();
+
+#endif
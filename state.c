@@ -0,0 +1,313 @@
+#include "state.h"
+#include "apu.h"
+#include "block.h"
+#include "cart.h"
+#include "dma.h"
+#include "interrupt.h"
+#include "machine.h"
+#include "memory.h"
+#include "ppu.h"
+#include "sched.h"
+#include "timer.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STATE_MAGIC "GBST"
+
+// The cartridge header's global checksum.
+#define HEADER_CHECKSUM 0x14E
+
+// Multiplier for stateHash(), from the golden ratio.
+#define HASH_PRIME 0x9E3779B97F4A7C15ull
+
+// What the devices hold: everything but memory.
+typedef struct {
+	CPUState cpu;
+	int halt;
+	uint64_t cycles;
+	uint64_t eventAt[EVENT_COUNT];
+	Timer timer;
+	Ppu ppu;
+	Hdma hdma;
+	int romBank;
+	Cartridge mbc;      // Only the MBC's registers, see copyMbc().
+	uint8_t apu[APU_STATE_SIZE];
+} Devices;
+
+// Everything but the cartridge's RAM, which follows it.
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t size;      // Of the whole state.
+	uint16_t checksum;  // Of the ROM it was saved with, 0 for none.
+
+	Devices devices;
+	uint8_t vram[2][0x2000];
+	uint8_t memory[0x10000];
+} SaveState;
+
+static uint16_t romChecksum()
+{
+	const uint8_t* rom = gb->cart.rom;
+
+	return rom ? rom[HEADER_CHECKSUM] << 8 | rom[HEADER_CHECKSUM + 1] : 0;
+}
+
+static size_t cartRamSize()
+{
+	return (size_t) gb->cart.ramBanks * 0x2000;
+}
+
+// The MBC's registers and clock, without the ROM and RAM they select from.
+static void copyMbc(Cartridge* to, const Cartridge* from)
+{
+	to->ramEnabled = from->ramEnabled;
+	to->romSelect = from->romSelect;
+	to->ramSelect = from->ramSelect;
+	to->mode = from->mode;
+	to->rtcBase = from->rtcBase;
+	to->rtcCycles = from->rtcCycles;
+	to->rtcFlags = from->rtcFlags;
+	memcpy(to->rtc, from->rtc, sizeof(to->rtc));
+}
+
+// Which frames are drawn, and whether the one under way is, belong to the
+// machine a state is loaded into rather than to the state.
+static void copyRendering(Ppu* to, const Ppu* from)
+{
+	to->renderPolicy = from->renderPolicy;
+	to->renderEvery = from->renderEvery;
+	to->frameRequested = from->frameRequested;
+	to->drawing = from->drawing;
+}
+
+static void saveDevices(Devices* d)
+{
+	static const Ppu none;
+
+	// Zeroed first so the padding is the same every time.
+	memset(d, 0, sizeof(*d));
+	d->cpu = gb->cpu;
+	d->halt = gb->halt;
+	d->cycles = gb->cycles;
+	memcpy(d->eventAt, gb->eventAt, sizeof(d->eventAt));
+	d->timer = gb->timer;
+	d->ppu = gb->ppu;
+	copyRendering(&d->ppu, &none);
+	d->hdma = gb->hdma;
+	d->romBank = gb->romBank;
+	copyMbc(&d->mbc, &gb->cart);
+	apuSave(d->apu);
+}
+
+// Call apuUpdate() first, see apuLoad().
+static void loadDevices(const Devices* d)
+{
+	Ppu live = gb->ppu;
+
+	gb->cpu = d->cpu;
+	gb->halt = d->halt;
+	gb->cycles = d->cycles;
+	memcpy(gb->eventAt, d->eventAt, sizeof(gb->eventAt));
+	gb->nextEvent = 0;
+	gb->timer = d->timer;
+	gb->ppu = d->ppu;
+	copyRendering(&gb->ppu, &live);
+	gb->hdma = d->hdma;
+	gb->romBank = d->romBank;
+	copyMbc(&gb->cart, &d->mbc);
+	apuLoad(d->apu);
+}
+
+// Hashes n bytes on from h.
+static uint64_t hashBytes(const void* data, size_t n, uint64_t h)
+{
+	const uint8_t* p = (const uint8_t*) data;
+
+	for(; n >= 8; n -= 8, p += 8)
+	{
+		uint64_t word;
+
+		memcpy(&word, p, 8);
+		h = (h ^ word) * HASH_PRIME;
+		h ^= h >> 32;
+	}
+	for(; n; n--, p++)
+		h = (h ^ *p) * HASH_PRIME;
+	h ^= h >> 29;
+	return h * HASH_PRIME;
+}
+
+// The host memory behind a state page.
+static const uint8_t* pageMemory(int page)
+{
+	if(page < PAGES_VRAM)
+		return gb->memory + (page << 8);
+	if(page < PAGES_CART)
+		return gb->video->vram[0] + ((page - PAGES_VRAM) << 8);
+	return gb->cart.ram + ((page - PAGES_CART) << 8);
+}
+
+// The bytes of state page page in s.
+static const uint8_t* statePageIn(const SaveState* s, int page)
+{
+	if(page < PAGES_VRAM)
+		return s->memory + (page << 8);
+	if(page < PAGES_CART)
+		return s->vram[0] + ((page - PAGES_VRAM) << 8);
+	return (const uint8_t*) (s + 1) + ((page - PAGES_CART) << 8);
+}
+
+// Drops the blocks on pages s is about to change. The ROM, which is not
+// part of the state, keeps its blocks, and so does RAM that holds the
+// same bytes in s. Pages mapped differently after the load are dealt with
+// by the remapping, see cartRestore() and ppuRestore().
+static void dropChangedCode(const SaveState* s)
+{
+	for(int page = 0; page < 0x100; page++)
+	{
+		// Only HRAM on the I/O page can hold code.
+		int statePage = page == 0xFF ? 0xFF : gb->statePage[page];
+		int from = page == 0xFF ? 0x80 : 0;
+
+		if(gb->codePages[page] && statePage < STATE_PAGES
+			&& memcmp(pageMemory(statePage) + from, statePageIn(s, statePage) + from, 0x100 - from))
+			invalidatePages(page, 1);
+	}
+}
+
+size_t stateSize()
+{
+	return sizeof(SaveState) + cartRamSize();
+}
+
+size_t stateSave(void* buf, size_t size)
+{
+	SaveState* s = (SaveState*) buf;
+
+	if(size < stateSize())
+		return 0;
+
+	memset(s, 0, offsetof(SaveState, devices));
+	memcpy(s->magic, STATE_MAGIC, 4);
+	s->version = STATE_VERSION;
+	s->size = stateSize();
+	s->checksum = romChecksum();
+	saveDevices(&s->devices);
+
+	memcpy(s->vram, gb->video->vram, sizeof(s->vram));
+	memcpy(s->memory, gb->memory, sizeof(s->memory));
+	if(gb->cart.ram)
+		memcpy(s + 1, gb->cart.ram, cartRamSize());
+	return s->size;
+}
+
+int stateLoad(const void* buf, size_t size)
+{
+	const SaveState* s = (const SaveState*) buf;
+
+	if(size < sizeof(SaveState) || memcmp(s->magic, STATE_MAGIC, 4) || s->version != STATE_VERSION
+		|| s->size != stateSize() || size < s->size || s->checksum != romChecksum())
+		return 0;
+
+	// Audio up to now is played out at the old cycle count.
+	apuUpdate();
+	dropChangedCode(s);
+	loadDevices(&s->devices);
+
+	memcpy(gb->memory, s->memory, sizeof(s->memory));
+	if(gb->cart.ram)
+		memcpy(gb->cart.ram, s + 1, cartRamSize());
+
+	timerRestore();
+	dmaRestore();
+	ppuRestore(s->vram[0]);
+	cartRestore();
+	interruptRestore();
+	dirtyAll();
+	return 1;
+}
+
+uint64_t stateHash()
+{
+	uint16_t pages[STATE_PAGES];
+	int count = dirtyPages(gb->hashEpoch, pages);
+	int end = PAGES_CART + gb->cart.ramBanks * 0x20;
+	Devices d;
+
+	gb->hashEpoch = newEpoch();
+	for(int i = 0; i < count; i++)
+	{
+		int page = pages[i];
+		uint64_t hash = page < end ? hashBytes(pageMemory(page), 0x100, page + 1) : 0;
+
+		gb->pagesHash += hash - gb->pageHash[page];
+		gb->pageHash[page] = hash;
+	}
+
+	saveDevices(&d);
+	return hashBytes(&d, sizeof(d), gb->pagesHash);
+}
+
+int stateSaveFile(const char* path)
+{
+	size_t size = stateSize();
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	void* map;
+
+	if(fd < 0 || ftruncate(fd, size) < 0)
+	{
+		perror(path);
+		if(fd >= 0)
+			close(fd);
+		return 0;
+	}
+	map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		perror(path);
+		return 0;
+	}
+	stateSave(map, size);
+	munmap(map, size);
+	return 1;
+}
+
+int stateLoadFile(const char* path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	void* map;
+	int loaded;
+
+	if(fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(path);
+		if(fd >= 0)
+			close(fd);
+		return 0;
+	}
+	if(st.st_size < (off_t) sizeof(SaveState))
+	{
+		fprintf(stderr, "%s: not a save state\n", path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		perror(path);
+		return 0;
+	}
+	loaded = stateLoad(map, st.st_size);
+	munmap(map, st.st_size);
+	if(!loaded)
+		fprintf(stderr, "%s: not a save state of this game and version\n", path);
+	return loaded;
+}
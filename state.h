@@ -0,0 +1,45 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Save states. A state is one fixed-layout block: a header, then the CPU,
+// the scheduler, every device, all 64K of memory and both VRAM banks, and
+// then the cartridge's RAM, if it has any. Saving and loading are copies
+// into and out of a buffer the caller owns, with nothing allocated, and
+// a state file is the same bytes, so it can be mapped straight in.
+//
+// A state only loads into a machine running the same ROM (by its header
+// checksum) and built with the same STATE_VERSION. Host pointers are never
+// saved: loading maps the pages and gives the events their handlers back.
+// Neither are finished frames or queued audio, only what makes the next
+// ones. The render policy, and whether the frame under way is drawn, are
+// the loading machine's own.
+
+// Bump whenever the layout of anything saved changes.
+#define STATE_VERSION 2
+
+// Bytes a state of the selected machine takes.
+size_t stateSize();
+
+// Saves the selected machine into buf. Returns the bytes written, or 0 if
+// size is less than stateSize().
+size_t stateSave(void* buf, size_t size);
+
+// Loads the state in buf into the selected machine. Returns 0, changing
+// nothing, if it is not a state of this version for the loaded ROM.
+int stateLoad(const void* buf, size_t size);
+
+// A 64-bit hash of the selected machine's state, equal for machines whose
+// states are. Only the pages written since the last call are hashed again
+// (see dirtyPages() in memory.h), so hashing every frame costs about as
+// much as what the frame wrote.
+uint64_t stateHash();
+
+// The same through a file, which is mapped rather than read. Return 0
+// after printing why to stderr if the file cannot be used.
+int stateSaveFile(const char* path);
+int stateLoadFile(const char* path);
+
+#endif
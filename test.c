@@ -3,7 +3,28 @@
 #include "execute.h"
 #include "memory.h"
 #include "cpu.h"
+#include "disasm.h"
+#include "opcodes.h"
+#include "loops.h"
+#include "cart.h"
+#include "sched.h"
+#include "ppu.h"
+#include "render.h"
+#include "output.h"
+#include "apu.h"
+#include "state.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "joypad.h"
+#include "movie.h"
+#include "interrupt.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "assert.h"
+#ifdef JIT
+#include "jit.h"
+#endif
 
 // Writes the given instrs into memory.
 void fillMemory(int n, uint8_t* instrs) {
@@ -33,9 +54,1189 @@ void testPUSH() {
   printf("PASSED testPUSH\n");
 }
 
+// LD A, 0x45
+// ADD A, 0x38
+// DAA
+// LD B, A
+// SCF
+// SBC A, 0x03
+void testALU() {
+  uint8_t instrs[] = {0x3E, 0x45, 0xC6, 0x38, 0x27, 0x47, 0x37, 0xDE, 0x03, 0x10};
+  fillMemory(10, instrs);
+  CPU();
+  assert(B() == 0x83);
+  assert(A() == 0x7F);
+  assert(Nflag() && Hflag() && !Cflag());
+  printf("PASSED testALU\n");
+}
+
+// LD B, 0x81
+// RLC B
+// BIT 7, B
+// SET 7, B
+void testCB() {
+  uint8_t instrs[] = {0x06, 0x81, 0xCB, 0x00, 0xCB, 0x78, 0xCB, 0xF8, 0x10};
+  fillMemory(9, instrs);
+  CPU();
+  assert(B() == 0x83);
+  assert(Zflag() && Cflag());
+  printf("PASSED testCB\n");
+}
+
+// LD BC, 0xABCD
+// JR NZ, -4
+// BIT 7, (HL)
+void testDisassemble() {
+  uint8_t instrs[] = {0x01, 0xCD, 0xAB, 0x20, 0xFC, 0xCB, 0x7E};
+  char text[32];
+  fillMemory(7, instrs);
+  assert(disassemble(0x100, text, sizeof(text)) == 3);
+  assert(!strcmp(text, "LD BC,$ABCD"));
+  assert(disassemble(0x103, text, sizeof(text)) == 2);
+  assert(!strcmp(text, "JR NZ,$0101"));
+  assert(disassemble(0x105, text, sizeof(text)) == 2);
+  assert(!strcmp(text, "BIT 7,(HL)"));
+  assert(opcodeAt(0x105)->cycles == 12);
+  assert(opcodeInfo[0x20].cyclesTaken == 12);
+  printf("PASSED testDisassemble\n");
+}
+
+// LD A, 0x01
+// SUB 0x02
+// INC B
+// PUSH AF
+// XOR A
+// LD HL, 0x0FFF
+// LD BC, 0x0001
+// ADD HL, BC
+// PUSH AF
+// POP BC
+// POP DE
+void testFlags() {
+  uint8_t instrs[] = {0x3E, 0x01, 0xD6, 0x02, 0x04, 0xF5, 0xAF, 0x21, 0xFF, 0x0F,
+    0x01, 0x01, 0x00, 0x09, 0xF5, 0xC1, 0xD1, 0x10};
+  fillMemory(18, instrs);
+  CPU();
+  assert(DE() == 0xFF10); // INC kept C from SUB
+  assert(BC() == 0x00A0); // ADD HL kept Z from XOR
+  printf("PASSED testFlags\n");
+}
+
+// LD A, 0
+// LD HL, 0x0108
+// LD (HL), 0x3C
+// NOP
+// NOP (overwritten with INC A by the previous store)
+void testSelfModifying() {
+  uint8_t instrs[] = {0x3E, 0x00, 0x21, 0x08, 0x01, 0x36, 0x3C, 0x00, 0x00, 0x10};
+  fillMemory(10, instrs);
+  CPU();
+  assert(A() == 1);
+  printf("PASSED testSelfModifying\n");
+}
+
+// Runs a program on a second machine and checks the first is untouched.
+void testTwoMachines() {
+  uint8_t instrs[] = {0x06, 0x12, 0x10};
+  uint8_t other[] = {0x06, 0x34, 0x10};
+  Machine* first = gb;
+  Machine second = {0};
+
+  fillMemory(3, instrs);
+  CPU();
+
+  machineSelect(&second);
+  memInit();
+  fillMemory(3, other);
+  CPU();
+  assert(B() == 0x34);
+  memFree();
+
+  machineSelect(first);
+  assert(B() == 0x12);
+  assert(readMem(0x101) == 0x12);
+  printf("PASSED testTwoMachines\n");
+}
+
+// Runs from 0x100 an instruction at a time until STOP or until the cycles
+// taken reach limit, which ends the run like runFor() does. Returns the
+// cycles and counts the instructions.
+long runCounted(long limit, long* instructions) {
+  int cycles;
+
+  CPUStateInit();
+  gb->runEnd = limit;
+  if(gb->nextEvent > gb->runEnd)
+    gb->nextEvent = gb->runEnd;
+  *instructions = 0;
+  while(!halted() && gb->cycles < limit) {
+    execute(readMem(PC()), &cycles);
+    gb->cycles += cycles;
+    (*instructions)++;
+  }
+  gb->runEnd = EVENT_NEVER;
+  return gb->cycles;
+}
+
+// Copies, fills and a poll loop that nothing can end, run with and without
+// the loop idioms. Both have to stop in the same state after the same cycles.
+// So do loops polling DIV and STAT, which change with no event, and a copy
+// the VBlank interrupt comes in the middle of.
+void testLoopIdioms() {
+  uint8_t instrs[] = {
+    0x21, 0x00, 0x00, 0x11, 0x00, 0xC0, 0x01, 0x00, 0x03, // HL=$0000 DE=$C000 BC=$300
+    0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8,       // 16-bit copy
+    0x21, 0x00, 0x01, 0x11, 0x00, 0xC4, 0x0E, 0x40,       // HL=$0100 DE=$C400 C=$40
+    0x2A, 0x12, 0x13, 0x0D, 0x20, 0xFA,                   // 8-bit copy
+    0x21, 0xFF, 0xC5, 0x3E, 0xA5, 0x06, 0x00,             // HL=$C5FF A=$A5 B=0
+    0x32, 0x05, 0x20, 0xFC,                               // fill down
+    0x21, 0x00, 0xC7, 0x1E, 0x10,                         // HL=$C700 E=$10
+    0x22, 0x1D, 0x20, 0xFC,                               // fill up
+    0xF0, 0x80, 0xFE, 0x42, 0x20, 0xFA};                  // poll $FF80 for $42
+  uint16_t regs[2][6];
+  uint8_t ram[2][0x800];
+  long cycles[2], steps[2];
+
+  fillMemory(sizeof(instrs), instrs);
+  for(int pass = 0; pass < 2; pass++) {
+    loopIdioms = !pass;
+    for(int i = 0; i < 0x800; i++)
+      writeMem(0xC000 + i, 0);
+    writeMem(0xFF80, 0);
+    cycles[pass] = runCounted(pass ? cycles[0] : 200000, &steps[pass]);
+    regs[pass][0] = AF(); regs[pass][1] = BC(); regs[pass][2] = DE();
+    regs[pass][3] = HL(); regs[pass][4] = SP(); regs[pass][5] = holdPC();
+    for(int i = 0; i < 0x800; i++)
+      ram[pass][i] = readMem(0xC000 + i);
+  }
+  loopIdioms = 1;
+
+  assert(cycles[0] == cycles[1]);
+  assert(steps[0] * 10 < steps[1]);
+  assert(memcmp(regs[0], regs[1], sizeof(regs[0])) == 0);
+  assert(memcmp(ram[0], ram[1], sizeof(ram[0])) == 0);
+  assert(ram[0][0x5FF] == 0xA5 && ram[0][0x500] == 0xA5 && ram[0][0x70F] == 0xA5);
+
+  for(int poll = 0; poll < 2; poll++) {
+    // LDH A,($04) / CP $80 / JR NZ, or LDH A,($41) / AND 3 / CP 3 / JR NZ,
+    // then INC B / STOP.
+    uint8_t div[] = {0xF0, 0x04, 0xFE, 0x80, 0x20, 0xFA, 0x04, 0x10, 0x00};
+    uint8_t stat[] = {0xF0, 0x41, 0xE6, 0x03, 0xFE, 0x03, 0x20, 0xF8, 0x04, 0x10, 0x00};
+
+    if(poll)
+      fillMemory(sizeof(stat), stat);
+    else
+      fillMemory(sizeof(div), div);
+    for(int pass = 0; pass < 2; pass++) {
+      loopIdioms = !pass;
+      CPUStateInit();
+      if(poll)
+        writeMem(0xFF40, 0x91);
+      cycles[pass] = runFor(100000);
+      regs[pass][0] = BC();
+      regs[pass][1] = holdPC();
+      writeMem(0xFF40, 0x00);
+    }
+    loopIdioms = 1;
+    assert(cycles[0] == cycles[1] && regs[0][0] == regs[1][0] && regs[0][1] == regs[1][1]);
+    assert(regs[0][0] == 0x0100);
+  }
+
+  {
+    // IE = VBlank, LCD on, EI, then copy $2000 bytes to $C000. The
+    // interrupt counts itself in $FF80.
+    uint8_t copy[] = {0x3E, 0x01, 0xE0, 0xFF, 0xAF, 0xE0, 0x0F, 0x3E, 0x91, 0xE0, 0x40, 0xFB,
+      0x21, 0x00, 0x00, 0x11, 0x00, 0xC0, 0x01, 0x00, 0x20,
+      0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8, 0x10, 0x00};
+    uint8_t vblank[] = {0xF5, 0xF0, 0x80, 0x3C, 0xE0, 0x80, 0xF1, 0xD9};
+    uint8_t counted[2];
+
+    fillMemory(sizeof(copy), copy);
+    for(int i = 0; i < sizeof(vblank); i++)
+      writeMem(0x40 + i, vblank[i]);
+    for(int pass = 0; pass < 2; pass++) {
+      loopIdioms = !pass;
+      writeMem(0xFF80, 0);
+      CPU();
+      cycles[pass] = gb->cycles;
+      regs[pass][0] = AF(); regs[pass][1] = BC(); regs[pass][2] = DE(); regs[pass][3] = HL();
+      counted[pass] = readMem(0xFF80);
+      writeMem(0xFF40, 0x00);
+      writeMem(0xFFFF, 0x00);
+    }
+    loopIdioms = 1;
+    assert(cycles[0] == cycles[1] && counted[0] == counted[1] && counted[0] >= 5);
+    assert(memcmp(regs[0], regs[1], 4 * sizeof(regs[0][0])) == 0);
+  }
+  printf("PASSED testLoopIdioms\n");
+}
+
+// Runs one instruction and counts its cycles.
+void step() {
+  int cycles;
+
+  execute(readMem(PC()), &cycles);
+  gb->cycles += cycles;
+}
+
+// HALT wakes at once on a pending interrupt, sleeps until the next event
+// and powers off when nothing is scheduled. Spin loops skip to the next
+// event the same way, but with nothing scheduled just go on running.
+void testHalt() {
+  uint8_t instrs[] = {
+    0x3E, 0x04, 0xE0, 0xFF, 0xE0, 0x0F, // IE = IF = timer
+    0x76, 0x04,                         // HALT / INC B
+    0xAF, 0xE0, 0x0F,                   // IF = 0
+    0x76, 0x04,                         // HALT / INC B
+    0x10, 0x00};
+  uint8_t spin[] = {0xF0, 0x80, 0xFE, 0x42, 0x20, 0xFA}; // poll $FF80 for $42
+  uint64_t cycles;
+
+  fillMemory(sizeof(instrs), instrs);
+  CPU();
+  assert(B() == 1);
+  assert(holdPC() == 0x10C);
+
+  CPUStateInit();
+  gb->nextEvent = 1000;
+  while(holdPC() != 0x10B)
+    step();
+  step();
+  assert(holdPC() == 0x10B && gb->cycles == 1000 && !halted());
+
+  fillMemory(sizeof(spin), spin);
+  writeMem(0xFF80, 0);
+  CPUStateInit();
+  gb->nextEvent = 5000;
+  for(int i = 0; i < 3; i++)
+    step();
+  assert(holdPC() == 0x100 && gb->cycles <= 5000 && gb->cycles > 5000 - 32);
+  assert(A() == 0 && !Zflag() && !halted());
+  gb->nextEvent = EVENT_NEVER;
+  cycles = gb->cycles;
+  for(int i = 0; i < 3; i++)
+    step();
+  assert(!halted() && holdPC() == 0x100 && gb->cycles == cycles + 32);
+  printf("PASSED testHalt\n");
+}
+
+// 16-bit accesses are little-endian, also across a page boundary, echo RAM
+// mirrors work RAM and instructions are fetched whole.
+void testMemoryMap() {
+  writeMem16(0xC0FF, 0x1234);
+  assert(readMem(0xC0FF) == 0x34 && readMem(0xC100) == 0x12);
+  assert(readMem16(0xC0FF) == 0x1234);
+  writeMem16(0xFF80, 0xBEEF);
+  assert(readMem(0xFF80) == 0xEF && readMem16(0xFF80) == 0xBEEF);
+
+  writeMem(0xE123, 0x56);
+  assert(readMem(0xC123) == 0x56);
+  writeMem(0xC124, 0x78);
+  assert(readMem(0xE124) == 0x78);
+
+  // LD BC, 0xABCD across the end of a page, then in the middle of one.
+  writeMem(0xC1FE, 0x01);
+  writeMem16(0xC1FF, 0xABCD);
+  assert(fetchInstruction(0xC1FE) == 0xABCD01);
+  writeMem(0xC210, 0x01);
+  writeMem16(0xC211, 0xABCD);
+  assert(fetchInstruction(0xC210) == 0xABCD01);
+  printf("PASSED testMemoryMap\n");
+}
+
+// An MBC1 cartridge with 8 ROM banks and 8K of RAM. Each bank starts with
+// its number. Switches to bank 3 from code running in bank 0.
+void testCartridge() {
+  static uint8_t rom[8 * 0x4000];
+  uint8_t program[] = {0x3E, 0x03, 0xEA, 0x00, 0x20, 0xFA, 0x01, 0x40, 0x10};
+  char path[] = "/tmp/testromXXXXXX", mbc5[] = "/tmp/testromXXXXXX";
+  int fd = mkstemp(path);
+
+  for(int bank = 0; bank < 8; bank++) {
+    rom[bank * 0x4000] = bank;
+    rom[bank * 0x4000 + 1] = bank * 0x11;
+  }
+  memcpy(rom + 0x100, program, sizeof(program));
+  rom[0x147] = 0x03;
+  rom[0x149] = 0x02;
+  assert(fd >= 0 && write(fd, rom, sizeof(rom)) == sizeof(rom));
+  close(fd);
+  assert(cartLoad(path));
+  unlink(path);
+
+  assert(readMem(0x4000) == 1);
+  writeMem(0x2000, 5);
+  assert(readMem(0x4000) == 5);
+  writeMem(0x2000, 0);
+  assert(readMem(0x4000) == 1);
+  writeMem(0x0150, 0x00);
+  assert(readMem(0x0150) == 0);
+
+  assert(readMem(0xA000) == 0xFF);
+  writeMem(0x0000, 0x0A);
+  writeMem(0xA000, 0x42);
+  assert(readMem(0xA000) == 0x42);
+  writeMem(0x0000, 0x00);
+  assert(readMem(0xA000) == 0xFF);
+
+  CPU();
+  assert(A() == 0x33 && readMem(0x4000) == 3);
+
+  cartFree();
+  writeMem(0x4000, 7);
+  assert(readMem(0x4000) == 7);
+
+  // MBC5 with 128K of RAM, all 16 banks of which map.
+  rom[0x147] = 0x1A;
+  rom[0x149] = 0x04;
+  fd = mkstemp(mbc5);
+  assert(fd >= 0 && write(fd, rom, sizeof(rom)) == sizeof(rom));
+  close(fd);
+  assert(cartLoad(mbc5));
+  unlink(mbc5);
+  writeMem(0x0000, 0x0A);
+  for(int bank = 0; bank < 16; bank++) {
+    writeMem(0x4000, bank);
+    writeMem(0xA000, 0x80 | bank);
+  }
+  for(int bank = 0; bank < 16; bank++) {
+    writeMem(0x4000, bank);
+    assert(readMem(0xA000) == (0x80 | bank));
+  }
+  cartFree();
+  printf("PASSED testCartridge\n");
+}
+
+static int eventCount;
+static uint64_t eventTimes[3];
+
+// Runs three times, 1000 cycles apart.
+void countEvent(uint64_t at) {
+  assert(gb->cycles >= at && gb->cycles < at + 16);
+  eventTimes[eventCount++] = at;
+  if(eventCount < 3)
+    scheduleEvent(EVENT_SERIAL, at + 1000, countEvent);
+}
+
+// Events run on time while the CPU runs in slices of cycles and frames.
+// NOP
+// JR -3
+void testScheduler() {
+  uint8_t instrs[] = {0x00, 0x18, 0xFD};
+  uint64_t ran;
+
+  fillMemory(3, instrs);
+  CPUStateInit();
+  scheduleEvent(EVENT_SERIAL, 1000, countEvent);
+  ran = runFor(3500);
+  assert(eventCount == 3 && eventTimes[0] == 1000 && eventTimes[2] == 3000);
+  assert(ran == gb->cycles && ran >= 3500 && ran < 3500 + 16);
+
+  runFrame();
+  assert(gb->cycles >= FRAME_CYCLES && gb->cycles < FRAME_CYCLES + 16);
+  ran = runFrame();
+  assert(gb->cycles >= 2 * FRAME_CYCLES && gb->cycles < 2 * FRAME_CYCLES + 16);
+  assert(ran <= FRAME_CYCLES && !halted());
+  printf("PASSED testScheduler\n");
+}
+
+// DIV and TIMA follow gb->cycles, TIMA overflows into TMA and IF 4 cycles
+// late, and resetting DIV or stopping the timer while the watched bit is set
+// counts an extra edge. Then HALT sleeps until the timer interrupt.
+// LD A, 0x04
+// LDH (0xFF), A
+// LD A, 0x05
+// LDH (0x07), A
+// HALT
+// STOP
+void testTimer() {
+  uint8_t instrs[] = {0x3E, 0x04, 0xE0, 0xFF, 0x3E, 0x05, 0xE0, 0x07, 0x76, 0x10};
+
+  CPUStateInit();
+  writeMem(0xFF0F, 0);
+  gb->cycles = 1000;
+  assert(readMem(0xFF04) == 3);
+  writeMem(0xFF04, 0);
+  gb->cycles = 1512;
+  assert(readMem(0xFF04) == 2);
+
+  gb->cycles = 2000;
+  writeMem(0xFF04, 0);
+  writeMem(0xFF07, 0x05);
+  gb->cycles = 2160;
+  assert(readMem(0xFF05) == 10);
+  writeMem(0xFF06, 0xE0);
+  writeMem(0xFF05, 0xFE);
+  gb->cycles = 2194;
+  assert(readMem(0xFF05) == 0 && !(readMem(0xFF0F) & 0x04));
+  gb->cycles = 2196;
+  assert(readMem(0xFF05) == 0xE0 && (readMem(0xFF0F) & 0x04));
+  assert(gb->eventAt[EVENT_TIMER] == 2192 + 32 * 16 + 4);
+
+  gb->cycles = 2460;
+  writeMem(0xFF04, 0);
+  assert(readMem(0xFF05) == 0xE0 + 16 + 1);
+  gb->cycles = 2468;
+  writeMem(0xFF07, 0x00);
+  assert(readMem(0xFF05) == 0xE0 + 16 + 2);
+  assert(gb->eventAt[EVENT_TIMER] == EVENT_NEVER);
+
+  fillMemory(sizeof(instrs), instrs);
+  writeMem(0xFF0F, 0);
+  CPU();
+  assert(halted() && (readMem(0xFF0F) & 0x04));
+  assert(gb->cycles >= 256 * 16 && gb->cycles < 257 * 16 + 64);
+  writeMem(0xFF07, 0x00);
+  writeMem(0xFFFF, 0x00);
+  writeMem(0xFF0F, 0x00);
+  printf("PASSED testTimer\n");
+}
+
+// The CPU takes an interrupt one instruction after EI and not at all after
+// EI then DI. HALT returns past itself from the interrupt that wakes it,
+// and the pending interrupts only change with IE, IF and IME.
+// LD SP, 0xDFF0
+// EI
+// INC A
+// JR -3
+void testInterrupts() {
+  uint8_t delayed[] = {0x31, 0xF0, 0xDF, 0xFB, 0x3C, 0x18, 0xFD};
+  uint8_t cancelled[] = {0x31, 0xF0, 0xDF, 0xFB, 0xF3, 0x10, 0x00};
+  uint8_t halt[] = {0x31, 0xF0, 0xDF, 0x3E, 0x05, 0xE0, 0x07, 0xFB, 0x76, 0x10, 0x00};
+  uint8_t handler[] = {0x04, 0xD9}; // INC B / RETI
+  uint16_t ret;
+
+  CPUStateInit();
+  writeMem(0xFFFF, INT_TIMER);
+  setIME(1);
+  assert(gb->interrupts == 0);
+  writeMem(0xFF0F, INT_TIMER);
+  assert(gb->interrupts == INT_TIMER && gb->nextEvent == 0);
+  setIME(0);
+  assert(gb->interrupts == 0);
+
+  fillMemory(sizeof(delayed), delayed);
+  writeMem(0x50, 0x10);
+  CPU();
+  ret = readMem16(0xDFEE);
+  assert(halted() && A() == 1 && SP() == 0xDFEE && ret == 0x105);
+  assert(!IME() && !(readMem(0xFF0F) & INT_TIMER));
+
+  fillMemory(sizeof(cancelled), cancelled);
+  writeMem(0xFF0F, INT_TIMER);
+  CPU();
+  assert(halted() && SP() == 0xDFF0 && !IME() && (readMem(0xFF0F) & INT_TIMER));
+
+  fillMemory(sizeof(halt), halt);
+  writeMem(0x50, handler[0]);
+  writeMem(0x51, handler[1]);
+  writeMem(0xFF0F, 0);
+  CPU();
+  assert(halted() && B() == 1 && readMem16(0xDFEE) == 0x109 && SP() == 0xDFF0);
+  assert(!gb->cpu.waiting && gb->cycles >= 256 * 16);
+
+  writeMem(0xFF07, 0x00);
+  writeMem(0xFFFF, 0x00);
+  writeMem(0xFF0F, 0x00);
+  printf("PASSED testInterrupts\n");
+}
+
+// OAM DMA copies at once and locks OAM until its event, a general purpose
+// HDMA copies at once and stalls the CPU, and an HBlank HDMA copies a block
+// per HBlank, none in VBlank, until it runs out or is stopped.
+void testDMA() {
+  for(int i = 0; i < 0x200; i++)
+    writeMem(0xC000 + i, i * 7);
+  writeMem(0xFF40, 0x80);
+  CPUStateInit();
+  gb->cycles = 100;
+  writeMem(0xFF46, 0xC0);
+  assert(readMem(0xFE00) == 0xFF && readMem(0xFF46) == 0xC0);
+  writeMem(0xFE01, 0);
+  assert(gb->eventAt[EVENT_DMA] == 100 + 640);
+  gb->cycles = 740;
+  runEvents();
+  assert(readMem(0xFE01) == 7 && readMem(0xFE9F) == (uint8_t) (159 * 7));
+
+  writeMem(0xFF51, 0xC1);
+  writeMem(0xFF52, 0x00);
+  writeMem(0xFF53, 0x80);
+  writeMem(0xFF54, 0x10);
+  gb->cycles = 1000;
+  writeMem(0xFF55, 0x01);
+  assert(readMem(0x8010) == (uint8_t) (0x100 * 7) && readMem(0x802F) == (uint8_t) (0x11F * 7));
+  assert(gb->cycles == 1000 + 64 && readMem(0xFF55) == 0xFF);
+
+  gb->cycles = 10 * 456 + 100;
+  runEvents();
+  writeMem(0xFF55, 0x81);
+  assert(readMem(0xFF55) == 0x01 && readMem(0x8030) == 0);
+  gb->cycles = 10 * 456 + 252;
+  runEvents();
+  assert(readMem(0x8030) == (uint8_t) (0x120 * 7) && readMem(0x8040) == 0);
+  assert(gb->cycles == 10 * 456 + 252 + 32 && readMem(0xFF55) == 0x00);
+  gb->cycles = 11 * 456 + 252;
+  runEvents();
+  assert(readMem(0x8040) == (uint8_t) (0x130 * 7) && readMem(0xFF55) == 0xFF);
+
+  gb->cycles = 143 * 456 + 300;
+  runEvents();
+  writeMem(0xFF55, 0x85);
+  gb->cycles = FRAME_CYCLES;
+  runEvents();
+  assert(readMem(0xFF55) == 0x85 - 0x80);
+  writeMem(0xFF55, 0x00);
+  assert(readMem(0xFF55) == 0x85);
+  writeMem(0xFF40, 0x00);
+  printf("PASSED testDMA\n");
+}
+
+// Lines are drawn from decoded tiles at HBlank, with objects over or
+// behind the background and the window on top. Writing a tile's bytes
+// decodes it again and other VRAM writes leave it alone. LY and STAT follow
+// gb->cycles and VBlank raises its interrupt.
+void testPPU() {
+  uint8_t* line = gb->video->frame[0];
+  uint64_t frames;
+
+  fillMem(0x8000, 0, 0x2000);
+  fillMem(0xFE00, 0, 0xA0);
+  writeMem(0x8010, 0xFF); // Tile 1 row 0: colour 1
+  writeMem(0x8021, 0xFF); // Tile 2 row 0: colour 2
+  writeMem(0x9800, 1);
+  writeMem(0xFE00, 16);
+  writeMem(0xFE01, 8 + 4);
+  writeMem(0xFE02, 2);
+  writeMem(0xFF47, 0xE4);
+  writeMem(0xFF48, 0xE4);
+  writeMem(0xFF0F, 0);
+  writeMem(0xFF40, 0x93);
+  CPUStateInit();
+  frames = gb->ppu.frames;
+
+  gb->cycles = 252;
+  runEvents();
+  assert(line[0] == 1 && line[3] == 1 && line[4] == 2 && line[11] == 2 && line[12] == 0);
+  assert(gb->video->tileValid[1] && !(readMem(0xFF0F) & INT_VBLANK));
+
+  writeMem(0xFE03, 0x80);
+  writeMem(0x9801, 0);
+  assert(gb->video->tileValid[1]);
+  writeMem(0x8011, 0xFF);
+  assert(!gb->video->tileValid[1]);
+  gb->cycles = FRAME_CYCLES + 252;
+  runEvents();
+  assert(gb->ppu.frames == frames + 1 && (readMem(0xFF0F) & INT_VBLANK));
+  assert(line[0] == 3 && line[4] == 3 && line[8] == 2 && line[12] == 0);
+
+  writeMem(0xFF4A, 0);
+  writeMem(0xFF4B, 7 + 80);
+  writeMem(0xFF40, 0x93 | 0x20);
+  gb->cycles = 2 * FRAME_CYCLES + 252;
+  runEvents();
+  assert(line[79] == 0 && line[80] == 3 && line[87] == 3 && line[88] == 0);
+
+  gb->cycles = 2 * FRAME_CYCLES + 10 * 456 + 100;
+  assert(readMem(0xFF44) == 10 && (readMem(0xFF41) & 3) == 3);
+  writeMem(0xFF40, 0x00);
+  assert(readMem(0xFF44) == 0 && gb->eventAt[EVENT_PPU] == EVENT_NEVER);
+  writeMem(0xFF0F, 0);
+  printf("PASSED testPPU\n");
+}
+
+// Runs three frames of a program that rewrites VRAM, scrolls and moves an
+// object all the time, and copies out the last frame.
+// LD HL, 0x8000
+// loop: LD (HL+), A
+// RES 5, H
+// INC A
+// LDH (0x43), A
+// LD (0xFE05), A
+// JR loop
+void renderFrames(int threaded, uint8_t* frame) {
+  uint8_t instrs[] = {0x21, 0x00, 0x80, 0x22, 0xCB, 0xAC, 0x3C, 0xE0, 0x43, 0xEA, 0x05, 0xFE,
+    0x18, 0xF5};
+
+  fillMemory(sizeof(instrs), instrs);
+  fillMem(0x8000, 0, 0x2000);
+  fillMem(0xFE00, 0, 0xA0);
+  writeMem(0xFE04, 40);
+  writeMem(0xFE06, 1);
+  writeMem(0xFF47, 0xE4);
+  writeMem(0xFF48, 0x1B);
+  writeMem(0xFF4A, 50);
+  writeMem(0xFF4B, 60);
+  writeMem(0xFF40, 0xF3);
+  if(threaded)
+    startRenderThread();
+  CPUStateInit();
+  runFor(3 * FRAME_CYCLES);
+  memcpy(frame, ppuFrame(), SCREEN_WIDTH * SCREEN_HEIGHT);
+  stopRenderThread();
+  writeMem(0xFF40, 0x00);
+  writeMem(0xFF0F, 0x00);
+}
+
+// Frames drawn on the render thread are the same as those drawn inline.
+void testRenderThread() {
+  static uint8_t inline_[SCREEN_WIDTH * SCREEN_HEIGHT], threaded[SCREEN_WIDTH * SCREEN_HEIGHT];
+  int differ = 0;
+
+  renderFrames(0, inline_);
+  renderFrames(1, threaded);
+  for(int i = 1; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+    differ |= inline_[i] != inline_[0];
+  assert(differ && !memcmp(inline_, threaded, sizeof(inline_)));
+  printf("PASSED testRenderThread\n");
+}
+
+// Skipped frames leave the last frame drawn in place but still raise
+// VBlank. Every other frame is drawn, then only the one asked for.
+// JR -2
+void testRenderPolicy() {
+  uint8_t instrs[] = {0x18, 0xFE};
+  uint64_t first;
+  int last;
+
+  fillMemory(sizeof(instrs), instrs);
+  fillMem(0x8000, 0, 0x2000);
+  writeMem(0xFF40, 0x91);
+  ppuSetRenderPolicy(RENDER_EVERY, 2);
+  CPUStateInit();
+  first = gb->ppu.frames;
+  last = ppuFrame()[0];
+  for(int k = 0; k < 4; k++) {
+    writeMem(0xFF47, k);
+    writeMem(0xFF0F, 0);
+    runFrame();
+    if((first + k) % 2 == 0)
+      last = k;
+    assert(ppuFrame()[0] == last && (readMem(0xFF0F) & INT_VBLANK));
+  }
+
+  ppuSetRenderPolicy(RENDER_ON_DEMAND, 0);
+  writeMem(0xFF47, 1);
+  runFrame();
+  assert(ppuFrame()[0] == last);
+  ppuRequestFrame();
+  runFrame();
+  assert(ppuFrame()[0] == 1);
+  writeMem(0xFF47, 2);
+  runFrame();
+  assert(ppuFrame()[0] == 1);
+
+  ppuSetRenderPolicy(RENDER_ALWAYS, 0);
+  writeMem(0xFF40, 0x00);
+  writeMem(0xFF0F, 0x00);
+  printf("PASSED testRenderPolicy\n");
+}
+
+// Converts and scales a width by height image of shades every way, into
+// out one after another.
+void outputAll(const uint8_t* shades, int width, int height, uint32_t* out) {
+  int pixels = width * height;
+  uint32_t* next = out + pixels;
+
+  outputConvert(shades, out, pixels, outputGreys);
+  for(int scale = 2; scale <= 4; scale++) {
+    outputScale(out, width, height, scale, next);
+    next += scale * scale * pixels;
+  }
+  outputScale2x(out, width, height, next);
+}
+
+// Each level of kernels gives the same pixels as the scalar code, on a
+// frame and on an image too narrow for them. Scale2x rounds off the corner
+// of a white pixel against black.
+void testOutput() {
+  static uint8_t shades[SCREEN_WIDTH * SCREEN_HEIGHT];
+  static uint32_t expected[34 * SCREEN_WIDTH * SCREEN_HEIGHT], got[34 * SCREEN_WIDTH * SCREEN_HEIGHT];
+  uint8_t corner[] = {0, 3, 3, 3};
+  uint32_t w = outputGreys[0], k = outputGreys[3];
+  uint32_t rounded[] = {w, w, k, k, w, k, k, k, k, k, k, k, k, k, k, k};
+  int best = outputSetLevel(OUTPUT_AVX2);
+
+  for(int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+    shades[i] = rand() % 4;
+  for(int size = 0; size < 2; size++) {
+    int width = size ? SCREEN_WIDTH : 13, height = size ? SCREEN_HEIGHT : 5;
+
+    outputSetLevel(OUTPUT_SCALAR);
+    outputAll(shades, width, height, expected);
+    for(int level = OUTPUT_SSE2; level <= best; level++) {
+      outputSetLevel(level);
+      outputAll(shades, width, height, got);
+      assert(!memcmp(got, expected, 34 * width * height * sizeof(uint32_t)));
+    }
+  }
+
+  for(int level = OUTPUT_SCALAR; level <= best; level++) {
+    outputSetLevel(level);
+    outputConvert(corner, got, 4, outputGreys);
+    outputScale2x(got, 2, 2, got + 4);
+    assert(!memcmp(got + 4, rounded, sizeof(rounded)));
+  }
+  outputSetLevel(best);
+  printf("PASSED testOutput\n");
+}
+
+// Plays a 1024 Hz square wave on channel 2 for an eighth of a second at
+// rate and takes the samples it made.
+// JR -2
+int playTone(int rate, int16_t* samples) {
+  uint8_t instrs[] = {0x18, 0xFE};
+
+  fillMemory(sizeof(instrs), instrs);
+  CPUStateInit();
+  apuSetRate(rate);
+  writeMem(0xFF25, 0x22);
+  writeMem(0xFF16, 0x80);
+  writeMem(0xFF17, 0xF0);
+  writeMem(0xFF18, 0x80);
+  writeMem(0xFF19, 0x87);
+  assert(readMem(0xFF26) == 0xF2);
+  runFor(APU_CLOCK / 8);
+  apuUpdate();
+  return apuReadSamples(samples, 16384);
+}
+
+// The tone comes out at the right pitch at each rate once it has settled,
+// 128 crossings of 0 in its second half, and the same every time. A
+// length counter stops a channel and turning the sound off clears
+// and locks the registers.
+void testAPU() {
+  static int16_t first[2 * 16384], second[2 * 16384];
+  int rates[] = {48000, 22050};
+
+  for(int i = 0; i < 2; i++) {
+    int count = playTone(rates[i], first), crossings = 0, peak = 0;
+
+    assert(count == (APU_CLOCK / 8) * (uint64_t) rates[i] / APU_CLOCK);
+    for(int j = 1; j < count; j++) {
+      if(j > count / 2 && (first[2 * j] < 0) != (first[2 * j - 2] < 0))
+        crossings++;
+      if(abs(first[2 * j]) > peak)
+        peak = abs(first[2 * j]);
+      assert(first[2 * j] == first[2 * j + 1]);
+    }
+    assert(crossings >= 127 && crossings <= 129 && peak > 1500);
+  }
+  assert(playTone(48000, first) == 6000 && playTone(48000, second) == 6000);
+  assert(!memcmp(first, second, sizeof(int16_t) * 2 * 6000));
+
+  writeMem(0xFF16, 0x80 | 63);
+  writeMem(0xFF19, 0xC7);
+  assert(readMem(0xFF26) == 0xF2);
+  runFrame();
+  assert(readMem(0xFF26) == 0xF0);
+
+  writeMem(0xFF26, 0x00);
+  assert(readMem(0xFF26) == 0x70 && readMem(0xFF25) == 0x00);
+  writeMem(0xFF25, 0xFF);
+  assert(readMem(0xFF25) == 0x00);
+  writeMem(0xFF26, 0x80);
+  printf("PASSED testAPU\n");
+}
+
+// Starts the program renderFrames() runs, with the timer and a tone
+// going as well, counting frames from 0. stopBusy() turns them all off
+// again.
+void startBusy() {
+  uint8_t instrs[] = {0x21, 0x00, 0x80, 0x22, 0xCB, 0xAC, 0x3C, 0xE0, 0x43, 0xEA, 0x05, 0xFE,
+    0x18, 0xF5};
+
+  fillMemory(sizeof(instrs), instrs);
+  writeMem(0xFE04, 40);
+  writeMem(0xFF47, 0xE4);
+  writeMem(0xFF40, 0xF3);
+  CPUStateInit();
+  gb->ppu.frames = 0;
+  writeMem(0xFF07, 0x05);
+  writeMem(0xFF17, 0xF0);
+  writeMem(0xFF19, 0x87);
+}
+
+void stopBusy() {
+  writeMem(0xFF40, 0x00);
+  writeMem(0xFF0F, 0x00);
+  writeMem(0xFF07, 0x00);
+}
+
+// A state saved mid-frame with the LCD, the timer and a tone running
+// carries on exactly as the machine it was saved from did, to the pixel.
+// States that are too big for the buffer or of another version are
+// refused, and one saved to a file loads back.
+void testSaveState() {
+  static uint8_t start[1 << 17], ran[1 << 17], rerun[1 << 17];
+  static uint8_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+  char path[] = "/tmp/teststateXXXXXX";
+  size_t size = stateSize();
+  uint64_t cycles;
+
+  assert(size <= sizeof(start));
+  startBusy();
+  runFor(FRAME_CYCLES + FRAME_CYCLES / 2);
+
+  assert(stateSave(start, size) == size);
+  runFor(2 * FRAME_CYCLES);
+  memcpy(frame, ppuFrame(), sizeof(frame));
+  assert(stateSave(ran, size) == size);
+  assert(stateLoad(start, size));
+  runFor(2 * FRAME_CYCLES);
+  assert(stateSave(rerun, size) == size);
+  assert(!memcmp(ran, rerun, size) && !memcmp(frame, ppuFrame(), sizeof(frame)));
+
+  cycles = gb->cycles;
+  assert(stateSave(rerun, size - 1) == 0);
+  memcpy(rerun, start, size);
+  rerun[4]++;
+  assert(!stateLoad(rerun, size) && !stateLoad(start, size - 1));
+  assert(gb->cycles == cycles);
+
+  close(mkstemp(path));
+  assert(stateSaveFile(path));
+  runFrame();
+  assert(stateLoadFile(path));
+  unlink(path);
+  assert(gb->cycles == cycles && stateSave(rerun, size) == size && !memcmp(ran, rerun, size));
+
+  // Only the tiles a load changes have to be decoded again.
+  writeMem(0x8010, readMem(0x8010) + 1);
+  gb->video->tileValid[0] = gb->video->tileValid[1] = 1;
+  assert(stateLoad(rerun, size));
+  assert(gb->video->tileValid[0] && !gb->video->tileValid[1]);
+  stopBusy();
+  printf("PASSED testSaveState\n");
+}
+
+// Going back gets each frame exactly, whether it was kept as a keyframe
+// or a delta, and history goes on from there. A budget too small for a
+// few frames is refused, and a small one keeps the newest frames whole
+// keyframes at a time.
+void testRewind() {
+  static uint8_t states[12][1 << 17], state[1 << 17];
+  size_t size = stateSize();
+  int held;
+
+  assert(!rewindStart(size, 4) && rewindStart(64 << 20, 4));
+  startBusy();
+  for(int i = 0; i < 12; i++) {
+    runFrame();
+    rewindCapture();
+    stateSave(states[i], size);
+  }
+  assert(rewindFrames() == 12);
+  assert(rewindSeek(1) && stateSave(state, size) && !memcmp(state, states[10], size));
+  assert(rewindSeek(4) && stateSave(state, size) && !memcmp(state, states[6], size));
+  assert(rewindSeek(5) && stateSave(state, size) && !memcmp(state, states[1], size));
+  assert(rewindFrames() == 2 && !rewindSeek(2));
+  runFrame();
+  rewindCapture();
+  runFrame();
+  rewindCapture();
+  assert(rewindSeek(1) && stateSave(state, size) && !memcmp(state, states[2], size));
+
+  assert(rewindStart(2 << 20, 4));
+  for(int i = 0; i < 300; i++) {
+    runFrame();
+    rewindCapture();
+  }
+  held = rewindFrames();
+  assert(held > 4 && held < 300 && rewindStored() < (2 << 20));
+  assert(!rewindSeek(held) && rewindSeek(held - 1));
+  assert(gb->cycles / FRAME_CYCLES == 300 - held + 4);
+  rewindStop();
+  stopBusy();
+  printf("PASSED testRewind\n");
+}
+
+// P1 reads the keys of the groups it selects, and pressing one of those
+// requests the joypad interrupt.
+void testJoypad() {
+  writeMem(0xFF0F, 0x00);
+  writeMem(0xFF00, 0x20);
+  joypadSet(JOYPAD_LEFT | JOYPAD_A);
+  assert(readMem(0xFF00) == 0xED && (readMem(0xFF0F) & INT_JOYPAD));
+  writeMem(0xFF00, 0x10);
+  assert(readMem(0xFF00) == 0xDE);
+  writeMem(0xFF00, 0x30);
+  assert(readMem(0xFF00) == 0xFF);
+
+  writeMem(0xFF0F, 0x00);
+  writeMem(0xFF00, 0x20);
+  joypadSet(JOYPAD_LEFT | JOYPAD_A | JOYPAD_B);
+  assert(!(readMem(0xFF0F) & INT_JOYPAD));
+  joypadSet(0);
+  writeMem(0xFF00, 0x00);
+  writeMem(0xFF0F, 0x00);
+  printf("PASSED testJoypad\n");
+}
+
+// Running ahead leaves the machine and its sound just as running the same
+// frames plainly does, but shows the frame that comes frames later.
+void testRunAhead() {
+  static uint8_t plain[1 << 17], ahead[1 << 17];
+  static uint8_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+  static int16_t heard[2 * 16384], played[2 * 16384];
+  size_t size = stateSize();
+
+  for(int frames = 1; frames <= 3; frames++) {
+    int count;
+
+    startBusy();
+    for(int i = 0; i < 5; i++)
+      runFrame();
+    stateSave(plain, size);
+    count = apuReadSamples(heard, 16384);
+    for(int i = 0; i < frames; i++)
+      runFrame();
+    memcpy(frame, ppuFrame(), sizeof(frame));
+
+    startBusy();
+    for(int i = 0; i < 5; i++)
+      runAhead(frames);
+    stateSave(ahead, size);
+    assert(!memcmp(plain, ahead, size) && !memcmp(frame, ppuFrame(), sizeof(frame)));
+    assert(apuReadSamples(played, 16384) == count && !memcmp(heard, played, count * 2 * sizeof(int16_t)));
+    assert(gb->ppu.renderPolicy == RENDER_ALWAYS);
+  }
+  stopBusy();
+  printf("PASSED testRunAhead\n");
+}
+
+// Writes stamp the state pages they land in, through the echo, in bulk or
+// in VRAM alike, each epoch again, and the 0xFF page always counts as
+// written.
+void testDirtyPages() {
+  uint16_t pages[STATE_PAGES];
+  uint16_t written[] = {0xC1, 0xC2, 0xC3, 0xC5, 0xFF, PAGES_VRAM};
+  uint32_t since = newEpoch();
+
+  assert(dirtyPages(since, pages) == 1 && pages[0] == 0xFF);
+  writeMem(0xC123, 1);
+  writeMem(0xE234, 2);
+  writeMem16(0xC310, 3);
+  copyMem(0xC500, 0xC100, 16);
+  writeMem(0x8000, 4);
+  assert(dirtyPages(since, pages) == 6 && !memcmp(pages, written, sizeof(written)));
+  assert(dirtyPages(newEpoch(), pages) == 1);
+
+  // Pages written last epoch are stamped again by their first write.
+  since = newEpoch();
+  writeMem(0xC124, 5);
+  writeMem(0xC125, 6);
+  fillMem(0xC500, 7, 8);
+  assert(dirtyPages(since, pages) == 3 && pages[0] == 0xC1 && pages[1] == 0xC5);
+  dirtyAll();
+  assert(dirtyPages(since, pages) == STATE_PAGES);
+  printf("PASSED testDirtyPages\n");
+}
+
+// The hash kept up a page at a time equals one of everything, follows a
+// change to memory or to a device and back, and comes out the same for
+// the same state however it was reached.
+void testStateHash() {
+  static uint8_t start[1 << 17];
+  size_t size = stateSize();
+  uint64_t hash, ran;
+  uint8_t old;
+
+  startBusy();
+  runFrame();
+  stateSave(start, size);
+  hash = stateHash();
+  for(int i = 0; i < 3; i++) {
+    runFrame();
+    ran = stateHash();
+  }
+  dirtyAll();
+  assert(stateHash() == ran && ran != hash);
+
+  old = readMem(0xC456);
+  writeMem(0xC456, old ^ 1);
+  assert(stateHash() != ran);
+  writeMem(0xC456, old);
+  assert(stateHash() == ran);
+  gb->cpu.BC.high ^= 1;
+  assert(stateHash() != ran);
+  gb->cpu.BC.high ^= 1;
+
+  assert(stateLoad(start, size) && stateHash() == hash);
+  for(int i = 0; i < 3; i++)
+    runFrame();
+  assert(stateHash() == ran);
+  stopBusy();
+  printf("PASSED testStateHash\n");
+}
+
+// A replayed movie matches the run it was recorded from, whatever the
+// machine did in between, and one whose keys were changed is caught at
+// the first hash after the change.
+void testMovie() {
+  char path[] = "/tmp/testmovieXXXXXX";
+  uint64_t hash;
+  uint8_t key;
+  FILE* file;
+
+  startBusy();
+  writeMem(0xFF00, 0x20);
+  joypadSet(0);
+  movieRecord(4);
+  for(int frame = 1; frame <= 20; frame++)
+    movieRunFrame(frame >= 7 ? JOYPAD_LEFT : 0);
+  hash = stateHash();
+  close(mkstemp(path));
+  assert(movieSave(path) && movieFrames() == 20);
+  movieStop();
+
+  runFrame();
+  joypadSet(JOYPAD_LEFT);
+  assert(movieLoad(path) && movieFrames() == 20);
+  assert(movieReplay() == 0 && stateHash() == hash);
+
+  // Keys come just before the 5 hashes at the end.
+  file = fopen(path, "r+b");
+  fseek(file, -5 * 8 - 20 + 2, SEEK_END);
+  key = JOYPAD_LEFT;
+  fwrite(&key, 1, 1, file);
+  fclose(file);
+  assert(movieLoad(path) && movieReplay() == 4);
+  unlink(path);
+  movieStop();
+  joypadSet(0);
+  writeMem(0xFF00, 0x00);
+  stopBusy();
+  printf("PASSED testMovie\n");
+}
+
+#ifdef JIT
+// Runs random straight-line programs through the interpreter and through
+// the JIT and checks both end in the same state. The programs leave HL
+// pointing at RAM so that (HL) stores never hit the code.
+void testJIT() {
+  // Opcodes that take no immediate, then opcodes that take a d8.
+  uint8_t plain[] = {
+    0x00, 0x04, 0x05, 0x0C, 0x0D, 0x14, 0x15, 0x1C, 0x1D, 0x3C, 0x3D, 0x03, 0x0B,
+    0x13, 0x1B, 0x0A, 0x1A, 0x34, 0x35, 0x41, 0x48, 0x53, 0x5A, 0x78, 0x7C, 0x7E,
+    0x46, 0x77, 0x70, 0x80, 0x86, 0x91, 0x97, 0xA2, 0xAE, 0xB3, 0xBB, 0xBE, 0x2F,
+    0x37, 0x17, 0x07, 0x27, 0xCB};
+  uint8_t withImm[] = {0x06, 0x0E, 0x16, 0x1E, 0x3E, 0x36, 0xC6, 0xD6, 0xE6, 0xEE,
+    0xF6, 0xFE, 0x20, 0x28, 0x30, 0x38};
+  int interpreted[6], translated[6];
+  uint8_t ram[2][16];
+
+  srand(1);
+  for(int run = 0; run < 200; run++) {
+    uint8_t instrs[128];
+    int n = 0;
+
+    instrs[n++] = 0x01; instrs[n++] = rand(); instrs[n++] = rand(); // LD BC,d16
+    instrs[n++] = 0x11; instrs[n++] = rand(); instrs[n++] = rand(); // LD DE,d16
+    instrs[n++] = 0x21; instrs[n++] = 0x00; instrs[n++] = 0xC0;     // LD HL,$C000
+    instrs[n++] = 0x3E; instrs[n++] = rand();                        // LD A,d8
+    while(n < 120) {
+      if(rand() % 3) {
+        instrs[n++] = plain[rand() % sizeof(plain)];
+        if(instrs[n - 1] == 0xCB)
+          instrs[n++] = 0x37; // SWAP A
+      } else {
+        instrs[n++] = withImm[rand() % sizeof(withImm)];
+        // Conditional JRs skip 0 or 1 bytes of a NOP pair.
+        if(instrs[n - 1] >= 0x20 && instrs[n - 1] <= 0x38 && (instrs[n - 1] & 7) == 0) {
+          instrs[n++] = rand() % 2;
+          instrs[n++] = 0x00;
+          instrs[n++] = 0x00;
+        } else
+          instrs[n++] = rand();
+      }
+    }
+    instrs[n++] = 0x10;
+    instrs[n++] = 0x00;
+
+    for(int pass = 0; pass < 2; pass++) {
+      int* state = pass ? translated : interpreted;
+
+      jitHotness = pass ? 1 : 1 << 30;
+      for(int i = 0; i < 16; i++)
+        writeMem(0xC000 + i, 0);
+      fillMemory(n, instrs);
+      CPU();
+      state[0] = AF(); state[1] = BC(); state[2] = DE(); state[3] = HL();
+      state[4] = SP(); state[5] = holdPC();
+      for(int i = 0; i < 16; i++)
+        ram[pass][i] = readMem(0xC000 + i);
+    }
+    assert(memcmp(interpreted, translated, sizeof(interpreted)) == 0);
+    assert(memcmp(ram[0], ram[1], 16) == 0);
+  }
+  jitHotness = 2;
+  printf("PASSED testJIT\n");
+}
+
+// LD C, 4
+// CALL 0xFF80 (INC B, RET)
+// LDH (0x43), A
+// LDH (0x90), A
+// DEC C
+// JR NZ, -10
+// Writes to SCX and to HRAM that holds no code must leave the translated
+// blocks alone, so they get hot and stay translated. A write to the HRAM
+// routine drops only its own block.
+void testCodeInvalidation() {
+  uint8_t instrs[] = {0x0E, 0x04, 0xCD, 0x80, 0xFF, 0xE0, 0x43, 0xE0, 0x90, 0x0D,
+    0x20, 0xF6, 0x10, 0x00};
+  fillMemory(sizeof(instrs), instrs);
+  writeMem(0xFF80, 0x04);
+  writeMem(0xFF81, 0xC9);
+  CPU();
+  assert(B() == 4);
+  assert(findBlock(0x102)->code && findBlock(0x105)->code);
+  assert(findBlock(0xFF80)->code);
+
+  writeMem(0xFF43, 0x12);
+  writeMem(0xFF90, 0x34);
+  assert(findBlock(0x102)->code && findBlock(0xFF80)->code);
+
+  writeMem(0xFF80, 0x05);
+  assert(!findBlock(0xFF80)->code);
+  assert(findBlock(0x102)->code && findBlock(0x105)->code);
+  printf("PASSED testCodeInvalidation\n");
+}
+#endif
+
 int main() {
   memInit();
   testLD();
   testPUSH();
+  testALU();
+  testCB();
+  testFlags();
+  testSelfModifying();
+  testDisassemble();
+  testTwoMachines();
+  testLoopIdioms();
+  testHalt();
+  testMemoryMap();
+  testCartridge();
+  testScheduler();
+  testTimer();
+  testInterrupts();
+  testDMA();
+  testPPU();
+  testRenderThread();
+  testRenderPolicy();
+  testOutput();
+  testAPU();
+  testSaveState();
+  testRewind();
+  testJoypad();
+  testRunAhead();
+  testDirtyPages();
+  testStateHash();
+  testMovie();
+#ifdef JIT
+  testJIT();
+  testCodeInvalidation();
+#endif
   return 0;
 }
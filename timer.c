@@ -0,0 +1,189 @@
+#include "timer.h"
+#include "interrupt.h"
+#include "machine.h"
+#include "sched.h"
+
+// Cycles between TIMA increments for each TAC clock select. The counter
+// bit that falls is half of it.
+static const int timerPeriods[] = {1024, 16, 64, 256};
+
+static void timerEvent(uint64_t at);
+
+static int timerPeriod()
+{
+	return timerPeriods[gb->timer.tac & 3];
+}
+
+static int timerEnabled()
+{
+	return gb->timer.tac & 4;
+}
+
+// Falling edges of the selected bit after cycle from, up to and including
+// cycle to.
+static uint64_t timerEdges(uint64_t from, uint64_t to)
+{
+	Timer* t = &gb->timer;
+
+	if(!timerEnabled())
+		return 0;
+	return (to - t->divBase) / timerPeriod() - (from - t->divBase) / timerPeriod();
+}
+
+// The cycle of the nth falling edge after cycle from.
+static uint64_t timerEdge(uint64_t from, int n)
+{
+	Timer* t = &gb->timer;
+
+	return t->divBase + ((from - t->divBase) / timerPeriod() + n) * timerPeriod();
+}
+
+// Works TIMA out up to cycle now, running any overflows on the way.
+static void timerSync(uint64_t now)
+{
+	Timer* t = &gb->timer;
+
+	for(;;)
+	{
+		uint64_t edges, wrap;
+
+		if(t->reloadAt <= now)
+		{
+			t->tima = t->tma;
+			t->timaCycle = t->reloadAt;
+			t->reloadAt = EVENT_NEVER;
+			requestInterrupt(INT_TIMER);
+		}
+		// TIMA reads 0 until it is reloaded. Edges are further apart than that.
+		if(t->reloadAt != EVENT_NEVER)
+		{
+			t->timaCycle = now;
+			return;
+		}
+
+		edges = timerEdges(t->timaCycle, now);
+		if(t->tima + edges <= 0xFF)
+		{
+			t->tima += edges;
+			t->timaCycle = now;
+			return;
+		}
+
+		wrap = timerEdge(t->timaCycle, 0x100 - t->tima);
+		t->tima = 0;
+		t->timaCycle = wrap;
+		t->reloadAt = wrap + 4;
+	}
+}
+
+// Schedules the next reload, if TIMA is counting.
+static void timerSchedule()
+{
+	Timer* t = &gb->timer;
+
+	if(t->reloadAt != EVENT_NEVER)
+		scheduleEvent(EVENT_TIMER, t->reloadAt, timerEvent);
+	else if(timerEnabled())
+		scheduleEvent(EVENT_TIMER, timerEdge(t->timaCycle, 0x100 - t->tima) + 4, timerEvent);
+	else
+		cancelEvent(EVENT_TIMER);
+}
+
+static void timerEvent(uint64_t at)
+{
+	timerSync(gb->cycles);
+	timerSchedule();
+}
+
+// One extra edge, from a DIV reset or TAC change at cycle now.
+static void timerTick(uint64_t now)
+{
+	Timer* t = &gb->timer;
+
+	if(t->tima == 0xFF)
+	{
+		t->tima = 0;
+		t->reloadAt = now + 4;
+	}
+	else if(t->reloadAt == EVENT_NEVER)
+		t->tima++;
+}
+
+// 1 if the bit the timer watches is set at cycle now.
+static int timerBit(uint64_t now)
+{
+	return timerEnabled() && ((now - gb->timer.divBase) & (timerPeriod() / 2));
+}
+
+void timerReset()
+{
+	Timer* t = &gb->timer;
+
+	t->divBase = t->timaCycle = gb->cycles;
+	t->reloadAt = EVENT_NEVER;
+	t->tima = t->tma = 0;
+	t->tac = 0xF8;
+	cancelEvent(EVENT_TIMER);
+}
+
+void timerRestore()
+{
+	restoreEvent(EVENT_TIMER, timerEvent);
+}
+
+void timerUpdate()
+{
+	uint64_t reloadAt = gb->timer.reloadAt;
+
+	timerSync(gb->cycles);
+	if(gb->timer.reloadAt != reloadAt)
+		timerSchedule();
+}
+
+uint8_t timerRead(uint16_t address)
+{
+	Timer* t = &gb->timer;
+
+	timerUpdate();
+	switch(address)
+	{
+		case 0xFF04: return (gb->cycles - t->divBase) >> 8;
+		case 0xFF05: return t->tima;
+		case 0xFF06: return t->tma;
+		default: return t->tac;
+	}
+}
+
+void timerWrite(uint16_t address, uint8_t value)
+{
+	Timer* t = &gb->timer;
+	uint64_t now = gb->cycles;
+
+	timerSync(now);
+	switch(address)
+	{
+		case 0xFF04:
+			if(timerBit(now))
+				timerTick(now);
+			t->divBase = now;
+			break;
+		case 0xFF05:
+			// Writing TIMA while it waits to be reloaded cancels the reload.
+			t->tima = value;
+			t->reloadAt = EVENT_NEVER;
+			break;
+		case 0xFF06:
+			t->tma = value;
+			break;
+		default:
+		{
+			int before = timerBit(now);
+
+			t->tac = value | 0xF8;
+			if(before && !timerBit(now))
+				timerTick(now);
+			break;
+		}
+	}
+	timerSchedule();
+}
@@ -0,0 +1,29 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// DIV, TIMA, TMA and TAC (0xFF04-0xFF07). Nothing ticks: the registers
+// are worked out from gb->cycles when they are read or written. DIV is
+// the top byte of a 16-bit counter that started when it was last reset,
+// and TIMA counts the falling edges of the counter bit TAC selects. The
+// only event is TIMA overflowing, which reloads it from TMA and requests
+// the timer interrupt 4 cycles later.
+//
+// Resetting DIV or changing TAC can make the selected bit fall, which
+// counts as an edge like on hardware.
+
+// Power on values.
+void timerReset();
+
+// Reads and writes one of the timer's registers.
+uint8_t timerRead(uint16_t address);
+void timerWrite(uint16_t address, uint8_t value);
+
+// Gives EVENT_TIMER its handler back, after a save state is loaded.
+void timerRestore();
+
+// Brings TIMA and the timer interrupt up to gb->cycles, for reads of IF.
+void timerUpdate();
+
+#endif